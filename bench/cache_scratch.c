@@ -0,0 +1,123 @@
+/****************************************************************************************
+ *
+ * Benchmark : Cache Scratch (Passive False Sharing)
+ *
+ * Description:
+ * - Port of the Hoard cache-scratch benchmark
+ * - The main thread allocates one small object per thread, all next to each other, and
+ *   hands one to each thread. Every thread frees the object it was given and then keeps
+ *   allocating a small object, writing to it many times and freeing it. If the freed
+ *   objects are handed out again to the thread which freed them, the threads end up
+ *   writing to the cache line the main thread allocated them from
+ * - Report the writes per second with 1 up to N threads (8 by default, or the first
+ *   argument), once with hg_malloc and once with glibc malloc, which the -wrap link
+ *   flags still leave reachable as __real_malloc
+ *
+ * Results:
+ * - Expected     -> The throughput should grow with the number of threads as long as
+ *                   there are cores to run them. A flat or falling throughput points at
+ *                   freed objects being reused by a thread other than their owner
+ *
+ ****************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+
+#define ITERATIONS	1000
+#define REPETITIONS	100000
+#define OBJECT_SIZE	8
+
+typedef struct {
+	unsigned int	allocator;
+	unsigned int	threads;
+	void		*object;
+} worker_t;
+
+/* The allocators under test */
+void *__real_malloc(size_t size);
+void __real_free(void *ptr);
+
+static const struct {
+	const char	*name;
+	void		*(*alloc)(size_t);
+	void		(*release)(void *);
+} allocators[] = {
+	{ "hg_malloc",	malloc,		free },
+	{ "glibc",	__real_malloc,	__real_free },
+};
+
+#define ALLOCATORS	(sizeof(allocators) / sizeof(allocators[0]))
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void *worker(void *arg)
+{
+	worker_t	*self = arg;
+	unsigned int	i, j;
+	volatile char	*object;
+
+	allocators[self->allocator].release(self->object);
+
+	for (i = 0; i < ITERATIONS / self->threads; i++) {
+		object = allocators[self->allocator].alloc(OBJECT_SIZE);
+
+		for (j = 0; j < REPETITIONS; j++)
+			object[j % OBJECT_SIZE]++;
+
+		allocators[self->allocator].release((void *)object);
+	}
+
+	return NULL;
+}
+
+static double run(unsigned int allocator, unsigned int threads)
+{
+	pthread_t	tids[threads];
+	worker_t	work[threads];
+	unsigned int	t;
+	double		start;
+
+	/* Objects allocated back to back by one thread share cache lines */
+	for (t = 0; t < threads; t++) {
+		work[t].allocator = allocator;
+		work[t].threads = threads;
+		work[t].object = allocators[allocator].alloc(OBJECT_SIZE);
+	}
+
+	start = now_ns();
+
+	for (t = 0; t < threads; t++)
+		pthread_create(&tids[t], NULL, worker, &work[t]);
+
+	for (t = 0; t < threads; t++)
+		pthread_join(tids[t], NULL);
+
+	return (double)(ITERATIONS / threads) * threads * REPETITIONS / ((now_ns() - start) / 1e9);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int	max_threads = (argc > 1) ? atoi(argv[1]) : 8;
+	unsigned int	threads, allocator;
+	double		ops[ALLOCATORS];
+
+	printf("%8s %16s %16s %8s\n", "Threads", "hg_malloc wr/s", "glibc wr/s", "Ratio");
+
+	for (threads = 1; threads <= max_threads; threads *= 2) {
+		for (allocator = 0; allocator < ALLOCATORS; allocator++)
+			ops[allocator] = run(allocator, threads);
+
+		printf("%8u %16.0f %16.0f %8.2f\n", threads, ops[0], ops[1], ops[0] / ops[1]);
+	}
+
+	return 0;
+}
@@ -0,0 +1,109 @@
+/****************************************************************************************
+ *
+ * Benchmark : Cache Thrash (Active False Sharing)
+ *
+ * Description:
+ * - Port of the Hoard cache-thrash benchmark
+ * - Every thread repeatedly allocates a small object, writes to it many times and frees
+ *   it. If the allocator hands threads objects from the same cache line, the writes of
+ *   one thread keep invalidating the line in the cache of the others
+ * - Report the writes per second with 1 up to N threads (8 by default, or the first
+ *   argument), once with hg_malloc and once with glibc malloc, which the -wrap link
+ *   flags still leave reachable as __real_malloc
+ *
+ * Results:
+ * - Expected     -> The throughput should grow with the number of threads as long as
+ *                   there are cores to run them. A flat or falling throughput points at
+ *                   objects of different threads sharing cache lines
+ *
+ ****************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+
+#define ITERATIONS	1000
+#define REPETITIONS	100000
+#define OBJECT_SIZE	8
+
+typedef struct {
+	unsigned int	allocator;
+	unsigned int	threads;
+} worker_t;
+
+/* The allocators under test */
+void *__real_malloc(size_t size);
+void __real_free(void *ptr);
+
+static const struct {
+	const char	*name;
+	void		*(*alloc)(size_t);
+	void		(*release)(void *);
+} allocators[] = {
+	{ "hg_malloc",	malloc,		free },
+	{ "glibc",	__real_malloc,	__real_free },
+};
+
+#define ALLOCATORS	(sizeof(allocators) / sizeof(allocators[0]))
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void *worker(void *arg)
+{
+	worker_t	*self = arg;
+	unsigned int	i, j;
+	volatile char	*object;
+
+	for (i = 0; i < ITERATIONS / self->threads; i++) {
+		object = allocators[self->allocator].alloc(OBJECT_SIZE);
+
+		for (j = 0; j < REPETITIONS; j++)
+			object[j % OBJECT_SIZE]++;
+
+		allocators[self->allocator].release((void *)object);
+	}
+
+	return NULL;
+}
+
+static double run(unsigned int allocator, unsigned int threads)
+{
+	pthread_t	tids[threads];
+	worker_t	work = { allocator, threads };
+	unsigned int	t;
+	double		start = now_ns();
+
+	for (t = 0; t < threads; t++)
+		pthread_create(&tids[t], NULL, worker, &work);
+
+	for (t = 0; t < threads; t++)
+		pthread_join(tids[t], NULL);
+
+	return (double)(ITERATIONS / threads) * threads * REPETITIONS / ((now_ns() - start) / 1e9);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int	max_threads = (argc > 1) ? atoi(argv[1]) : 8;
+	unsigned int	threads, allocator;
+	double		ops[ALLOCATORS];
+
+	printf("%8s %16s %16s %8s\n", "Threads", "hg_malloc wr/s", "glibc wr/s", "Ratio");
+
+	for (threads = 1; threads <= max_threads; threads *= 2) {
+		for (allocator = 0; allocator < ALLOCATORS; allocator++)
+			ops[allocator] = run(allocator, threads);
+
+		printf("%8u %16.0f %16.0f %8.2f\n", threads, ops[0], ops[1], ops[0] / ops[1]);
+	}
+
+	return 0;
+}
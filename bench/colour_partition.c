@@ -0,0 +1,184 @@
+/****************************************************************************************
+ *
+ * Benchmark : Cache Partitioning by Page Colour
+ *
+ * Description:
+ * - Two tasks take turns on the cache. The victim chases pointers around a random cycle
+ *   of 64 byte nodes which together take half of the cache, and the polluter streams
+ *   through nodes taking four times the cache after every lap of the victim
+ * - Both tasks allocate their nodes with malloc, first from the regular heap, then with
+ *   both of them restricted to every colour of the cache and finally with the victim kept
+ *   to three quarters of the colours and the polluter to the quarter left
+ * - Report the time per hop of the victim, and its LLC misses where perf can count them
+ * - The colours split the last level cache by default. The first argument picks another
+ *   cache level, e.g. 2 on machines whose last level cache is too large to fill here, and
+ *   the benchmark runs itself again with HG_MALLOC_COLOUR_LEVEL set to it
+ *
+ * Results:
+ * - Expected     -> Kept apart, the polluter can only evict its own nodes, so the victim
+ *                   should miss less and its hops should get faster than when the two
+ *                   tasks share every colour
+ *
+ ****************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "../hg_malloc.h"
+
+#define NODE_SIZE	64
+#define LAPS		20
+
+typedef struct node {
+	struct node	*next;
+	unsigned long	pad[NODE_SIZE / sizeof(unsigned long) - 1];
+} node_t;
+
+/* Keeps the chase from being optimized away */
+void *volatile sink;
+
+/* Cheap deterministic pseudo random numbers */
+static unsigned long next_rand(unsigned long *seed)
+{
+	*seed = *seed * 6364136223846793005UL + 1442695040888963407UL;
+
+	return *seed >> 33;
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Allocate the given number of nodes restricted to the given colours, linked into one random cycle */
+static node_t **build(unsigned long count, unsigned long mask, int cycle)
+{
+	node_t		**nodes, *tmp;
+	unsigned long	seed = 1, i, j;
+
+	nodes = malloc(count * sizeof(*nodes));
+
+	if (hg_malloc_colours(mask) < 0) {
+		perror("hg_malloc_colours");
+		exit(1);
+	}
+
+	for (i = 0; i < count; i++)
+		nodes[i] = malloc(sizeof(node_t));
+
+	hg_malloc_colours(0);
+
+	/* Sattolo's algorithm gives a random permutation made of one single cycle */
+	if (cycle) {
+		for (i = count - 1; i > 0; i--) {
+			j = next_rand(&seed) % i;
+			tmp = nodes[i];
+			nodes[i] = nodes[j];
+			nodes[j] = tmp;
+		}
+	}
+
+	for (i = 0; i < count; i++)
+		nodes[i]->next = nodes[(i + 1) % count];
+
+	return nodes;
+}
+
+static void release(node_t **nodes, unsigned long count)
+{
+	unsigned long i;
+
+	for (i = 0; i < count; i++)
+		free(nodes[i]);
+
+	free(nodes);
+}
+
+static void run(const char *label, unsigned long victim_count, unsigned long victim_mask,
+		unsigned long polluter_count, unsigned long polluter_mask)
+{
+	node_t		**victim, **polluter, *p;
+	hg_perf_t	perf;
+	unsigned long	lap, i, misses = 0;
+	double		start, elapsed = 0;
+	int		valid = 0;
+
+	victim = build(victim_count, victim_mask, 1);
+	polluter = build(polluter_count, polluter_mask, 0);
+
+	/* Warm up the victim with one lap */
+	for (p = victim[0], i = 0; i < victim_count; i++)
+		p = p->next;
+
+	for (lap = 0; lap < LAPS; lap++) {
+		/* The polluter streams through its nodes in the order they were allocated */
+		for (i = 0; i < polluter_count; i++)
+			sink = polluter[i]->next;
+
+		hg_perf_begin(&perf);
+		start = now_ns();
+
+		for (i = 0; i < victim_count; i++)
+			p = p->next;
+
+		elapsed += now_ns() - start;
+		hg_perf_end(&perf);
+
+		if (perf.valid[HG_PERF_LLC_MISSES]) {
+			misses += perf.count[HG_PERF_LLC_MISSES];
+			valid = 1;
+		}
+	}
+
+	sink = p;
+
+	if (valid)
+		printf("%-10s %12.2f %16.3f\n", label, elapsed / (LAPS * victim_count), (double)misses / (LAPS * victim_count));
+	else
+		printf("%-10s %12.2f %16s\n", label, elapsed / (LAPS * victim_count), "n/a");
+
+	release(victim, victim_count);
+	release(polluter, polluter_count);
+}
+
+int main(int argc, char *argv[])
+{
+	hg_malloc_stats_t	stats;
+	unsigned long		cache, all, victim_mask, nodes;
+
+	/* Run again with the cache level picked through the environment */
+	if (argc > 1) {
+		setenv("HG_MALLOC_COLOUR_LEVEL", argv[1], 1);
+		execl(argv[0], argv[0], NULL);
+		perror("execl");
+		return 1;
+	}
+
+	if (hg_malloc_colours(0) < 0) {
+		printf("Cache colours are not known on this system\n");
+		return 0;
+	}
+
+	hg_malloc_stats(&stats);
+
+	cache = stats.colours * stats.colour_size;
+	all = (stats.colours >= 64) ? ~0UL : (1UL << stats.colours) - 1;
+	victim_mask = (1UL << (stats.colours * 3 / 4)) - 1;
+	nodes = cache / 2 / NODE_SIZE;
+
+	printf("Cache of %lu kB in %u colours (%s frames)\n", cache >> 10, stats.colours,
+	       stats.colour_physical ? "physical" : "virtual");
+	printf("%-10s %12s %16s\n", "Placement", "ns per hop", "LLC misses / hop");
+
+	run("heap", nodes, 0, nodes * 8, 0);
+	run("shared", nodes, all, nodes * 8, all);
+	run("apart", nodes, victim_mask, nodes * 8, all & ~victim_mask);
+
+	return 0;
+}
@@ -0,0 +1,164 @@
+/****************************************************************************************
+ *
+ * Benchmark : Larson Server Churn
+ *
+ * Description:
+ * - Port of the Larson and Krishnan benchmark, which models a server whose worker
+ *   threads come and go while the objects they allocated live on
+ * - Every thread owns a set of slots filled with objects of random sizes. It keeps
+ *   freeing a random slot and allocating a new object of random size into it, and after
+ *   a fixed number of rounds hands its slots over to a new thread and exits. The new
+ *   thread therefore frees objects which another thread allocated
+ * - Count the operations done in a fixed time, with 1 up to N threads (8 by default,
+ *   or the first argument), once with hg_malloc and once with glibc malloc, which the
+ *   -wrap link flags still leave reachable as __real_malloc
+ *
+ * Results:
+ * - Expected     -> The throughput should grow with the number of threads as long as
+ *                   there are cores to run them, and cross-thread frees should not make
+ *                   it collapse
+ *
+ ****************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SLOTS		1000
+#define ROUNDS		10000
+#define MIN_SIZE	8
+#define MAX_SIZE	1000
+#define RUN_MS		1000
+
+typedef struct {
+	void		*slots[SLOTS];
+	unsigned long	seed;
+	unsigned long	ops;
+	unsigned int	allocator;
+	int		done;
+} worker_t;
+
+/* The allocators under test */
+void *__real_malloc(size_t size);
+void __real_free(void *ptr);
+
+static const struct {
+	const char	*name;
+	void		*(*alloc)(size_t);
+	void		(*release)(void *);
+} allocators[] = {
+	{ "hg_malloc",	malloc,		free },
+	{ "glibc",	__real_malloc,	__real_free },
+};
+
+#define ALLOCATORS	(sizeof(allocators) / sizeof(allocators[0]))
+
+static volatile int stopped;
+
+/* Cheap deterministic pseudo random numbers */
+static unsigned long next_rand(unsigned long *seed)
+{
+	*seed = *seed * 6364136223846793005UL + 1442695040888963407UL;
+
+	return *seed >> 33;
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void *worker(void *arg)
+{
+	worker_t	*self = arg;
+	pthread_t	next;
+	unsigned long	i, slot;
+
+	for (i = 0; i < ROUNDS && !stopped; i++) {
+		slot = next_rand(&self->seed) % SLOTS;
+		allocators[self->allocator].release(self->slots[slot]);
+		self->slots[slot] = allocators[self->allocator].alloc(MIN_SIZE + next_rand(&self->seed) % (MAX_SIZE - MIN_SIZE));
+	}
+
+	self->ops += 2 * i;
+
+	/* Hand the slots over to a new thread, which frees what this one allocated */
+	if (!stopped && pthread_create(&next, NULL, worker, self) == 0) {
+		pthread_detach(next);
+		return NULL;
+	}
+
+	/* The last thread of the chain tells the main thread it is done */
+	__atomic_store_n(&self->done, 1, __ATOMIC_RELEASE);
+
+	return NULL;
+}
+
+static double run(unsigned int allocator, unsigned int threads)
+{
+	worker_t	*workers = calloc(threads, sizeof(worker_t));
+	unsigned long	ops = 0;
+	unsigned int	t, i;
+	pthread_t	tid;
+	double		start, elapsed;
+
+	for (t = 0; t < threads; t++) {
+		workers[t].seed = t + 1;
+		workers[t].allocator = allocator;
+
+		for (i = 0; i < SLOTS; i++)
+			workers[t].slots[i] = allocators[allocator].alloc(MIN_SIZE + next_rand(&workers[t].seed) % (MAX_SIZE - MIN_SIZE));
+	}
+
+	stopped = 0;
+	start = now_ns();
+
+	for (t = 0; t < threads; t++) {
+		pthread_create(&tid, NULL, worker, &workers[t]);
+		pthread_detach(tid);
+	}
+
+	usleep(RUN_MS * 1000);
+	stopped = 1;
+
+	for (t = 0; t < threads; t++)
+		while (!__atomic_load_n(&workers[t].done, __ATOMIC_ACQUIRE))
+			usleep(1000);
+
+	elapsed = now_ns() - start;
+
+	for (t = 0; t < threads; t++) {
+		ops += workers[t].ops;
+
+		for (i = 0; i < SLOTS; i++)
+			allocators[allocator].release(workers[t].slots[i]);
+	}
+
+	free(workers);
+
+	return ops / (elapsed / 1e9);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int	max_threads = (argc > 1) ? atoi(argv[1]) : 8;
+	unsigned int	threads, allocator;
+	double		ops[ALLOCATORS];
+
+	printf("%8s %16s %16s %8s\n", "Threads", "hg_malloc ops/s", "glibc ops/s", "Ratio");
+
+	for (threads = 1; threads <= max_threads; threads *= 2) {
+		for (allocator = 0; allocator < ALLOCATORS; allocator++)
+			ops[allocator] = run(allocator, threads);
+
+		printf("%8u %16.0f %16.0f %8.2f\n", threads, ops[0], ops[1], ops[0] / ops[1]);
+	}
+
+	return 0;
+}
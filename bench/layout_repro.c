@@ -0,0 +1,195 @@
+/****************************************************************************************
+ *
+ * Benchmark : Run to Run Layout Variation
+ *
+ * Description:
+ * - Run the benchmark again RUNS times with the heap placed by the kernel, then RUNS times
+ *   with HG_MALLOC_BASE set to a fixed base
+ * - Every run allocates the same mix of nodes of 16 to 4096 bytes, links them into one
+ *   random cycle and chases it, after a fixed number of allocations and frees which
+ *   scatter the nodes over the heap
+ * - Report how many different layouts the runs saw, the mean and spread of the time per
+ *   hop, and of the LLC misses per hop where perf can count them
+ *
+ * Results:
+ * - Expected     -> Runs with a fixed base should all see one layout, and their times and
+ *                   misses should spread less than when the kernel places the heap
+ *
+ ****************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "../hg_malloc.h"
+
+#define RUNS		8
+#define NODES		(1 << 16)
+#define LAPS		20
+#define FIXED_BASE	"0x200000000000"
+
+typedef struct node {
+	struct node	*next;
+} node_t;
+
+typedef struct {
+	unsigned long	layout;
+	double		ns;
+	double		misses;
+	int		valid;
+} result_t;
+
+/* Keeps the chase from being optimized away */
+void *volatile sink;
+
+/* Cheap deterministic pseudo random numbers */
+static unsigned long next_rand(unsigned long *seed)
+{
+	*seed = *seed * 6364136223846793005UL + 1442695040888963407UL;
+
+	return *seed >> 33;
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* One run, whose result goes to the given file descriptor */
+static void child(int fd)
+{
+	static node_t	*nodes[NODES];
+	static void	*holes[NODES];
+	node_t		*p, *tmp;
+	hg_perf_t	perf;
+	result_t	res;
+	unsigned long	seed = 1, i, j, lap, misses = 0;
+	double		start, elapsed = 0;
+
+	memset(&res, 0, sizeof(res));
+
+	/* Interleave nodes with blocks freed later, so that the nodes are spread out */
+	for (i = 0; i < NODES; i++) {
+		nodes[i] = malloc(16UL << (next_rand(&seed) % 9));
+		holes[i] = malloc(16 + next_rand(&seed) % 2048);
+	}
+
+	for (i = 0; i < NODES; i++)
+		free(holes[i]);
+
+	/* Sattolo's algorithm gives a random permutation made of one single cycle */
+	for (i = NODES - 1; i > 0; i--) {
+		j = next_rand(&seed) % i;
+		tmp = nodes[i];
+		nodes[i] = nodes[j];
+		nodes[j] = tmp;
+	}
+
+	for (i = 0; i < NODES; i++) {
+		nodes[i]->next = nodes[(i + 1) % NODES];
+		res.layout = res.layout * 31 + (unsigned long)nodes[i];
+	}
+
+	for (p = nodes[0], i = 0; i < NODES; i++)
+		p = p->next;
+
+	for (lap = 0; lap < LAPS; lap++) {
+		hg_perf_begin(&perf);
+		start = now_ns();
+
+		for (i = 0; i < NODES; i++)
+			p = p->next;
+
+		elapsed += now_ns() - start;
+		hg_perf_end(&perf);
+
+		if (perf.valid[HG_PERF_LLC_MISSES]) {
+			misses += perf.count[HG_PERF_LLC_MISSES];
+			res.valid = 1;
+		}
+	}
+
+	sink = p;
+	res.ns = elapsed / (LAPS * NODES);
+	res.misses = (double)misses / (LAPS * NODES);
+
+	if (write(fd, &res, sizeof(res)) != sizeof(res))
+		exit(1);
+}
+
+static void mode(const char *label, char *prog, const char *base)
+{
+	result_t	res[RUNS];
+	double		ns = 0, ns_dev = 0, misses = 0, miss_dev = 0;
+	int		fds[2], i, j, layouts = 0, status;
+
+	for (i = 0; i < RUNS; i++) {
+		if (pipe(fds) < 0) {
+			perror("pipe");
+			exit(1);
+		}
+
+		if (fork() == 0) {
+			close(fds[0]);
+			dup2(fds[1], STDOUT_FILENO);
+
+			if (base != NULL)
+				setenv("HG_MALLOC_BASE", base, 1);
+
+			execl(prog, prog, "run", NULL);
+			_exit(1);
+		}
+
+		close(fds[1]);
+
+		if (read(fds[0], &res[i], sizeof(res[i])) != sizeof(res[i])) {
+			fprintf(stderr, "Run %d failed\n", i);
+			exit(1);
+		}
+
+		close(fds[0]);
+		wait(&status);
+	}
+
+	for (i = 0; i < RUNS; i++) {
+		for (j = 0; j < i && res[j].layout != res[i].layout; j++)
+			;
+
+		layouts += (j == i);
+		ns += res[i].ns / RUNS;
+		misses += res[i].misses / RUNS;
+	}
+
+	for (i = 0; i < RUNS; i++) {
+		ns_dev += (res[i].ns - ns) * (res[i].ns - ns) / RUNS;
+		miss_dev += (res[i].misses - misses) * (res[i].misses - misses) / RUNS;
+	}
+
+	if (res[0].valid)
+		printf("%-8s %8d %10.2f %10.3f %12.3f %12.4f\n", label, layouts, ns, sqrt(ns_dev), misses, sqrt(miss_dev));
+	else
+		printf("%-8s %8d %10.2f %10.3f %12s %12s\n", label, layouts, ns, sqrt(ns_dev), "n/a", "n/a");
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc > 1) {
+		child(STDOUT_FILENO);
+		return 0;
+	}
+
+	printf("%d runs of %d nodes each\n", RUNS, NODES);
+	printf("%-8s %8s %10s %10s %12s %12s\n", "Heap", "Layouts", "ns / hop", "Std Dev", "Misses / hop", "Std Dev");
+
+	mode("kernel", argv[0], NULL);
+	mode("fixed", argv[0], FIXED_BASE);
+
+	return 0;
+}
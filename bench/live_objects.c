@@ -0,0 +1,84 @@
+/****************************************************************************************
+ *
+ * Benchmark : Malloc Latency vs. Number of Live Objects
+ *
+ * Description:
+ * - Allocate N objects of mixed sizes and keep them alive
+ * - Free every other object so that the heap is full of holes of all sizes
+ * - Time a fixed number of malloc/free pairs on top of this heap
+ * - Repeat for N growing from a hundred to half a million objects
+ *
+ * Results:
+ * - Expected     -> The latency per malloc should stay flat as N grows because free
+ *                   chunks are found through size-class free lists rather than by
+ *                   scanning every chunk of the heap
+ *
+ ****************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define MAX_LIVE_OBJECTS	(512 * 1024)
+#define TIMED_OPERATIONS	(256 * 1024)
+#define BATCH_SIZE		64
+
+static void *live[MAX_LIVE_OBJECTS];
+static void *batch[BATCH_SIZE];
+
+/* Cheap deterministic pseudo random sizes between 16 and 528 bytes */
+static unsigned long next_size(unsigned long *seed)
+{
+	*seed = *seed * 6364136223846793005UL + 1442695040888963407UL;
+
+	return 16 + ((*seed >> 33) % 512);
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(void)
+{
+	unsigned long	seed = 1;
+	unsigned long	live_objects, i, j;
+	double		start, elapsed;
+
+	printf("%12s %16s\n", "Live Objects", "ns per malloc");
+
+	for (live_objects = 128; live_objects <= MAX_LIVE_OBJECTS; live_objects *= 4) {
+		/* Build the live heap */
+		for (i = 0; i < live_objects; i++)
+			live[i] = malloc(next_size(&seed));
+
+		/* Punch holes in it */
+		for (i = 0; i < live_objects; i += 2)
+			free(live[i]);
+
+		/* Time malloc in batches so that frees do not simply hand back the same chunk */
+		start = now_ns();
+
+		for (i = 0; i < TIMED_OPERATIONS; i += BATCH_SIZE) {
+			for (j = 0; j < BATCH_SIZE; j++)
+				batch[j] = malloc(next_size(&seed));
+
+			for (j = 0; j < BATCH_SIZE; j++)
+				free(batch[j]);
+		}
+
+		elapsed = now_ns() - start;
+
+		printf("%12lu %16.1f\n", live_objects, elapsed / TIMED_OPERATIONS);
+
+		/* Tear down the live heap */
+		for (i = 1; i < live_objects; i += 2)
+			free(live[i]);
+	}
+
+	return 0;
+}
@@ -0,0 +1,240 @@
+/****************************************************************************************
+ *
+ * Benchmark : Hardware Counters of hg_malloc vs. glibc
+ *
+ * Description:
+ * - Build a linked list of small nodes, with short lived blocks of random sizes
+ *   allocated and freed in between so that the heap gets fragmented, then walk the
+ *   list in a random order a few times and free it
+ * - Count the dTLB load misses, LLC misses and page faults of the whole workload
+ *   through hg_perf_begin and hg_perf_end
+ * - Run the same workload once with hg_malloc and once with glibc malloc, which the
+ *   -wrap link flags still leave reachable as __real_malloc. The benchmark runs itself
+ *   once per allocator and round so that every run starts from a fresh process, and
+ *   reports the mean and standard deviation over the rounds
+ * - Counters the system does not offer, e.g. hardware events inside a virtual machine,
+ *   are reported as n/a
+ *
+ * Results:
+ * - Expected     -> hg_malloc should take fewer dTLB misses and far fewer page faults
+ *                   since the nodes sit on 2MB pages
+ *
+ ****************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "../hg_malloc.h"
+
+#define NODES		(2 * 1024 * 1024)
+#define NODE_SIZE	64
+#define WALKS		4
+#define ROUNDS		5
+
+typedef struct node {
+	struct node	*next;
+	unsigned long	value;
+} node_t;
+
+/* The allocators under test */
+void *__real_malloc(size_t size);
+void __real_free(void *ptr);
+
+static const struct {
+	const char	*name;
+	void		*(*alloc)(size_t);
+	void		(*release)(void *);
+} allocators[] = {
+	{ "hg_malloc",	malloc,		free },
+	{ "glibc",	__real_malloc,	__real_free },
+};
+
+#define ALLOCATORS	(sizeof(allocators) / sizeof(allocators[0]))
+
+static const char *names[HG_PERF_EVENTS] = {
+	[HG_PERF_DTLB_LOAD_MISSES]	= "dTLB Misses",
+	[HG_PERF_LLC_MISSES]		= "LLC Misses",
+	[HG_PERF_PAGE_FAULTS]		= "Page Faults",
+};
+
+/* Keeps the walk from being optimized away */
+volatile unsigned long sink;
+
+static node_t *nodes[NODES];
+
+/* Cheap deterministic pseudo random numbers */
+static unsigned long next_rand(unsigned long *seed)
+{
+	*seed = *seed * 6364136223846793005UL + 1442695040888963407UL;
+
+	return *seed >> 33;
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void workload(unsigned int allocator)
+{
+	unsigned long	seed = 42, sum = 0;
+	node_t		*node, *tmp;
+	void		*junk;
+	long		i, j;
+
+	for (i = 0; i < NODES; i++) {
+		nodes[i] = allocators[allocator].alloc(NODE_SIZE);
+		nodes[i]->value = i;
+
+		junk = allocators[allocator].alloc(16 + next_rand(&seed) % 512);
+		allocators[allocator].release(junk);
+	}
+
+	/* Link the nodes in a random order */
+	for (i = NODES - 1; i > 0; i--) {
+		j = next_rand(&seed) % (i + 1);
+		tmp = nodes[i];
+		nodes[i] = nodes[j];
+		nodes[j] = tmp;
+	}
+
+	for (i = 0; i < NODES - 1; i++)
+		nodes[i]->next = nodes[i + 1];
+	nodes[NODES - 1]->next = NULL;
+
+	for (i = 0; i < WALKS; i++)
+		for (node = nodes[0]; node != NULL; node = node->next)
+			sum += node->value;
+
+	sink = sum;
+
+	for (i = 0; i < NODES; i++)
+		allocators[allocator].release(nodes[i]);
+}
+
+/* Child run, prints the time and the counters of one round */
+static void run(unsigned int allocator)
+{
+	hg_perf_t	perf;
+	double		start, elapsed;
+	unsigned int	event;
+
+	/* Fault in our own array first so that only the faults of the workload are counted */
+	memset(nodes, 0, sizeof(nodes));
+
+	hg_perf_begin(&perf);
+	start = now_ns();
+
+	workload(allocator);
+
+	elapsed = now_ns() - start;
+	hg_perf_end(&perf);
+
+	printf("%f", elapsed / 1e6);
+	for (event = 0; event < HG_PERF_EVENTS; event++)
+		printf(" %lld", perf.valid[event] ? (long long)perf.count[event] : -1LL);
+	printf("\n");
+}
+
+/* Runs one round in a fresh process and reads back its results */
+static int spawn(unsigned int allocator, char *prog, double values[HG_PERF_EVENTS + 1])
+{
+	long long	count;
+	unsigned int	event;
+	char		arg[16];
+	FILE		*results;
+	int		fds[2], ok;
+
+	if (pipe(fds) != 0)
+		return -1;
+
+	fflush(stdout);
+
+	if (fork() == 0) {
+		dup2(fds[1], STDOUT_FILENO);
+		close(fds[0]);
+		close(fds[1]);
+
+		snprintf(arg, sizeof(arg), "%u", allocator);
+		execl(prog, prog, arg, NULL);
+		_exit(1);
+	}
+
+	close(fds[1]);
+	results = fdopen(fds[0], "r");
+
+	ok = (fscanf(results, "%lf", &values[0]) == 1);
+	for (event = 0; ok && event < HG_PERF_EVENTS; event++) {
+		ok = (fscanf(results, "%lld", &count) == 1);
+		values[event + 1] = (count < 0) ? NAN : count;
+	}
+
+	fclose(results);
+	wait(NULL);
+
+	return ok ? 0 : -1;
+}
+
+static void print_stat(const double *samples, int rounds)
+{
+	double	mean = 0, var = 0;
+	int	i;
+
+	for (i = 0; i < rounds; i++)
+		mean += samples[i] / rounds;
+	for (i = 0; i < rounds; i++)
+		var += (samples[i] - mean) * (samples[i] - mean) / rounds;
+
+	if (isnan(mean))
+		printf(" %24s", "n/a");
+	else
+		printf(" %14.5g +- %-7.2g", mean, sqrt(var));
+}
+
+int main(int argc, char *argv[])
+{
+	double		samples[ALLOCATORS][HG_PERF_EVENTS + 1][ROUNDS];
+	double		values[HG_PERF_EVENTS + 1];
+	unsigned int	allocator, event;
+	int		round;
+
+	if (argc > 1) {
+		run(atoi(argv[1]));
+		return 0;
+	}
+
+	/* Interleave the allocators so that both see the same drift of the machine */
+	for (round = 0; round < ROUNDS; round++) {
+		for (allocator = 0; allocator < ALLOCATORS; allocator++) {
+			if (spawn(allocator, argv[0], values) != 0) {
+				fprintf(stderr, "Round %d of %s failed\n", round, allocators[allocator].name);
+				return 1;
+			}
+
+			for (event = 0; event <= HG_PERF_EVENTS; event++)
+				samples[allocator][event][round] = values[event];
+		}
+	}
+
+	printf("%10s %24s", "Allocator", "Time (ms)");
+	for (event = 0; event < HG_PERF_EVENTS; event++)
+		printf(" %24s", names[event]);
+	printf("\n");
+
+	for (allocator = 0; allocator < ALLOCATORS; allocator++) {
+		printf("%10s", allocators[allocator].name);
+		for (event = 0; event <= HG_PERF_EVENTS; event++)
+			print_stat(samples[allocator][event], ROUNDS);
+		printf("\n");
+	}
+
+	return 0;
+}
@@ -0,0 +1,120 @@
+/****************************************************************************************
+ *
+ * Benchmark : Page Faults Inside Malloc vs. Pre-faulted Pool
+ *
+ * Description:
+ * - Allocate 512MB worth of small objects and count the page faults taken and the
+ *   worst malloc latency seen along the way
+ * - Repeat with the heap faulting in lazily, with a pool reserved up front through
+ *   HG_MALLOC_POOL and with that pool pre-faulted by one or more threads through
+ *   HG_MALLOC_PREFAULT. The benchmark runs itself once per setting so that each run
+ *   sets up its pool at startup
+ * - The startup time covers loading the program up to main, pool setup included
+ *
+ * Results:
+ * - Expected     -> Without a pre-faulted pool every new huge page costs a fault and the
+ *                   kernel zeroing it, which shows up as the worst malloc latency
+ * - Expected     -> With a pre-faulted pool malloc takes no page faults at all, and
+ *                   more threads shorten the startup on large pools
+ *
+ ****************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define OBJECT_SIZE	256
+#define OBJECTS		(2 * 1024 * 1024)
+
+static void *objects[OBJECTS];
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static long minor_faults(void)
+{
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+
+	return usage.ru_minflt;
+}
+
+static void run(const char *label)
+{
+	double	start, elapsed, worst = 0, startup;
+	long	faults;
+	int	i;
+
+	startup = now_ns() - strtod(getenv("BENCH_T0"), NULL);
+
+	/* Fault in our own array first so that only the faults of the allocator are counted */
+	memset(objects, 0, sizeof(objects));
+	faults = minor_faults();
+
+	for (i = 0; i < OBJECTS; i++) {
+		start = now_ns();
+		objects[i] = malloc(OBJECT_SIZE);
+		elapsed = now_ns() - start;
+
+		if (elapsed > worst)
+			worst = elapsed;
+	}
+
+	faults = minor_faults() - faults;
+
+	for (i = 0; i < OBJECTS; i++)
+		free(objects[i]);
+
+	printf("%16s %14.2f %14ld %16.2f\n", label, startup / 1e6, faults, worst / 1e3);
+}
+
+static void spawn(const char *label, const char *pool, const char *prefault, char *prog)
+{
+	char t0[32];
+
+	fflush(stdout);
+
+	if (fork() == 0) {
+		if (pool != NULL)
+			setenv("HG_MALLOC_POOL", pool, 1);
+		if (prefault != NULL)
+			setenv("HG_MALLOC_PREFAULT", prefault, 1);
+
+		snprintf(t0, sizeof(t0), "%.0f", now_ns());
+		setenv("BENCH_T0", t0, 1);
+
+		execl(prog, prog, label, NULL);
+		_exit(1);
+	}
+
+	wait(NULL);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc > 1) {
+		/* Child run, the pool was set up through the environment */
+		run(argv[1]);
+		return 0;
+	}
+
+	printf("%16s %14s %14s %16s\n", "Setting", "Startup (ms)", "Page Faults", "Worst malloc (us)");
+
+	spawn("lazy", NULL, NULL, argv[0]);
+	spawn("pool", "1G", NULL, argv[0]);
+	spawn("pool+prefault1", "1G", "1", argv[0]);
+	spawn("pool+prefault4", "1G", "4", argv[0]);
+
+	return 0;
+}
@@ -0,0 +1,178 @@
+/****************************************************************************************
+ *
+ * Benchmark : Producer Consumer Pipelines
+ *
+ * Description:
+ * - Every pipeline is a producer thread which allocates messages of 16 to 256 bytes and
+ *   a consumer thread which frees them. Messages go through a ring of their own, which
+ *   takes no lock, so that the allocator is all the pipelines share
+ * - Count the messages passed in a fixed time, with 1 up to N pipelines (4 by default,
+ *   or the first argument), once with hg_malloc and once with glibc malloc, which the
+ *   -wrap link flags still leave reachable as __real_malloc
+ * - Every message is freed by a thread which did not allocate it, so with hg_malloc it
+ *   goes through the remote queue of its producer
+ *
+ * Results:
+ * - Expected     -> The throughput should grow with the number of pipelines as long as
+ *                   there are cores to run them, since freeing a message takes no lock
+ *
+ ****************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RING		256
+#define MIN_SIZE	16
+#define MAX_SIZE	256
+#define RUN_MS		1000
+
+typedef struct {
+	void		*slots[RING];
+	unsigned long	head __attribute__((aligned(64)));
+	unsigned long	tail __attribute__((aligned(64)));
+	unsigned long	ops;
+	unsigned int	allocator;
+} pipeline_t;
+
+/* The allocators under test */
+void *__real_malloc(size_t size);
+void __real_free(void *ptr);
+
+static const struct {
+	const char	*name;
+	void		*(*alloc)(size_t);
+	void		(*release)(void *);
+} allocators[] = {
+	{ "hg_malloc",	malloc,		free },
+	{ "glibc",	__real_malloc,	__real_free },
+};
+
+#define ALLOCATORS	(sizeof(allocators) / sizeof(allocators[0]))
+
+static volatile int stopped;
+
+/* Cheap deterministic pseudo random numbers */
+static unsigned long next_rand(unsigned long *seed)
+{
+	*seed = *seed * 6364136223846793005UL + 1442695040888963407UL;
+
+	return *seed >> 33;
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void *producer(void *arg)
+{
+	pipeline_t	*pipe = arg;
+	unsigned long	head = 0, seed = (unsigned long)arg;
+	char		*msg;
+
+	while (!stopped) {
+		/* Wait for the consumer to make room */
+		if (head - __atomic_load_n(&pipe->tail, __ATOMIC_ACQUIRE) == RING) {
+			sched_yield();
+			continue;
+		}
+
+		msg = allocators[pipe->allocator].alloc(MIN_SIZE + next_rand(&seed) % (MAX_SIZE - MIN_SIZE + 1));
+		msg[0] = (char)head;
+
+		pipe->slots[head % RING] = msg;
+		__atomic_store_n(&pipe->head, ++head, __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+static void *consumer(void *arg)
+{
+	pipeline_t	*pipe = arg;
+	unsigned long	tail = 0, head;
+
+	for (;;) {
+		head = __atomic_load_n(&pipe->head, __ATOMIC_ACQUIRE);
+
+		if (head == tail) {
+			if (stopped)
+				break;
+
+			sched_yield();
+			continue;
+		}
+
+		while (tail != head) {
+			allocators[pipe->allocator].release(pipe->slots[tail % RING]);
+			__atomic_store_n(&pipe->tail, ++tail, __ATOMIC_RELEASE);
+		}
+	}
+
+	pipe->ops = tail;
+
+	return NULL;
+}
+
+static double run(unsigned int allocator, unsigned int pipelines)
+{
+	pipeline_t	*pipes = aligned_alloc(64, pipelines * sizeof(pipeline_t));
+	pthread_t	*tids = calloc(2 * pipelines, sizeof(pthread_t));
+	unsigned long	ops = 0;
+	unsigned int	p;
+	double		start, elapsed;
+
+	stopped = 0;
+	start = now_ns();
+
+	for (p = 0; p < pipelines; p++) {
+		pipes[p].head = 0;
+		pipes[p].tail = 0;
+		pipes[p].allocator = allocator;
+		pthread_create(&tids[2 * p], NULL, producer, &pipes[p]);
+		pthread_create(&tids[2 * p + 1], NULL, consumer, &pipes[p]);
+	}
+
+	usleep(RUN_MS * 1000);
+	stopped = 1;
+
+	/* Consumers only stop once they have freed everything their producer sent */
+	for (p = 0; p < 2 * pipelines; p++)
+		pthread_join(tids[p], NULL);
+
+	elapsed = now_ns() - start;
+
+	for (p = 0; p < pipelines; p++)
+		ops += pipes[p].ops;
+
+	free(pipes);
+	free(tids);
+
+	return ops / (elapsed / 1e9);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int	max_pipelines = (argc > 1) ? atoi(argv[1]) : 4;
+	unsigned int	pipelines, allocator;
+	double		ops[ALLOCATORS];
+
+	printf("%9s %16s %16s %8s\n", "Pipelines", "hg_malloc msg/s", "glibc msg/s", "Ratio");
+
+	for (pipelines = 1; pipelines <= max_pipelines; pipelines *= 2) {
+		for (allocator = 0; allocator < ALLOCATORS; allocator++)
+			ops[allocator] = run(allocator, pipelines);
+
+		printf("%9u %16.0f %16.0f %8.2f\n", pipelines, ops[0], ops[1], ops[0] / ops[1]);
+	}
+
+	return 0;
+}
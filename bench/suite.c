@@ -0,0 +1,302 @@
+/****************************************************************************************
+ *
+ * Benchmark : Regression Suite
+ *
+ * Description:
+ * - Time the basic allocation patterns, each as the nanoseconds per operation:
+ *     pair/<size>         malloc and free the same size over and over, from the thread
+ *                         cache up to large mappings
+ *     churn/random        free and reallocate random slots of a live set with random
+ *                         sizes
+ *     order/<order>       allocate a batch of objects and free it in LIFO, FIFO or
+ *                         random order
+ *     realloc/grow        grow blocks 16 bytes at a time up to 64kB
+ *     heap/<objects>      churn on top of a live heap of a few up to millions of objects,
+ *                         which must not get slower as the heap grows
+ * - Every case is run a few times and the fastest run is kept, which is the one least
+ *   disturbed by the rest of the machine
+ * - The results are written as name,ns_per_op lines to the file given with -o, and are
+ *   compared with the baseline given with -b, e.g. one written by an earlier run. A case
+ *   which is slower than its baseline by more than the tolerance given with -t (in
+ *   percent, 15 by default) fails the run, and so does a missing baseline
+ *
+ * Usage:
+ * - make bench-baseline   Stores the results of this tree as bench/baseline.csv
+ * - make bench-check      Compares the results of this tree with bench/baseline.csv
+ *
+ ****************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RUNS		5
+#define MAX_OBJECTS	(4 * 1024 * 1024)
+#define MAX_CASES	64
+
+typedef struct {
+	char		name[32];
+	double		ns;
+} result_t;
+
+/* Keeps the allocations from being optimized away */
+void *volatile sink;
+
+static void *objects[MAX_OBJECTS];
+static result_t results[MAX_CASES];
+static int cases;
+
+/* Cheap deterministic pseudo random numbers */
+static unsigned long next_rand(unsigned long *seed)
+{
+	*seed = *seed * 6364136223846793005UL + 1442695040888963407UL;
+
+	return *seed >> 33;
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Each case runs its pattern once and returns the time it took per operation */
+static double bench_pair(unsigned long size)
+{
+	unsigned long	i, count = (size >= 1024 * 1024) ? 100000 : 1000000;
+	double		start = now_ns();
+	void		*ptr;
+
+	for (i = 0; i < count; i++) {
+		ptr = malloc(size);
+		sink = ptr;
+		free(ptr);
+	}
+
+	return (now_ns() - start) / count;
+}
+
+static double bench_churn(unsigned long live, unsigned long max_size, unsigned long ops)
+{
+	unsigned long	seed = 7, i, slot;
+	double		start, elapsed;
+
+	for (i = 0; i < live; i++)
+		objects[i] = malloc(16 + next_rand(&seed) % max_size);
+
+	start = now_ns();
+
+	for (i = 0; i < ops; i++) {
+		slot = next_rand(&seed) % live;
+		free(objects[slot]);
+		objects[slot] = malloc(16 + next_rand(&seed) % max_size);
+	}
+
+	elapsed = now_ns() - start;
+
+	for (i = 0; i < live; i++)
+		free(objects[i]);
+
+	/* Every op is one free and one malloc */
+	return elapsed / (2 * ops);
+}
+
+static double bench_order(int order)
+{
+	unsigned long	seed = 11, i, j, count = 100000;
+	double		start = now_ns();
+	void		*tmp;
+	int		round;
+
+	for (round = 0; round < 10; round++) {
+		for (i = 0; i < count; i++)
+			objects[i] = malloc(16 + (i % 16) * 16);
+
+		if (order == 2) {
+			for (i = count - 1; i > 0; i--) {
+				j = next_rand(&seed) % (i + 1);
+				tmp = objects[i];
+				objects[i] = objects[j];
+				objects[j] = tmp;
+			}
+		}
+
+		if (order == 0) {
+			for (i = count; i > 0; i--)
+				free(objects[i - 1]);
+		} else {
+			for (i = 0; i < count; i++)
+				free(objects[i]);
+		}
+	}
+
+	return (now_ns() - start) / (20 * count);
+}
+
+static double bench_realloc(void)
+{
+	unsigned long	size, ops = 0;
+	double		start = now_ns();
+	void		*ptr, *keep[64];
+	int		round;
+
+	for (round = 0; round < 64; round++) {
+		ptr = NULL;
+
+		for (size = 16; size <= 65536; size += 16, ops++)
+			ptr = realloc(ptr, size);
+
+		/* Blocks kept alive stop the next one from growing into their place */
+		keep[round] = malloc(64);
+		free(ptr);
+	}
+
+	for (round = 0; round < 64; round++)
+		free(keep[round]);
+
+	return (now_ns() - start) / ops;
+}
+
+static void record(const char *name, double (*run)(void *), void *arg)
+{
+	double	best = 0, ns;
+	int	i;
+
+	for (i = 0; i < RUNS; i++) {
+		ns = run(arg);
+
+		if (i == 0 || ns < best)
+			best = ns;
+	}
+
+	snprintf(results[cases].name, sizeof(results[cases].name), "%s", name);
+	results[cases++].ns = best;
+
+	printf("%-24s %12.2f\n", name, best);
+	fflush(stdout);
+}
+
+/* Adapters from the generic case signature */
+static double run_pair(void *arg)	{ return bench_pair((unsigned long)arg); }
+static double run_churn(void *arg)	{ return bench_churn(10000, 4096, 1000000); (void)arg; }
+static double run_order(void *arg)	{ return bench_order((int)(long)arg); }
+static double run_realloc(void *arg)	{ return bench_realloc(); (void)arg; }
+static double run_heap(void *arg)	{ return bench_churn((unsigned long)arg, 256, 1000000); }
+
+/* Compares the results with the baseline, returns the number of regressions or -1 without a baseline */
+static int compare(const char *path, double tolerance)
+{
+	char	name[32];
+	double	ns;
+	FILE	*file = fopen(path, "r");
+	int	i, regressions = 0;
+
+	if (file == NULL) {
+		perror(path);
+		return -1;
+	}
+
+	printf("\n%-24s %12s %12s %10s\n", "Case", "Baseline", "Now", "Change");
+
+	while (fscanf(file, " %31[^,],%lf", name, &ns) == 2) {
+		for (i = 0; i < cases && strcmp(results[i].name, name) != 0; i++);
+
+		if (i == cases)
+			continue;
+
+		printf("%-24s %12.2f %12.2f %+9.1f%%", name, ns, results[i].ns, 100 * (results[i].ns - ns) / ns);
+
+		if (results[i].ns > ns * (1 + tolerance / 100)) {
+			printf("  REGRESSION");
+			regressions++;
+		}
+
+		printf("\n");
+	}
+
+	fclose(file);
+
+	printf("\n%d regression(s) beyond %.0f%%\n", regressions, tolerance);
+
+	return regressions;
+}
+
+int main(int argc, char *argv[])
+{
+	static const char	*orders[] = { "order/lifo", "order/fifo", "order/random" };
+	const char		*output = NULL, *baseline = NULL;
+	double			tolerance = 15;
+	unsigned long		size, objects;
+	char			name[32];
+	FILE			*file;
+	int			opt, i;
+
+	while ((opt = getopt(argc, argv, "o:b:t:")) != -1) {
+		switch (opt) {
+		case 'o':
+			output = optarg;
+			break;
+		case 'b':
+			baseline = optarg;
+			break;
+		case 't':
+			tolerance = strtod(optarg, NULL);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-o results.csv] [-b baseline.csv] [-t tolerance%%]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	/* A check without a baseline would pass whatever the results */
+	if (baseline != NULL && access(baseline, R_OK) != 0) {
+		perror(baseline);
+		fprintf(stderr, "No baseline to compare with, take one first (make bench-baseline)\n");
+		return 2;
+	}
+
+	printf("%-24s %12s\n", "Case", "ns per op");
+
+	for (size = 16; size <= 4096; size *= 4) {
+		snprintf(name, sizeof(name), "pair/%lu", size);
+		record(name, run_pair, (void *)size);
+	}
+
+	record("pair/65536", run_pair, (void *)65536UL);
+	record("pair/2097152", run_pair, (void *)2097152UL);
+	record("churn/random", run_churn, NULL);
+
+	for (i = 0; i < 3; i++)
+		record(orders[i], run_order, (void *)(long)i);
+
+	record("realloc/grow", run_realloc, NULL);
+
+	for (objects = 16; objects <= MAX_OBJECTS; objects *= 16) {
+		snprintf(name, sizeof(name), "heap/%lu", objects);
+		record(name, run_heap, (void *)objects);
+	}
+
+	if (output != NULL) {
+		file = fopen(output, "w");
+
+		if (file == NULL) {
+			perror(output);
+			return 2;
+		}
+
+		for (i = 0; i < cases; i++)
+			fprintf(file, "%s,%.2f\n", results[i].name, results[i].ns);
+
+		fclose(file);
+	}
+
+	if (baseline != NULL && compare(baseline, tolerance) != 0)
+		return 1;
+
+	return 0;
+}
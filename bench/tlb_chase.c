@@ -0,0 +1,166 @@
+/****************************************************************************************
+ *
+ * Benchmark : dTLB Reach vs. Page Size
+ *
+ * Description:
+ * - Allocate one large buffer and link one pointer per 4kB page of it into a single
+ *   random cycle, so that every hop of the chase lands on a different page
+ * - Time a fixed number of dependent loads around the cycle
+ * - Repeat with the buffer backed by 4kB pages (plain mmap), by the allocator with its
+ *   default 2MB pages and by the allocator with HG_MALLOC_PAGE_SIZE=1G. The benchmark
+ *   runs itself once per page size so that each run picks its page size at startup
+ * - The page size which actually backs the buffer is read back from /proc/self/smaps,
+ *   a 1GB request falls back to 2MB pages when the 1GB pool is empty
+ *
+ * Results:
+ * - Expected     -> The latency per hop should drop as the page size grows because
+ *                   fewer TLB entries cover the whole buffer and page walks become rare
+ *
+ ****************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#define BUFFER_SIZE	(512UL * 1024 * 1024)
+#define STRIDE		4096UL
+#define HOPS		(16 * 1024 * 1024)
+
+/* Keeps the chase from being optimized away */
+void *volatile sink;
+
+/* Cheap deterministic pseudo random numbers */
+static unsigned long next_rand(unsigned long *seed)
+{
+	*seed = *seed * 6364136223846793005UL + 1442695040888963407UL;
+
+	return *seed >> 33;
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Look up the page size of the mapping holding the given address */
+static unsigned long kernel_page_size(void *addr)
+{
+	unsigned long	start, end, page = 0;
+	int		found = 0;
+	char		line[256];
+	FILE		*smaps;
+
+	smaps = fopen("/proc/self/smaps", "r");
+	if (smaps == NULL)
+		return 0;
+
+	while (fgets(line, sizeof(line), smaps)) {
+		if (sscanf(line, "%lx-%lx ", &start, &end) == 2)
+			found = ((unsigned long)addr >= start && (unsigned long)addr < end);
+		else if (found && sscanf(line, "KernelPageSize: %lu kB", &page) == 1)
+			break;
+	}
+
+	fclose(smaps);
+
+	return page;
+}
+
+static void chase(const char *label, char *buf)
+{
+	unsigned long	pages = BUFFER_SIZE / STRIDE;
+	unsigned long	*order, seed = 1, i, j, tmp, from, to;
+	void		**p;
+	double		start, elapsed;
+
+	/* Sattolo's algorithm gives a random permutation made of one single cycle */
+	order = malloc(pages * sizeof(*order));
+	for (i = 0; i < pages; i++)
+		order[i] = i;
+
+	for (i = pages - 1; i > 0; i--) {
+		j = next_rand(&seed) % i;
+		tmp = order[i];
+		order[i] = order[j];
+		order[j] = tmp;
+	}
+
+	/* Spread the pointers over the cache lines of a page so that they do not share a set */
+	for (i = 0; i < pages; i++) {
+		from = order[i];
+		to = order[(i + 1) % pages];
+		*(void **)(buf + from * STRIDE + (from % 64) * 64) = buf + to * STRIDE + (to % 64) * 64;
+	}
+
+	p = (void **)(buf + order[0] * STRIDE + (order[0] % 64) * 64);
+	free(order);
+
+	/* Warm up the caches with one lap */
+	for (i = 0; i < pages; i++)
+		p = *p;
+
+	start = now_ns();
+	for (i = 0; i < HOPS; i++)
+		p = *p;
+	elapsed = now_ns() - start;
+	sink = p;
+
+	printf("%10s %14lu %12.2f\n", label, kernel_page_size(buf), elapsed / HOPS);
+}
+
+int main(int argc, char *argv[])
+{
+	char	*buf;
+
+	if (argc > 1) {
+		/* Child run, the page size was picked through the environment */
+		buf = malloc(BUFFER_SIZE);
+		if (buf == NULL) {
+			perror("malloc");
+			return 1;
+		}
+
+		chase(argv[1], buf);
+		free(buf);
+
+		return 0;
+	}
+
+	printf("%10s %14s %12s\n", "Requested", "Page Size (kB)", "ns per hop");
+
+	/* Baseline with regular pages, kept away from transparent huge pages */
+	buf = mmap(0, BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buf == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+
+	madvise(buf, BUFFER_SIZE, MADV_NOHUGEPAGE);
+	chase("4K", buf);
+	munmap(buf, BUFFER_SIZE);
+	fflush(stdout);
+
+	if (fork() == 0) {
+		setenv("HG_MALLOC_PAGE_SIZE", "2M", 1);
+		execl(argv[0], argv[0], "2M", NULL);
+		_exit(1);
+	}
+	wait(NULL);
+
+	if (fork() == 0) {
+		setenv("HG_MALLOC_PAGE_SIZE", "1G", 1);
+		execl(argv[0], argv[0], "1G", NULL);
+		_exit(1);
+	}
+	wait(NULL);
+
+	return 0;
+}
@@ -0,0 +1,135 @@
+/**********************************************************************************************************************
+ * Dynamic Memory Allocation Using Huge Pages
+ *
+ * This header declares the calls which the allocator offers on top of the standard malloc interface, and the
+ * performance counter calls used to measure its effect
+ *********************************************************************************************************************/
+
+#ifndef HG_MALLOC_H
+#define HG_MALLOC_H
+
+#include <stddef.h>
+
+/* Reserve a segment of at least the given size up front and hand out memory from it first. With a
+   non-zero number of threads its pages are faulted in before it is used, so that malloc does not take
+   page faults on it later. The same can be asked for at startup with HG_MALLOC_POOL=4G and
+   HG_MALLOC_PREFAULT=<threads>. Returns 0 on success and -1 with errno set on failure */
+int hg_malloc_pool(size_t size, unsigned int threads);
+
+/* Restrict the blocks the calling thread allocates from now on to pages of the cache colours set in mask,
+   so that threads given disjoint masks do not evict each other from the cache. Colours split the sets of the
+   last level cache, or of the level given in HG_MALLOC_COLOUR_LEVEL, and are taken from the physical frames
+   when /proc/self/pagemap shows them and from the virtual addresses otherwise. A mask of 0 lifts the
+   restriction, and HG_MALLOC_COLOURS=<mask> sets the one threads start with. A caller can restrict a single
+   allocation by setting a mask around it. Blocks larger than a huge page, blocks longer than the longest run
+   of consecutive colours in the mask and blocks aligned to more than a page are not restricted. Returns 0 on
+   success and -1 with errno set on failure */
+int hg_malloc_colours(unsigned long mask);
+
+/* Return the cache colour of the page holding the given address, or -1 with errno set if the cache is
+   unknown. The address may belong to anyone */
+int hg_malloc_colour(const void *addr);
+
+/* Snapshot of the allocator stats. The counters marked as profiled stay at zero unless the allocator is
+   built with profiling support */
+typedef struct {
+	size_t		heap_used;		/* Bytes handed out, trackers included */
+	size_t		max_heap_used;		/* Peak of heap_used, without the tracker overhead */
+	size_t		max_request;		/* Largest request (profiled) */
+	size_t		mallocs;		/* Allocations (profiled) */
+	size_t		frees;			/* Deallocations (profiled) */
+	size_t		trackers;		/* Live chunks (profiled) */
+	size_t		max_trackers;		/* Peak of trackers (profiled) */
+	size_t		reused_trackers;	/* Allocations served from a free or cached chunk (profiled) */
+	size_t		page_size;		/* Size of the huge pages backing the heap */
+	size_t		segments;		/* Heap segments (profiled) */
+	size_t		hugetlb_mappings;	/* Mappings backed by the hugetlbfs pool (profiled) */
+	size_t		thp_mappings;		/* Mappings backed by transparent huge pages (profiled) */
+	size_t		normal_mappings;	/* Mappings backed by normal pages (profiled) */
+	size_t		large_mappings;		/* Mappings of large chunks, cached ones included (profiled) */
+	size_t		large_cached;		/* Cached mappings of large chunks */
+	size_t		purged_mappings;	/* Mappings given back to the system once idle (profiled) */
+	size_t		slab_used;		/* Bytes handed out in slab slots, which are not part of heap_used (profiled) */
+	size_t		slab_runs;		/* Slab runs cut into slots of a class (profiled) */
+	size_t		remote_frees;		/* Slots given straight back to slab runs other threads own (profiled) */
+	size_t		max_steps;		/* Most steps one call took through the heap: segments or cached chunks
+						   walked over, bitmap scans, free list operations, splits and merges (profiled) */
+	int		tlsf;			/* Whether TLSF mode is on, asked for with HG_MALLOC_TLSF=1 */
+	void		*fixed_base;		/* Base the heap is laid out from with HG_MALLOC_BASE=<address>, NULL if none */
+	size_t		colour_used;		/* Bytes handed out in colour pages, which are not part of heap_used (profiled) */
+	size_t		colour_pages;		/* Colour pages holding blocks (profiled) */
+	size_t		colour_segments;	/* Segments mapped for colour pages, which are never given back */
+	size_t		colour_size;		/* Bytes of cache behind each colour */
+	unsigned int	colours;		/* Cache colours threads can be restricted to, 0 if the cache is unknown */
+	int		colour_physical;	/* Whether colours come from physical frames rather than virtual addresses */
+} hg_malloc_stats_t;
+
+/* Fill in a snapshot of the stats. No lock is taken, so counters may be a little out of step with each
+   other while other threads allocate */
+void hg_malloc_stats(hg_malloc_stats_t *stats);
+
+/* Print the stats to the given file descriptor. This does not allocate, but it formats with snprintf
+   and must not be called from a signal handler. The stats are also printed at exit with
+   HG_MALLOC_STATS=1, and by a thread of the allocator whenever the signal number given in
+   HG_MALLOC_STATS_SIGNAL is received */
+void hg_malloc_stats_print(int fd);
+
+/* Paths through malloc and free which the latency instrumentation tells apart */
+enum {
+	HG_LAT_MALLOC_INIT,		/* First call, which sets the heap up */
+	HG_LAT_MALLOC_COLOUR,		/* Placed in a page of the colours of the thread */
+	HG_LAT_MALLOC_SLAB,		/* Given a slot in a slab run */
+	HG_LAT_MALLOC_CACHE,		/* Served from the thread cache */
+	HG_LAT_MALLOC_REFILL,		/* Thread cache refilled from the depot */
+	HG_LAT_MALLOC_REUSE,		/* Free chunk taken out of the free lists */
+	HG_LAT_MALLOC_EXPAND,		/* Carved out of the end of a segment */
+	HG_LAT_MALLOC_SEGMENT,		/* Carved out of a newly mapped segment */
+	HG_LAT_MALLOC_LARGE,		/* Given a mapping of its own */
+	HG_LAT_FREE_COLOUR,		/* Given back to its colour page */
+	HG_LAT_FREE_SLAB,		/* Slot given back to its slab run */
+	HG_LAT_FREE_REMOTE,		/* Slot given straight back to a slab run another thread owns */
+	HG_LAT_FREE_CACHE,		/* Put in the thread cache */
+	HG_LAT_FREE_FLUSH,		/* Put in the thread cache, which overflowed to the depot */
+	HG_LAT_FREE_HEAP,		/* Given back to the shared heap */
+	HG_LAT_FREE_LARGE,		/* Mapping of its own cached or unmapped */
+	HG_LAT_PATHS
+};
+
+/* Latency percentiles of one path, in nanoseconds */
+typedef struct {
+	size_t		count;
+	size_t		p50;
+	size_t		p99;
+	size_t		p999;
+	size_t		max;
+} hg_malloc_latency_t;
+
+/* Fill in the latency percentiles of every path. The latency instrumentation must be built in with
+   -DLATENCY_MASTER_CONTROL=1, otherwise this returns -1 with errno set to ENOSYS. The stats printouts
+   include the percentiles when it is */
+int hg_malloc_latency(hg_malloc_latency_t lat[HG_LAT_PATHS]);
+
+/* Events counted by hg_perf_begin and hg_perf_end */
+enum {
+	HG_PERF_DTLB_LOAD_MISSES,
+	HG_PERF_LLC_MISSES,
+	HG_PERF_PAGE_FAULTS,
+	HG_PERF_EVENTS
+};
+
+/* Performance counters of one region of code */
+typedef struct {
+	int			fd[HG_PERF_EVENTS];
+	unsigned long long	start[HG_PERF_EVENTS];
+	unsigned long long	count[HG_PERF_EVENTS];	/* Events counted in the region */
+	int			valid[HG_PERF_EVENTS];	/* Whether the count is available */
+} hg_perf_t;
+
+/* Count the dTLB load misses, LLC misses and page faults of the calling thread, and of the threads it
+   creates, from hg_perf_begin to hg_perf_end. Events the system cannot count are left invalid, except for
+   page faults which fall back to getrusage. hg_perf_begin returns how many events perf can count and
+   hg_perf_end how many counts are valid */
+int hg_perf_begin(hg_perf_t *perf);
+int hg_perf_end(hg_perf_t *perf);
+
+#endif
@@ -0,0 +1,199 @@
+/**********************************************************************************************************************
+ * Hardware Performance Counters
+ *
+ * This file lets a program measure the dTLB load misses, LLC misses and page faults of a region of its code, so that
+ * the effect of the allocator on the miss rate can be quantified. The counters come from perf_event_open and cover
+ * the calling thread and the threads it creates within the region. Counters which the system does not offer, e.g.
+ * hardware events in a virtual machine or with a strict perf_event_paranoid, are reported as unavailable, and page
+ * faults fall back to getrusage
+ *********************************************************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "hg_malloc.h"
+
+/*********************************************
+ * Macro Definitions
+ *********************************************/
+
+/* The generic hardware cache event for data TLB read misses */
+#define PERF_DTLB_LOAD_MISSES										\
+		(PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |			\
+		 (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+/*********************************************
+ * Global Variables
+ *********************************************/
+
+/* The perf event behind each counter */
+static const struct {
+	unsigned int		type;
+	unsigned long long	config;
+} perf_events[HG_PERF_EVENTS] = {
+	[HG_PERF_DTLB_LOAD_MISSES]	= { PERF_TYPE_HW_CACHE, PERF_DTLB_LOAD_MISSES },
+	[HG_PERF_LLC_MISSES]		= { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+	[HG_PERF_PAGE_FAULTS]		= { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+};
+
+/*********************************************
+ * Helper Functions
+ *********************************************/
+
+/*
+ *
+ * Name:
+ * perf_open
+ *
+ * Description:
+ * This is a helper function which opens a disabled counter for the given
+ * event on the calling thread and the threads it creates. Only user space
+ * is counted, which is what an unprivileged process is allowed to do. It
+ * returns -1 if the event is not available
+ *
+ */
+static int perf_open(unsigned int event)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = perf_events[event].type;
+	attr.config = perf_events[event].config;
+	attr.disabled = 1;
+	attr.inherit = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/*
+ *
+ * Name:
+ * perf_read
+ *
+ * Description:
+ * This is a helper function which reads a counter. When the counter had to
+ * share the hardware with other events, its value is scaled up to the whole
+ * time it was enabled
+ *
+ */
+static int perf_read(int fd, unsigned long long *count)
+{
+	unsigned long long values[3];
+
+	if (read(fd, values, sizeof(values)) != sizeof(values))
+		return -1;
+
+	if (values[2] == 0) {
+		*count = 0;
+		return 0;
+	}
+
+	*count = (values[2] < values[1]) ? (unsigned long long)((double)values[0] * values[1] / values[2]) : values[0];
+
+	return 0;
+}
+
+/*
+ *
+ * Name:
+ * rusage_faults
+ *
+ * Description:
+ * This is a helper function which reads the page faults taken by the whole
+ * process so far, for systems without perf events
+ *
+ */
+static unsigned long long rusage_faults(void)
+{
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+
+	return usage.ru_minflt + usage.ru_majflt;
+}
+
+/*********************************************
+ * Performance Counter API
+ *********************************************/
+
+/*
+ *
+ * Name:
+ * hg_perf_begin
+ *
+ * Description:
+ * This function opens and starts every available counter. It returns the
+ * number of counters which are backed by perf events
+ *
+ */
+int hg_perf_begin(hg_perf_t *perf)
+{
+	unsigned int	event;
+	int		available = 0;
+
+	memset(perf, 0, sizeof(*perf));
+
+	for (event = 0; event < HG_PERF_EVENTS; event++) {
+		perf->fd[event] = perf_open(event);
+
+		if (perf->fd[event] >= 0)
+			available++;
+	}
+
+	/* Page faults can still be counted the old way */
+	if (perf->fd[HG_PERF_PAGE_FAULTS] < 0)
+		perf->start[HG_PERF_PAGE_FAULTS] = rusage_faults();
+
+	/* Start the counters last so that setting them up is not counted */
+	for (event = 0; event < HG_PERF_EVENTS; event++)
+		if (perf->fd[event] >= 0)
+			ioctl(perf->fd[event], PERF_EVENT_IOC_ENABLE, 0);
+
+	return available;
+}
+
+/*
+ *
+ * Name:
+ * hg_perf_end
+ *
+ * Description:
+ * This function stops the counters, reads them and closes them. It returns
+ * the number of counters which could be read
+ *
+ */
+int hg_perf_end(hg_perf_t *perf)
+{
+	unsigned int	event;
+	int		valid = 0;
+
+	for (event = 0; event < HG_PERF_EVENTS; event++)
+		if (perf->fd[event] >= 0)
+			ioctl(perf->fd[event], PERF_EVENT_IOC_DISABLE, 0);
+
+	for (event = 0; event < HG_PERF_EVENTS; event++) {
+		perf->valid[event] = 0;
+
+		if (perf->fd[event] >= 0) {
+			perf->valid[event] = (perf_read(perf->fd[event], &perf->count[event]) == 0);
+			close(perf->fd[event]);
+			perf->fd[event] = -1;
+		} else if (event == HG_PERF_PAGE_FAULTS) {
+			perf->count[event] = rusage_faults() - perf->start[event];
+			perf->valid[event] = 1;
+		}
+
+		valid += perf->valid[event];
+	}
+
+	return valid;
+}
@@ -0,0 +1,228 @@
+/**********************************************************************************************************************
+ * Allocation Traces
+ *
+ * This file records every call to malloc, free and realloc to a file, so that the allocation pattern of a program
+ * can be replayed offline against different allocators with tools/hg_replay. The file is memory mapped and each
+ * thread appends to a chunk of its own, so recording a call takes neither a lock nor a system call. Only the
+ * mapping of a new chunk, once per TRACE_CHUNK_SIZE bytes of records, goes through the kernel
+ *********************************************************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "hg_trace.h"
+
+/*********************************************
+ * Global Variables
+ *********************************************/
+
+/* The chunk a thread is currently writing to */
+typedef struct {
+	trace_record_t		*chunk;
+	trace_record_t		*next;
+	trace_record_t		*end;
+	unsigned int		thread;
+	int			started;
+	int			failed;
+} trace_buf_t;
+
+static __thread trace_buf_t trace_buf;
+static pthread_key_t	trace_key;
+static int		trace_fd = -1;
+static unsigned long	trace_offset = TRACE_HEADER_SIZE;
+static unsigned int	trace_threads;
+
+/*********************************************
+ * Helper Functions
+ *********************************************/
+
+/*
+ *
+ * Name:
+ * trace_release
+ *
+ * Description:
+ * This is a helper function which unmaps the chunk of an exiting thread.
+ * Its records stay in the file
+ *
+ */
+static void trace_release(void *arg)
+{
+	(void)arg;
+
+	if (trace_buf.chunk != NULL)
+		munmap(trace_buf.chunk, TRACE_CHUNK_SIZE);
+
+	trace_buf.chunk = trace_buf.next = trace_buf.end = NULL;
+}
+
+/*
+ *
+ * Name:
+ * trace_refill
+ *
+ * Description:
+ * This is a helper function which hands the calling thread the next free
+ * chunk of the file, growing the file to make room for it. A thread which
+ * cannot get a chunk stops recording. The errno of the caller is kept
+ *
+ */
+static int trace_refill(void)
+{
+	unsigned long	offset;
+	void		*chunk;
+	int		saved_errno = errno;
+
+	if (trace_buf.failed)
+		return -1;
+
+	trace_release(NULL);
+
+	/* Threads are told apart by the order in which they started recording */
+	if (!trace_buf.started) {
+		trace_buf.started = 1;
+		trace_buf.thread = __atomic_fetch_add(&trace_threads, 1, __ATOMIC_RELAXED);
+	}
+
+	offset = __atomic_fetch_add(&trace_offset, TRACE_CHUNK_SIZE, __ATOMIC_RELAXED);
+
+	/* Writing the last byte grows the file, and unlike ftruncate never shrinks it under another thread */
+	if (pwrite(trace_fd, "", 1, offset + TRACE_CHUNK_SIZE - 1) != 1)
+		goto fail;
+
+	chunk = mmap(NULL, TRACE_CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, trace_fd, offset);
+
+	if (chunk == MAP_FAILED)
+		goto fail;
+
+	trace_buf.chunk = trace_buf.next = chunk;
+	trace_buf.end = trace_buf.chunk + TRACE_CHUNK_SIZE / sizeof(trace_record_t);
+
+	/* The chunk is unmapped when the thread exits */
+	pthread_setspecific(trace_key, &trace_buf);
+
+	errno = saved_errno;
+
+	return 0;
+
+fail:
+	trace_buf.failed = 1;
+	errno = saved_errno;
+
+	return -1;
+}
+
+/*
+ *
+ * Name:
+ * trace_fork
+ *
+ * Description:
+ * This is a helper function which stops a forked child from recording,
+ * since it would write to the chunks of its parent
+ *
+ */
+static void trace_fork(void)
+{
+	close(trace_fd);
+	trace_fd = -1;
+}
+
+/*********************************************
+ * Tracing API
+ *********************************************/
+
+/*
+ *
+ * Name:
+ * trace_open
+ *
+ * Description:
+ * This function creates the trace file and writes its header. Recording
+ * starts right away. A %p in the path is replaced by the process id, so
+ * that processes started by the traced program get files of their own.
+ * Otherwise the last process to start wins. The file is written under a
+ * temporary name and renamed into place, since truncating the file of a
+ * running process would make its next record fault
+ *
+ */
+void trace_open(const char *path)
+{
+	trace_header_t	header;
+	char		name[PATH_MAX], tmp[PATH_MAX + 32];
+	const char	*pid;
+	int		fd;
+
+	if (path == NULL || *path == '\0')
+		return;
+
+	pid = strstr(path, "%p");
+
+	if (pid != NULL)
+		snprintf(name, sizeof(name), "%.*s%d%s", (int)(pid - path), path, getpid(), pid + 2);
+	else
+		snprintf(name, sizeof(name), "%s", path);
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp%d", name, getpid());
+
+	fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+	if (fd < 0)
+		return;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+	header.version = TRACE_VERSION;
+	header.record_size = sizeof(trace_record_t);
+	header.chunk_size = TRACE_CHUNK_SIZE;
+
+	if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header) || ftruncate(fd, TRACE_HEADER_SIZE) != 0 ||
+	    rename(tmp, name) != 0 || pthread_key_create(&trace_key, trace_release) != 0) {
+		unlink(tmp);
+		close(fd);
+		return;
+	}
+
+	pthread_atfork(NULL, NULL, trace_fork);
+
+	__atomic_store_n(&trace_fd, fd, __ATOMIC_RELEASE);
+}
+
+/*
+ *
+ * Name:
+ * trace_record
+ *
+ * Description:
+ * This function appends one call to the chunk of the calling thread
+ *
+ */
+void trace_record(unsigned int op, void *ptr, void *arg, unsigned long size)
+{
+	trace_record_t	*record;
+	struct timespec	ts;
+
+	if (__atomic_load_n(&trace_fd, __ATOMIC_ACQUIRE) < 0)
+		return;
+
+	if (trace_buf.next == trace_buf.end && trace_refill() != 0)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	record = trace_buf.next++;
+	record->time = ts.tv_sec * 1000000000UL + ts.tv_nsec;
+	record->ptr = (uintptr_t)ptr;
+	record->arg = (uintptr_t)arg;
+	record->size = size;
+	record->thread = trace_buf.thread;
+	record->op = op;
+}
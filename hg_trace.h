@@ -0,0 +1,56 @@
+/**********************************************************************************************************************
+ * Allocation Traces
+ *
+ * This header describes the trace file written by the allocator when it is built with TRACE_MASTER_CONTROL=1 and
+ * run with HG_MALLOC_TRACE=<file>, and read back by tools/hg_replay. A %p in the file name stands for the process id
+ *
+ * The file starts with one page holding the header. The rest of it is made of chunks of TRACE_CHUNK_SIZE bytes,
+ * each of which belongs to a single thread and holds its records in the order they were written. The unused tail
+ * of a chunk is zeroed, i.e. made of records with op TRACE_OP_NONE
+ *********************************************************************************************************************/
+
+#ifndef HG_TRACE_H
+#define HG_TRACE_H
+
+#include <stdint.h>
+
+/* Identifies a trace file and the version of its format */
+#define TRACE_MAGIC		"HGTRACE"
+#define TRACE_VERSION		1
+
+/* Size of the header page and of the chunks handed to each thread */
+#define TRACE_HEADER_SIZE	4096UL
+#define TRACE_CHUNK_SIZE	(1024UL * 1024)
+
+/* Calls which are recorded. Calloc is kept apart from malloc since it also writes the whole block */
+#define TRACE_OP_NONE		0
+#define TRACE_OP_MALLOC		1
+#define TRACE_OP_CALLOC		2
+#define TRACE_OP_MEMALIGN	3
+#define TRACE_OP_REALLOC	4
+#define TRACE_OP_FREE		5
+
+typedef struct {
+	char			magic[8];
+	uint32_t		version;
+	uint32_t		record_size;
+	uint64_t		chunk_size;
+} trace_header_t;
+
+/* One call. Pointers are recorded as they were returned, the replay turns them into ids. Allocations are
+   stamped once they return and frees before they start, so that a block is always allocated before it is
+   freed in the order of the timestamps */
+typedef struct {
+	uint64_t		time;		/* CLOCK_MONOTONIC in nanoseconds */
+	uint64_t		ptr;		/* Block returned, or freed for TRACE_OP_FREE */
+	uint64_t		arg;		/* Block given to realloc, or alignment asked for */
+	uint64_t		size : 48;	/* Size asked for */
+	uint64_t		thread : 12;	/* Order in which the thread wrote its first record */
+	uint64_t		op : 4;
+} trace_record_t;
+
+/* Start tracing to the given file, and record one call. Both are no-ops unless tracing was asked for */
+void trace_open(const char *path);
+void trace_record(unsigned int op, void *ptr, void *arg, unsigned long size);
+
+#endif
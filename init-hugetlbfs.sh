@@ -16,3 +16,8 @@
 mount | grep hugetlbfs || mount -t hugetlbfs none /mnt/huge
 echo 1024 > /proc/sys/vm/nr_hugepages
 
+
+# Optionally reserve 1GB pages as well, used with HG_MALLOC_PAGE_SIZE=1G
+if [ -n "$HUGE_1G_PAGES" ]; then
+	echo $HUGE_1G_PAGES > /sys/kernel/mm/hugepages/hugepages-1048576kB/nr_hugepages
+fi
@@ -5,19 +5,114 @@
  * huge pages to provide the requesting application with non-fragmented physically contiguous memory range.
  * The purpose for using this kind of allocation scheme is to reduce the variation in miss-rate that an
  * application sees from run-to-run due to disparity in the virutal memory pages allocated by the OS
+ *
+ * By default the entry points are named __wrap_malloc etc. and are linked in with -Wl,-wrap. When built with
+ * HG_PRELOAD they replace malloc etc. directly, so that the library can be dropped in with LD_PRELOAD
  *********************************************************************************************************************/
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+#include <semaphore.h>
+#include <malloc.h>
 #include <sys/mman.h>
 #include "list.h"
+#include "hg_malloc.h"
+#include "hg_trace.h"
 
 /*********************************************
  * Macro Definitions
  *********************************************/
 
-/* This macro defines the size of one huge page */
-#define SYS_HUGE_PAGE_SIZE	2048 * 1024
+/* This macro defines the size of one huge page. Segments may use larger huge pages, see page_size,
+   but never smaller ones */
+#define SYS_HUGE_PAGE_SIZE	(2048 * 1024)
+
+/* Number of address bits covered by one huge page */
+#define SYS_HUGE_PAGE_SHIFT	21
+
+/* The huge page sizes offered by the system are listed here, one directory per size */
+#define SYS_HUGE_PAGE_DIR	"/sys/kernel/mm/hugepages"
+
+/* The transparent huge page mode of the system, the active one is in brackets */
+#define SYS_THP_ENABLED		"/sys/kernel/mm/transparent_hugepage/enabled"
+
+/* The caches of the first CPU are described here, one directory per cache */
+#define SYS_CACHE_DIR		"/sys/devices/system/cpu/cpu0/cache"
+
+/* The physical frame backing every virtual page of the process. Frame numbers read as zero without
+   CAP_SYS_ADMIN */
+#define SYS_PAGEMAP		"/proc/self/pagemap"
+#define PAGEMAP_PRESENT		(1UL << 63)
+#define PAGEMAP_PFN_MASK	((1UL << 55) - 1)
+
+/* Segments come from the first of these tiers which can back them: the hugetlbfs pool, transparent
+   huge pages or, as a last resort, normal pages */
+#define SEG_TIER_HUGETLB	0
+#define SEG_TIER_THP		1
+#define SEG_TIER_NORMAL		2
+#define SEG_TIERS		3
+
+/* Empty segments and cached large mappings are given back to the system once they have been idle for
+   this many milliseconds, unless HG_MALLOC_DECAY_MS says otherwise. A negative decay keeps them forever */
+#define PURGE_DECAY_MS		1000
+
+/* Number of segments the purge thread looks at before it lets go of the heap lock for a while */
+#define PURGE_SCAN		64
+
+/* Counters updated outside of the heap lock are kept in shards of one cache line each, which are only
+   added up when the stats are read. Each thread owns a shard while it runs and bumps its counters without
+   atomic operations. Threads beyond the first STATS_SHARDS ones share one more shard atomically. The free
+   shards are tracked in a single word, so there are at most 64 of them */
+#define STATS_SHARDS		64
+
+/* Pools are faulted in by at most this many threads */
+#define POOL_MAX_THREADS	64
+
+/* Ask the kernel to fault pages in without touching them, if the headers predate it */
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE	23
+#endif
+
+/* Map at the given address only if nothing lives there yet. Kernels older than 4.17 take it as a hint */
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE	0x100000
+#endif
+
+/* With HG_MALLOC_BASE=<address> the heap is laid out from that address up. Up to FIXED_HOLES ranges given
+   back are kept for reuse, and a range found taken by someone else is skipped at most FIXED_TRIES times.
+   The base must be aligned to SYS_HUGE_PAGE_SIZE and lie below FIXED_LIMIT, the end of the address space
+   the segment map covers for user space */
+#define FIXED_HOLES		256
+#define FIXED_TRIES		64
+#define FIXED_LIMIT		(1UL << 47)
+
+/* Chunk sizes, tracker included, are multiples of CHUNK_ALIGN bytes and every chunk starts right before
+   a CHUNK_ALIGN boundary, so that the memory handed out is aligned for any type. A chunk must be large
+   enough to hold a free list node once it is freed, and small enough for the size field of its tracker */
+#define CHUNK_ALIGN		16
+#define CHUNK_MIN_SIZE		((sizeof(track_t) + sizeof(struct list_head) + CHUNK_ALIGN - 1) & ~(CHUNK_ALIGN - 1))
+#define CHUNK_MAX_SIZE		(((1UL << 30) - 1) * CHUNK_ALIGN)
+
+/* Chunks of at least LARGE_MIN_SIZE bytes get a mapping of their own instead of being carved out of
+   the shared segments. Up to LARGE_CACHE_SLOTS freed mappings, LARGE_CACHE_BYTES bytes in total, are
+   kept around for the next large requests */
+#define LARGE_MIN_SIZE		(SYS_HUGE_PAGE_SIZE / 2)
+#define LARGE_CACHE_SLOTS	8
+#define LARGE_CACHE_BYTES	(64UL << 20)
+
+/* Largest request we accept. Its segment, headers included, must still fit in a single chunk */
+#define MEM_MAX_REQUEST		(CHUNK_MAX_SIZE - 2 * SYS_HUGE_PAGE_SIZE)
 
 /* This macro calculates the address of a memory chunk from a given tracker address */
 #define MEM_GET_ADDRESS(track_ptr)									\
@@ -27,23 +122,191 @@
 #define MEM_GET_TRACKER(addr_ptr)									\
 		(void *)((unsigned long)addr_ptr - (unsigned long)(sizeof(track_t)))
 
-/* This macro calculates the total size of the memory region we have for allocation */
-#define MEM_GET_SIZE(mem_start)										\
-		((unsigned long)(mem_start) + (unsigned long)(SYS_HUGE_PAGE_SIZE))
+/* This macro rounds a mapping up to a whole number of pages of the given size */
+#define SEG_ROUND(size, page)										\
+		(((size) + (page) - 1) & ~((unsigned long)(page) - 1))
+
+/* This macro calculates where the first chunk of a segment starts */
+#define SEG_GET_START(seg)										\
+		((void *)((((unsigned long)(seg) + sizeof(segment_t) + sizeof(track_t) + CHUNK_ALIGN - 1)	\
+			& ~(CHUNK_ALIGN - 1UL)) - sizeof(track_t)))
+
+/* This macro calculates the end address of the memory region covered by a segment */
+#define SEG_GET_LIMIT(seg)										\
+		((unsigned long)(seg) + (unsigned long)((seg)->size))
+
+/* This macro rounds a request up to the size of the chunk holding it, tracker included */
+#define CHUNK_ROUND(size)										\
+		(((size) + sizeof(track_t) < CHUNK_MIN_SIZE) ? CHUNK_MIN_SIZE :				\
+		((size) + sizeof(track_t) + CHUNK_ALIGN - 1) & ~(CHUNK_ALIGN - 1UL))
+
+/* This is what a chunk costs on top of the memory it hands out, for requests which are a multiple of
+   CHUNK_ALIGN bytes */
+#define CHUNK_OVERHEAD		((sizeof(track_t) + CHUNK_ALIGN - 1) & ~(CHUNK_ALIGN - 1))
+
+/* These macros give the size of a chunk in bytes, with and without its tracker */
+#define CHUNK_SIZE(track_ptr)										\
+		((unsigned long)(track_ptr)->size * CHUNK_ALIGN)
+
+#define MEM_SIZE(track_ptr)										\
+		(CHUNK_SIZE(track_ptr) - sizeof(track_t))
+
+/* These macros get the trackers of the chunks right after and right before a given chunk */
+#define CHUNK_NEXT(track_ptr)										\
+		((track_t *)((unsigned long)(track_ptr) + CHUNK_SIZE(track_ptr)))
+
+#define CHUNK_PREV(track_ptr)										\
+		((track_t *)((unsigned long)(track_ptr) - (unsigned long)(track_ptr)->prev_size * CHUNK_ALIGN))
+
+/* The segment map translates any address into the segment that contains it with two table lookups.
+   Each first level entry covers 1 GB and each second level entry covers one huge page */
+#define SEG_MAP_L2_SHIFT	30
+#define SEG_MAP_L1_ENTRIES	(1UL << (48 - SEG_MAP_L2_SHIFT))
+#define SEG_MAP_L2_ENTRIES	(1UL << (SEG_MAP_L2_SHIFT - SYS_HUGE_PAGE_SHIFT))
+
+#define SEG_MAP_L1_INDEX(addr)										\
+		(((unsigned long)(addr) >> SEG_MAP_L2_SHIFT) & (SEG_MAP_L1_ENTRIES - 1))
+
+#define SEG_MAP_L2_INDEX(addr)										\
+		(((unsigned long)(addr) >> SYS_HUGE_PAGE_SHIFT) & (SEG_MAP_L2_ENTRIES - 1))
+
+/* A free chunk keeps its free list node at the start of its memory, where the caller's data used to be */
+#define FREE_NODE(track_ptr)										\
+		((struct list_head *)MEM_GET_ADDRESS(track_ptr))
 
-/* This macro calculates the current end of the memory region 
-   CAUTION : The list must not be empty */
-#define MEM_GET_END()											\
-		(void *)((unsigned long)((container_of(alloc_list.prev, track_t, list))->address) 	\
-			+ (unsigned long)((container_of(alloc_list.prev, track_t, list))->size))
+#define FREE_TRACKER(list_node)										\
+		((track_t *)MEM_GET_TRACKER(list_node))
+
+/* A cached chunk keeps the pointer to the next chunk of its cache at the same place */
+#define CACHE_NEXT(track_ptr)										\
+		(*(track_t **)MEM_GET_ADDRESS(track_ptr))
+
+/* Free chunks are indexed by size class. Chunks below FREE_CLASS_SMALL_MAX bytes get one class per
+   FREE_CLASS_SMALL_STEP bytes, larger ones get one class per power of two. In TLSF mode every power of
+   two is further split into TLSF_SL_COUNT classes */
+#define FREE_CLASS_SMALL_STEP	16
+#define FREE_CLASS_SMALL_MAX	1024
+#define FREE_CLASS_SMALL	(FREE_CLASS_SMALL_MAX / FREE_CLASS_SMALL_STEP)
+#define TLSF_SL_BITS		4
+#define TLSF_SL_COUNT		(1 << TLSF_SL_BITS)
+#define FREE_CLASS_COUNT	(FREE_CLASS_SMALL + (64 - 10) * TLSF_SL_COUNT)
+#define FREE_CLASS_WORDS	((FREE_CLASS_COUNT + 63) / 64)
+
+/* Requests up to TCACHE_MAX_SIZE bytes which do not get a slab slot are served from per-thread caches
+   holding one list of chunks per FREE_CLASS_SMALL_STEP bytes. Chunks move between a thread cache and the
+   shared depot TCACHE_BATCH at a time */
+#define TCACHE_MAX_SIZE		FREE_CLASS_SMALL_MAX
+#define TCACHE_CLASSES		(TCACHE_MAX_SIZE / FREE_CLASS_SMALL_STEP)
+#define TCACHE_BATCH		16
+#define TCACHE_LIMIT		(4 * TCACHE_BATCH)
+#define DEPOT_LIMIT		(16 * TCACHE_BATCH)
+
+/* This macro gives the size of the chunks carved for a thread cache class, tracker included */
+#define TCACHE_CLASS_SIZE(class)									\
+		((class) * FREE_CLASS_SMALL_STEP + CHUNK_MIN_SIZE)
+
+/* This macro maps a request to the thread cache class whose chunks are all large enough for it */
+#define TCACHE_CLASS(size)										\
+		((CHUNK_ROUND(size) - CHUNK_MIN_SIZE) / FREE_CLASS_SMALL_STEP)
+
+/* This macro maps a chunk to the largest thread cache class it can serve. Chunks which were too
+   small to split may be slightly larger than the chunks of the last class */
+#define TCACHE_CHUNK_CLASS(track_ptr)									\
+		((CHUNK_SIZE(track_ptr) >= TCACHE_CLASS_SIZE(TCACHE_CLASSES - 1)) ? TCACHE_CLASSES - 1 :	\
+		(CHUNK_SIZE(track_ptr) - CHUNK_MIN_SIZE) / FREE_CLASS_SMALL_STEP)
+
+/* Requests up to SLAB_MAX_SIZE bytes get a slot in a slab run instead of a chunk, unless HG_MALLOC_SLAB=0
+   leaves them to the thread caches. Slabs cover all but the last class of the thread caches, since picking
+   one of the two for requests of random sizes made malloc and free mispredict about every other call. The
+   last class is left to the heap so that kilobyte blocks are still carved from a hg_malloc_pool. A slab
+   segment is one huge page cut into SLAB_RUNS runs of SLAB_RUN_SIZE bytes. The first run holds the run
+   headers and every other run is cut into slots of a single class, with one class per SLAB_STEP bytes */
+#define SLAB_MAX_SIZE		(TCACHE_MAX_SIZE - SLAB_STEP)
+#define SLAB_STEP		16
+#define SLAB_CLASSES		(SLAB_MAX_SIZE / SLAB_STEP)
+#define SLAB_RUN_SHIFT		16
+#define SLAB_RUN_SIZE		(1UL << SLAB_RUN_SHIFT)
+#define SLAB_RUNS		(SYS_HUGE_PAGE_SIZE / SLAB_RUN_SIZE)
+#define SLAB_WORDS		(SLAB_RUN_SIZE / SLAB_STEP / 64)
+
+/* Number of full runs a thread checks for slots given back by other threads whenever it runs dry */
+#define SLAB_SCAN		4
+
+/* Slots freed by a thread which does not own their run go straight back to the run, which is then pushed
+   onto the remote queue of its owner. The first REMOTE_QUEUES threads to take slots get a queue, the runs
+   of the others wait for their owner to scan them. The free queues are tracked in a single word, so there
+   are at most 64 of them */
+#define REMOTE_QUEUES		64
+
+/* This macro maps a request to the slab class whose slots are large enough for it */
+#define SLAB_CLASS(size)										\
+		(((size) + ((size) == 0) + SLAB_STEP - 1) / SLAB_STEP - 1)
+
+/* This macro gives the size of the slots of a slab class */
+#define SLAB_CLASS_SIZE(class)										\
+		(((class) + 1) * SLAB_STEP)
+
+/* This macro finds the slab segment holding a run header or a slot, from its address alone */
+#define SLAB_SEGMENT(addr_ptr)										\
+		((slab_segment_t *)((unsigned long)(addr_ptr) & ~(SYS_HUGE_PAGE_SIZE - 1)))
+
+/* This macro finds the header of the slab run holding a slot, from the address of the slot alone */
+#define SLAB_RUN(addr_ptr)										\
+		(&((slab_segment_t *)((unsigned long)(addr_ptr) & ~(SYS_HUGE_PAGE_SIZE - 1)))->runs[		\
+			((unsigned long)(addr_ptr) >> SLAB_RUN_SHIFT) & (SLAB_RUNS - 1)])
+
+/* Free slots sitting in a thread cache are chained through their first word */
+#define SLAB_NEXT(addr_ptr)										\
+		(*(void **)(addr_ptr))
+
+/* Threads restricted to some cache colours get their blocks from colour segments, which are cut into pages
+   of COLOUR_PAGE bytes with their headers kept apart in the first pages. Blocks up to COLOUR_SLOT_MAX bytes
+   share a page with blocks of the same power of two, larger ones get a span of whole pages. The cache is
+   split into COLOUR_MAX colours at most, each one a range of sets which pages of that colour map to */
+#define COLOUR_PAGE		4096UL
+#define COLOUR_PAGES		(SYS_HUGE_PAGE_SIZE / COLOUR_PAGE)
+#define COLOUR_MAX		64
+#define COLOUR_SLOT_MIN		16
+#define COLOUR_SLOT_MAX		2048
+#define COLOUR_CLASSES		8
+#define COLOUR_WORDS		(COLOUR_PAGE / COLOUR_SLOT_MIN / 64)
+
+/* Colour segments are touched in full and never given back, so there are at most COLOUR_SEG_LIMIT of
+   them. A huge page only covers a few colours, so a request which finds no page of its colours maps new
+   segments until one has some, and the pages of other colours are kept for the threads which want them */
+#define COLOUR_SEG_LIMIT	64
+
+/* States of a colour page */
+#define COLOUR_PAGE_HEADER	0
+#define COLOUR_PAGE_FREE	1
+#define COLOUR_PAGE_SLOTS	2
+#define COLOUR_PAGE_SPAN	3
+#define COLOUR_PAGE_TAIL	4
+
+/* This macro maps a request to the colour class whose slots are large enough for it */
+#define COLOUR_CLASS(size)										\
+		(((size) <= COLOUR_SLOT_MIN) ? 0 : 64 - __builtin_clzl((size) - 1) - 4)
+
+/* This macro finds the header of the colour page holding an address, from the address alone */
+#define COLOUR_PAGE_OF(addr_ptr)									\
+		(&((colour_segment_t *)((unsigned long)(addr_ptr) & ~(SYS_HUGE_PAGE_SIZE - 1)))->pages[	\
+			((unsigned long)(addr_ptr) / COLOUR_PAGE) & (COLOUR_PAGES - 1)])
+
+/* This macro gives the address of the page a colour page header describes */
+#define COLOUR_PAGE_ADDR(page_ptr)									\
+		((char *)((unsigned long)(page_ptr) & ~(SYS_HUGE_PAGE_SIZE - 1)) +				\
+			((page_ptr) - ((colour_segment_t *)((unsigned long)(page_ptr) & ~(SYS_HUGE_PAGE_SIZE - 1)))->pages) * COLOUR_PAGE)
+
+/* States of a chunk. Cached chunks sit in a thread cache or in the depot and look allocated to the heap */
+#define CHUNK_IN_USE		0
+#define CHUNK_FREE		1
+#define CHUNK_CACHED		2
 
-/* This macro gets the tracker pointer from the linked list node */
-#define TRACKER(list_node)										\
-		(container_of(list_node, track_t, list))
-		
 /* Turn profiling on or off completely. In case profiling is turned on, statements are
    selectively profiled using the PROFILE mechanism defined below */
+#ifndef PROFILE_MASTER_CONTROL
 #define PROFILE_MASTER_CONTROL	1
+#endif
 
 #if (PROFILE_MASTER_CONTROL == 1)
   #define PROFILE(control, statement) PROFILE_##control(statement)
@@ -54,33 +317,477 @@
 #define PROFILE_ON(statement) 	statement
 #define PROFILE_OFF(statement)
 
+/* Turn the latency instrumentation on or off. When it is on, every call to malloc and free is timed with
+   the TSC and counted in a histogram of the path it took */
+#ifndef LATENCY_MASTER_CONTROL
+#define LATENCY_MASTER_CONTROL	0
+#endif
+
+#if (LATENCY_MASTER_CONTROL == 1)
+  #define LATENCY(statement) statement
+#else
+  #define LATENCY(statement)
+#endif
+
+/* Turn the trace recorder on or off. When it is on and HG_MALLOC_TRACE names a file, every call to malloc,
+   free and realloc is written to that file for tools/hg_replay */
+#ifndef TRACE_MASTER_CONTROL
+#define TRACE_MASTER_CONTROL	0
+#endif
+
+#if (TRACE_MASTER_CONTROL == 1)
+  #define TRACE(statement) statement
+#else
+  #define TRACE(statement)
+#endif
+
+/* Latency histograms are log-linear. Values below 2 * LAT_SUB get a bucket each, and every power of two
+   above is split into LAT_SUB linear buckets, so a bucket is never wider than 1/LAT_SUB of its values */
+#define LAT_SUB_BITS		3
+#define LAT_SUB			(1 << LAT_SUB_BITS)
+#define LAT_BUCKETS		((64 - LAT_SUB_BITS + 1) * LAT_SUB)
+
+/* Stats are dumped at exit by default in the profiling builds which are linked in with -Wl,-wrap.
+   HG_MALLOC_STATS=0 or 1 says otherwise */
+#if (PROFILE_MASTER_CONTROL == 1) && !defined(HG_PRELOAD)
+#define STATS_DUMP_DEFAULT	1
+#else
+#define STATS_DUMP_DEFAULT	0
+#endif
+
+/* Names of the entry points, and of the allocator which owns every pointer we did not hand out. The
+   preload build looks the next allocator up the first time it meets one of its pointers */
+#ifdef HG_PRELOAD
+  #define HG_SYM(name)		name
+  #define HG_REAL(name)		((__typeof__(real_##name))real_lookup((void **)&real_##name, #name))
+#else
+  #define HG_SYM(name)		__wrap_##name
+  #define HG_REAL(name)		__real_##name
+#endif
+
 /*********************************************
  * Global Data
  ********************************************/
 
+/* A tracker is 8 bytes. Sizes are kept in CHUNK_ALIGN units and include the tracker, so the neighbours
+   of a chunk are found from the sizes alone. The size and the state of a chunk are only written by
+   whoever owns the chunk, while prev_size is only written under the heap lock */
 typedef struct {
-	struct list_head 	list;
-	void   			*address;
-	unsigned long 		size;
-	unsigned long 		free;
+	unsigned int		prev_size;
+	unsigned int 		size : 30;
+	unsigned int 		free : 2;
 } track_t;
 
-static struct list_head alloc_list;
-static void    		*g_mem_ptr;
+/* A segment is one mapping of huge pages. Its header sits at the start of the mapping and is followed
+   by the chunks carved out of it, from start up to top. Memory above fresh has never been handed out
+   and is still zeroed by the kernel. A large segment holds a single large chunk. Segments are always
+   aligned to SYS_HUGE_PAGE_SIZE, whichever tier backs them. An empty or cached segment records when it
+   went idle, and a pinned segment is never given back. A slab segment holds slab runs instead of chunks,
+   and a colour segment holds colour pages */
+typedef struct {
+	struct list_head	list;
+	track_t			*last;
+	void			*start;
+	void			*top;
+	void			*fresh;
+	unsigned long		size;
+	unsigned long		page;
+	unsigned long		idle;
+	int			tier;
+	int			large;
+	int			pinned;
+	int			slab;
+	int			colour;
+} segment_t;
+
+/* The remote queue of a thread, a stack of the slab runs which other threads gave slots back to. They push
+   onto it with a compare and swap and its owner takes the whole stack at once. Queues outlive the threads
+   which claim them, so that a push racing with the exit of the owner never lands in freed memory. A run
+   its owner gave up while another thread was still pushing it is left to whoever takes it off the queue,
+   and counts as an orphan of the queue until then */
+typedef struct {
+	struct slab_run		*head;
+	int			orphans;
+} __attribute__((aligned(64))) remote_queue_t;
+
+/* A slab run is a slice of a slab segment cut into slots of one class, which carry no header at all. Its
+   free slots are set bits in two bitmaps. The thread owning the run takes and gives back slots in local
+   without atomic operations, and other threads give them back in remote, which the owner merges into
+   local once it runs dry. A thread keeps the runs it owns on its own lists until it exits. Runs owned by
+   no thread sit on the partial list of their class while they have free slots, and on the pool of free
+   runs once all their slots are free, both of which count as listed. An owned run points to the remote
+   queue of its owner, if it has one, and sits on it while slots given back by other threads wait to be
+   merged. Threads giving slots back count themselves in releasing, and the segment of the run stays mapped
+   until they are done */
+typedef struct slab_run {
+	unsigned long		local[SLAB_WORDS];
+	struct list_head	list;
+	struct slab_run		*next;
+	void			*owner;
+	remote_queue_t		*queue;
+	struct slab_run		*remote_next;
+	char			*base;
+	unsigned int		size;
+	unsigned int		inv;
+	unsigned int		class;
+	unsigned int		slots;
+	unsigned int		words;
+	unsigned int		free;
+	unsigned int		hint;
+	int			full;
+	int			listed;
+	int			pending;
+	int			queued;
+	int			releasing;
+	unsigned long		remote[SLAB_WORDS] __attribute__((aligned(64)));
+} __attribute__((aligned(64))) slab_run_t;
+
+/* Layout of a slab segment. The headers fill the first run, which is never cut into slots. The segment
+   counts its runs in the pool, and goes idle once they all are */
+typedef struct {
+	segment_t		seg;
+	unsigned int		pooled;
+	slab_run_t		runs[SLAB_RUNS];
+} slab_segment_t;
+
+_Static_assert(sizeof(slab_segment_t) <= SLAB_RUN_SIZE, "slab headers must fit in the first run");
+
+/* A colour page is one page of a colour segment. Its header records the cache colour of the frame behind
+   it, and either the slots it is cut into, with the free ones as set bits in map, or the span of pages it
+   starts. Free pages sit on the free list of their colour, and pages with both free and used slots on the
+   partial list of their class and colour */
+typedef struct {
+	unsigned long		map[COLOUR_WORDS];
+	struct list_head	list;
+	unsigned int		size;
+	unsigned int		slots;
+	unsigned int		free;
+	unsigned int		pages;
+	unsigned char		colour;
+	unsigned char		class;
+	unsigned char		state;
+} __attribute__((aligned(64))) colour_page_t;
+
+/* Layout of a colour segment. The headers fill the first pages, which never hold blocks */
+typedef struct {
+	segment_t		seg;
+	colour_page_t		pages[COLOUR_PAGES];
+} colour_segment_t;
+
+#define COLOUR_HEADER_PAGES	((sizeof(colour_segment_t) + COLOUR_PAGE - 1) / COLOUR_PAGE)
+
+/* A range of the fixed address space which was given back and is not mapped */
+typedef struct {
+	unsigned long		addr;
+	unsigned long		size;
+} fixed_hole_t;
+
+/* One shard of the counters which are updated without holding the heap lock */
+typedef struct {
+	unsigned long		mallocs;
+	unsigned long		frees;
+	unsigned long		reused_trackers;
+	unsigned long		max_req;
+	unsigned long		slab_used;
+	unsigned long		max_steps;
+	unsigned long		remote_frees;
+} __attribute__((aligned(64))) stats_shard_t;
+
+/* Latency histograms of every path, one set per stats shard. Counts are in TSC cycles */
+typedef struct {
+	unsigned long		count[HG_LAT_PATHS][LAT_BUCKETS];
+	unsigned long		max[HG_LAT_PATHS];
+} lat_shard_t;
+
+/* Per-thread cache of chunks. Cached chunks are chained through CACHE_NEXT. Each thread also owns slab
+   runs, the one it takes slots from in every class and the others which have free slots or are full,
+   and caches the slots it frees in front of them the same way as chunks. It holds the shard its
+   counters go to, notes the path the current call takes when latency is measured, and counts the
+   steps the current call takes through the heap when profiling. A thread may be restricted to some cache colours,
+   which it takes pages of in turn. The remote queue it claims gets the slots other threads free in its
+   runs */
+typedef struct {
+	track_t			*head[TCACHE_CLASSES];
+	unsigned int		count[TCACHE_CLASSES];
+	void			*slab_head[SLAB_CLASSES];
+	unsigned int		slab_count[SLAB_CLASSES];
+	slab_run_t		*slab[SLAB_CLASSES];
+	struct list_head	slab_avail[SLAB_CLASSES];
+	struct list_head	slab_full[SLAB_CLASSES];
+	int			slab_ready;
+	int			registered;
+	int			stats_shared;
+	stats_shard_t		*stats;
+	unsigned int		lat_path;
+	unsigned int		steps;
+	unsigned long		colours;
+	int			colours_set;
+	unsigned int		colour_next;
+	remote_queue_t		*queue;
+} tcache_t;
+
+/* Shared pool of cached chunks for one class. Each class has its own lock and cache line */
+typedef struct {
+	pthread_mutex_t		lock;
+	track_t			*head;
+	unsigned int		count;
+} __attribute__((aligned(64))) depot_t;
+
+static __thread tcache_t tcache;
+static depot_t		depot[TCACHE_CLASSES] = { [0 ... TCACHE_CLASSES - 1] = { PTHREAD_MUTEX_INITIALIZER, NULL, 0 } };
+static pthread_key_t	tcache_key;
+static stats_shard_t	stats_shards[STATS_SHARDS + 1];
+static unsigned long	stats_free_shards = ~0UL;
+LATENCY(static lat_shard_t	lat_shards[STATS_SHARDS + 1]);
+
+/* Slab runs which no thread owns, partial ones chained through their next field and free ones through their
+   list node, and the slab segments. The slab lock protects them along with the owner and listed fields of
+   every run, the pooled count of every segment and the time the purge thread last collected the slots given
+   back to listed runs. Slabs stay off until the heap setup has read HG_MALLOC_SLAB, which malloc does before
+   it picks a path */
+static pthread_mutex_t	slab_lock = PTHREAD_MUTEX_INITIALIZER;
+static slab_run_t	*slab_partial[SLAB_CLASSES];
+static struct list_head	slab_pool;
+static struct list_head	slab_segs;
+static unsigned long	slab_collected;
+static int		slab_on;
+
+/* Remote queues and the ones no thread has claimed */
+static remote_queue_t	remote_queues[REMOTE_QUEUES];
+static unsigned long	remote_free_queues = ~0UL;
+
+/* Colour segments and the pages nobody uses yet, by colour. The colour lock protects them along with the
+   headers of every colour page. The geometry of the cache is read once at startup */
+static pthread_mutex_t	colour_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct list_head	colour_segs;
+static struct list_head	colour_free[COLOUR_MAX];
+static struct list_head	colour_partial[COLOUR_CLASSES][COLOUR_MAX];
+static unsigned long	colour_segments;
+static unsigned int	colours;
+static unsigned long	colour_unit;
+static unsigned long	colour_way;
+static unsigned long	colour_ways;
+static unsigned long	colour_default;
+static int		colour_on;
+static int		colour_physical;
+static int		colour_fd = -1;
+
+/* The fixed address space the heap is laid out in, up to fixed_next, and the holes in it in address order.
+   Mappings are given back without the heap lock, so the fixed lock protects them */
+static pthread_mutex_t	fixed_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long	fixed_base;
+static unsigned long	fixed_next;
+static fixed_hole_t	fixed_holes[FIXED_HOLES];
+static unsigned int	fixed_count;
+
+/* Everything below is protected by the heap lock */
+static pthread_mutex_t	heap_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct list_head seg_list;
+static segment_t	*cur_seg;
+static segment_t	**seg_map[SEG_MAP_L1_ENTRIES];
+static struct list_head free_lists[FREE_CLASS_COUNT];
+static unsigned long	free_map[FREE_CLASS_WORDS];
+static unsigned long	free_summary;
+static int		tlsf;
 static int 		init = 0;
+static unsigned long	heap_used = 0;
 static unsigned long	max_used = 0;
+static void		*fresh_start;
+static unsigned long	page_size = SYS_HUGE_PAGE_SIZE;
+static int		thp_enabled;
+static long		decay_ms = PURGE_DECAY_MS;
+static int		purge_pending;
+static pid_t		purge_pid;
+static pthread_cond_t	purge_cond;
+static segment_t	*purge_next;
+static unsigned long	large_bytes;
+static unsigned long	large_live;
+static int		stats_dump = STATS_DUMP_DEFAULT;
+static sem_t		stats_sem;
+static int		stats_asked;
+static segment_t	*large_cache[LARGE_CACHE_SLOTS];
+static unsigned int	large_cached;
+static unsigned long	large_cached_bytes;
+
+/* The allocator owning the pointers we did not hand out */
+#ifdef HG_PRELOAD
+static void		(*real_free)(void *);
+static void		*(*real_realloc)(void *, size_t);
+static size_t		(*real_malloc_usable_size)(void *);
+
+static inline void *real_lookup(void **real, const char *name)
+{
+	if (*real == NULL)
+		*real = dlsym(RTLD_NEXT, name);
+
+	return *real;
+}
+#else
+void			__real_free(void *);
+void			*__real_realloc(void *, size_t);
+size_t			__real_malloc_usable_size(void *);
+#endif
 
-/* These stats are tracked only when library is built with profiling support */
-PROFILE(ON, static unsigned long	max_req  = 0);
+/* These stats are tracked only when library is built with profiling support. The ones updated outside of
+   the heap lock live in the stats shards */
 PROFILE(ON, static unsigned long	trackers = 0);
 PROFILE(ON, static unsigned long	max_trackers = 0);
-PROFILE(ON, static unsigned long	reused_trackers = 0);
 PROFILE(ON, static unsigned long	max_trackers_new = 0);
+PROFILE(ON, static unsigned long	segments = 0);
+PROFILE(ON, static unsigned long	large_maps = 0);
+PROFILE(ON, static unsigned long	tier_maps[SEG_TIERS]);
+PROFILE(ON, static unsigned long	purged_maps = 0);
+PROFILE(ON, static unsigned long	max_used_trackers = 0);
+PROFILE(ON, static unsigned long	slab_runs = 0);
+PROFILE(ON, static unsigned long	colour_used = 0);
+PROFILE(ON, static unsigned long	colour_pages = 0);
+
+/* Profiling counters which are also updated outside of the heap lock */
+#define PROFILE_ATOMIC_ADD(counter, value)	__atomic_add_fetch(&(counter), (value), __ATOMIC_RELAXED)
+#define PROFILE_ATOMIC_MAX(counter, value)								\
+	do {												\
+		unsigned long __old = __atomic_load_n(&(counter), __ATOMIC_RELAXED);			\
+		while (__old < (value) && !__atomic_compare_exchange_n(&(counter), &__old, (value),	\
+						0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));		\
+	} while (0)
+
+/* Sharded counters. Only the shared shard needs atomic operations, the others have a single writer */
+#define STATS_ADD(field, value)										\
+	do {												\
+		stats_shard_t *__shard = stats_shard();							\
+		if (tcache.stats_shared)								\
+			PROFILE_ATOMIC_ADD(__shard->field, (value));					\
+		else											\
+			__atomic_store_n(&__shard->field, __shard->field + (value), __ATOMIC_RELAXED);	\
+	} while (0)
+#define STATS_MAX(field, value)										\
+	do {												\
+		stats_shard_t *__shard = stats_shard();							\
+		if (tcache.stats_shared)								\
+			PROFILE_ATOMIC_MAX(__shard->field, (value));					\
+		else if (__shard->field < (value))							\
+			__atomic_store_n(&__shard->field, (value), __ATOMIC_RELAXED);			\
+	} while (0)
 
 /*********************************************
  * Helper Functions
  ********************************************/
 
+static void stats_claim(void);
+
+/*
+ *
+ * Name:
+ * stats_shard
+ *
+ * Description:
+ * This is a helper function which returns the stats shard of the calling
+ * thread, claiming one the first time around
+ *
+ */
+static inline stats_shard_t *stats_shard(void)
+{
+	if (tcache.stats == NULL)
+		stats_claim();
+
+	return tcache.stats;
+}
+
+/*
+ *
+ * Name:
+ * lat_now
+ *
+ * Description:
+ * This is a helper function which reads the TSC, or a nanosecond clock on
+ * processors which do not have one
+ *
+ */
+static inline unsigned long lat_now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+#endif
+}
+
+/*
+ *
+ * Name:
+ * lat_bucket
+ *
+ * Description:
+ * This is a helper function which maps a latency to its histogram bucket
+ *
+ */
+static inline unsigned int lat_bucket(unsigned long value)
+{
+	unsigned int shift;
+
+	if (value < 2 * LAT_SUB)
+		return value;
+
+	shift = 63 - __builtin_clzl(value) - LAT_SUB_BITS;
+
+	return (shift + 1) * LAT_SUB + (value >> shift) - LAT_SUB;
+}
+
+/*
+ *
+ * Name:
+ * lat_bucket_limit
+ *
+ * Description:
+ * This is a helper function which returns the largest latency counted in
+ * the given histogram bucket
+ *
+ */
+static inline unsigned long lat_bucket_limit(unsigned int bucket)
+{
+	unsigned int shift;
+
+	if (bucket < 2 * LAT_SUB)
+		return bucket;
+
+	shift = bucket / LAT_SUB - 1;
+
+	return ((unsigned long)(LAT_SUB + bucket % LAT_SUB + 1) << shift) - 1;
+}
+
+#if (LATENCY_MASTER_CONTROL == 1)
+/*
+ *
+ * Name:
+ * lat_record
+ *
+ * Description:
+ * This is a helper function which counts a call that started at the given
+ * TSC value in the histogram of the given path
+ *
+ */
+static inline void lat_record(unsigned int path, unsigned long start)
+{
+	unsigned long	cycles = lat_now() - start;
+	lat_shard_t	*lat = &lat_shards[stats_shard() - stats_shards];
+
+	if (tcache.stats_shared) {
+		PROFILE_ATOMIC_ADD(lat->count[path][lat_bucket(cycles)], 1);
+		PROFILE_ATOMIC_MAX(lat->max[path], cycles);
+		return;
+	}
+
+	__atomic_store_n(&lat->count[path][lat_bucket(cycles)], lat->count[path][lat_bucket(cycles)] + 1, __ATOMIC_RELAXED);
+
+	if (cycles > lat->max[path])
+		__atomic_store_n(&lat->max[path], cycles, __ATOMIC_RELAXED);
+}
+#endif
+
 /*
  *
  * Name:
@@ -91,19 +798,24 @@ PROFILE(ON, static unsigned long	max_trackers_new = 0);
  * with the information regaring the on-going memory allocation
  *
  */
-static inline void populate_tracker(track_t *tracker, unsigned long size)
+static inline void populate_tracker(segment_t *seg, track_t *tracker, unsigned long size)
 {
-	/* Add this allocated chunk to tracker list */
-	INIT_LIST_HEAD(&tracker->list);
-	list_add_tail(&tracker->list, &alloc_list);
-
 	/* Populate the tracker with information about this allocation */
-	tracker->size = size;
-	tracker->address = MEM_GET_ADDRESS(tracker);
-	tracker->free = 0;
+	tracker->prev_size = (seg->last != NULL) ? seg->last->size : 0;
+	tracker->size = size / CHUNK_ALIGN;
+	tracker->free = CHUNK_IN_USE;
+
+	/* This chunk is now the last one of its segment. Free reads the top without the heap lock */
+	seg->last = tracker;
+	__atomic_store_n(&seg->top, (void *)CHUNK_NEXT(tracker), __ATOMIC_RELAXED);
+
+	/* Let calloc know where the untouched part of this chunk starts */
+	fresh_start = (seg->fresh > (void *)tracker) ? seg->fresh : (void *)tracker;
+	if (seg->top > seg->fresh)
+		seg->fresh = seg->top;
 
 	/* Increment the number of active trackers */
-	PROFILE(ON, trackers++);
+	PROFILE(ON, PROFILE_ATOMIC_ADD(trackers, 1));
 	PROFILE(ON, max_trackers_new++);
 
 	/* Keep track of overall maximum number of trackers */
@@ -112,163 +824,4685 @@ static inline void populate_tracker(track_t *tracker, unsigned long size)
 	return;
 }
 
-
-/*********************************************
- * Function Definitions
- ********************************************/
-
-/* 
+/*
  *
  * Name:
- * __wrap_malloc
+ * free_class
  *
  * Description:
- * This function intercepts the call to malloc and performs
- * dynamic memory allocation on behalf of the caller
+ * This is a helper function which maps a chunk size to the free list
+ * holding chunks of that size
  *
  */
-void *__wrap_malloc(size_t size)
+static inline unsigned int free_class(unsigned long size)
 {
-	track_t		*tracker = NULL;
-	void		*mem_end = NULL;
-
-	/* Find out if this is the first call to malloc */
-	if (init == 0) {
-		init = 1;
-		
-		/* Initialize a linked list to track allocations */
-		INIT_LIST_HEAD(&alloc_list);
-
-		/* Allocate one huge page to take care of all the memory requests of this application */
-		g_mem_ptr = mmap(0, SYS_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	unsigned int fl;
 
-		/* Verify that the allocation was successful */
-		if (g_mem_ptr == MAP_FAILED) {
-			perror("Allocation from Huge Page Pool Failed. Please verify that hugetlbfs is properly mounted!");
-			exit(1);
-		}
-
-		/* Place a malloc header at the start of the memory area */
-		tracker = (track_t *)g_mem_ptr;
+	if (size < FREE_CLASS_SMALL_MAX)
+		return size / FREE_CLASS_SMALL_STEP;
 
-		/* Populate the tracker with information regaring this allocation */
-		populate_tracker(tracker, (unsigned long)size);
+	/* One class per power of two starting at FREE_CLASS_SMALL_MAX */
+	fl = 63 - __builtin_clzl(size);
 
-		/* We need to track max_used here as well because this is the one-time init case */
-		max_used = (unsigned long)MEM_GET_ADDRESS(g_mem_ptr) + (unsigned long)size;
+	if (!tlsf)
+		return FREE_CLASS_SMALL + fl - 10;
 
-		/* Nothing needs to be done for initializtion case */
-		goto done;
-	}
+	/* Split by the bits right below the leading one in TLSF mode */
+	return FREE_CLASS_SMALL + (fl - 10) * TLSF_SL_COUNT + ((size >> (fl - TLSF_SL_BITS)) & (TLSF_SL_COUNT - 1));
+}
 
-	/* No free chunk of the right size available. Allocate a chunk in the memory page */
-	if (list_empty(&alloc_list)) {
-		/* Since the list is empty, there are no trackers */
-		PROFILE(ON, max_trackers_new = 0);
+/*
+ *
+ * Name:
+ * free_map_find
+ *
+ * Description:
+ * This is a helper function which finds the first class at or above the
+ * given one which has free chunks. The summary word tells which words of
+ * the bitmap have a bit set, so this takes two bit scans at most. It
+ * returns -1 when there is none
+ *
+ */
+static inline int free_map_find(unsigned int class)
+{
+	unsigned int	word = class / 64;
+	unsigned long	bits, words;
 
-		/* List is empty so create the first chunk */
-		tracker = (track_t *)g_mem_ptr;
+	if (word >= FREE_CLASS_WORDS)
+		return -1;
 
-		/* Populate the tracker with information regaring this allocation */
-		populate_tracker(tracker, (unsigned long)size);
+	bits = free_map[word] & (~0UL << (class % 64));
+	PROFILE(ON, tcache.steps++);
 
-		/* We need to track max_used here as well */
-		PROFILE(ON, max_used = (unsigned long)MEM_GET_ADDRESS(g_mem_ptr) + (unsigned long)size);
+	if (bits == 0) {
+		words = free_summary & ~((2UL << word) - 1);
+		PROFILE(ON, tcache.steps++);
 
-		/* Return the address to the caller */
-		goto done;
-	} else {
-		/* Look through the allocated chunks to find an appropriate sized one which is free */
-		list_for_each_entry(tracker, &alloc_list, list) {
-			if (tracker->free && tracker->size >= size) {
-				/* Found the right chunk */
-				tracker->free = 0;
+		if (words == 0)
+			return -1;
 
-				/* Keep track of trackers reusage information */
-				PROFILE(ON, reused_trackers++);
+		word = __builtin_ctzl(words);
+		bits = free_map[word];
+	}
 
-				/* Return the tracker to caller */
-				goto done;
-			}
-		}
+	return word * 64 + __builtin_ctzl(bits);
+}
 
-		/* Expand the list */
-		mem_end = MEM_GET_END();
+/*
+ *
+ * Name:
+ * free_list_insert
+ *
+ * Description:
+ * This is a helper function which makes a free chunk available for reuse
+ * by adding it to the free list of its size class
+ *
+ */
+static inline void free_list_insert(track_t *tracker)
+{
+	unsigned int class = free_class(CHUNK_SIZE(tracker));
 
-		/* Since we are expanding the heap, this is the best place to record max heap usage */
-		max_used = (unsigned long)MEM_GET_ADDRESS(mem_end) + (unsigned long)size;
+	/* Reuse the most recently freed chunk first as it is likely to be cache hot */
+	list_add(FREE_NODE(tracker), &free_lists[class]);
+	free_map[class / 64] |= 1UL << (class % 64);
+	free_summary |= 1UL << (class / 64);
 
-		/* Make sure that we have enough memory */
-		if (max_used >= MEM_GET_SIZE(g_mem_ptr)) {
-			/* Out of Memory!!! */
-			printf("We are out of Memory!\n");
+	PROFILE(ON, tcache.steps++);
+}
 
-			/* Exit the program */
-			exit(-1);
-		}
+/*
+ *
+ * Name:
+ * free_list_remove
+ *
+ * Description:
+ * This is a helper function which takes a chunk off its free list
+ *
+ */
+static inline void free_list_remove(track_t *tracker)
+{
+	unsigned int class = free_class(CHUNK_SIZE(tracker));
 
-		/* Place a tracker at the current end of memory area */
-		tracker = (track_t *)mem_end;
+	list_del(FREE_NODE(tracker));
 
-		/* Populate the tracker with information regaring this allocation */
-		populate_tracker(tracker, (unsigned long)size);
+	if (list_empty(&free_lists[class])) {
+		free_map[class / 64] &= ~(1UL << (class % 64));
 
-		/* Return the address to the caller */
-		goto done;
+		if (free_map[class / 64] == 0)
+			free_summary &= ~(1UL << (class / 64));
 	}
 
-done:
-
-	/* Find out if this the largest allocation request so far */
-	PROFILE(ON, max_req = (size < max_req) ? max_req : size);
-
-	/* Return the address to caller */
-	return tracker->address;
+	PROFILE(ON, tcache.steps++);
 }
 
-/* 
+/*
  *
  * Name:
- * __wrap_free
+ * free_list_search
  *
  * Description:
- * This function intercepts the call to free. It frees the allocated memory
- * and performs defragmentation whenever possible 
+ * This is a helper function which finds a free chunk of at least the given
+ * size in constant time. Only the head of the exact size class is checked
+ * because every chunk in a higher class is large enough by construction.
+ * TLSF mode rounds the size up to the next class instead, so that the head
+ * of the class it lands in is always large enough
  *
  */
-void __wrap_free(void *ptr)
+static inline track_t *free_list_search(unsigned long size)
 {
-	track_t *tracker;
+	unsigned int	class = free_class(size);
+	track_t		*tracker;
+	int		found;
 
-	/* Get the tracker from the address */
-	tracker = MEM_GET_TRACKER(ptr);
+	if (tlsf) {
+		if (size >= FREE_CLASS_SMALL_MAX)
+			class = free_class(size + (1UL << (63 - __builtin_clzl(size) - TLSF_SL_BITS)) - 1);
 
-	/* Mark the tracker as free */
-	tracker->free = 1;
+		goto search;
+	}
 
-	/* If the tracker is the last chunk in the heap, then delete it */
-	if ((tracker->list).next == &alloc_list) {
-		list_del_init(&tracker->list);
+	/* Try the most recently freed chunk of the exact size class */
+	if (!list_empty(&free_lists[class])) {
+		tracker = FREE_TRACKER(free_lists[class].next);
 
-		/* Keep freeing chunks until all free blocks are deleted from linked list */
-		while (!(list_empty(&alloc_list)) && TRACKER(alloc_list.prev)->free == 1) {
-			list_del_init(alloc_list.prev);
+		if (CHUNK_SIZE(tracker) >= size)
+			return tracker;
+	}
 
-			/* Decrement the number of trackers */
-			PROFILE(ON, trackers--);
-		}
+	class++;
 
-		/* Decrement the number of trackers */
-		PROFILE(ON, trackers--);
-	}
+search:
+	/* Find the first non-empty class from there using the bitmap */
+	found = free_map_find(class);
 
-	PROFILE(ON, printf("\n***** Allocator Stats\n"));
-	PROFILE(ON, printf("Heap Usage        : %lu Bytes\n", (list_empty(&alloc_list))? 0 : (unsigned long)MEM_GET_END() - (unsigned long)g_mem_ptr));
-	PROFILE(ON, printf("Max Heap Used     : %lu Bytes\n", max_used - (unsigned long)g_mem_ptr - (max_trackers * sizeof(track_t))));
-	PROFILE(ON, printf("Max Request       : %lu Bytes\n", max_req));
-	PROFILE(ON, printf("Trackers          : %lu\n", trackers));
-	PROFILE(ON, printf("Max Trackers      : %lu\n", max_trackers));
-	PROFILE(ON, printf("Reused Trackers   : %lu\n\n", reused_trackers));
+	if (found < 0)
+		return NULL;
 
-	return;
+	return FREE_TRACKER(free_lists[found].next);
+}
+
+/*
+ *
+ * Name:
+ * seg_lookup
+ *
+ * Description:
+ * This is a helper function which finds the segment containing the given
+ * address in constant time. It returns NULL for addresses outside the heap
+ *
+ */
+static inline segment_t *seg_lookup(void *addr)
+{
+	segment_t **leaf = __atomic_load_n(&seg_map[SEG_MAP_L1_INDEX(addr)], __ATOMIC_ACQUIRE);
+
+	return (leaf == NULL) ? NULL : __atomic_load_n(&leaf[SEG_MAP_L2_INDEX(addr)], __ATOMIC_ACQUIRE);
+}
+
+/*
+ *
+ * Name:
+ * seg_map_insert
+ *
+ * Description:
+ * This is a helper function which records every huge page of a segment in
+ * the segment map. Second level tables are mapped the first time a 1 GB
+ * range of the address space is used
+ *
+ */
+static int seg_map_insert(segment_t *seg)
+{
+	unsigned long	addr;
+	segment_t	***leaf;
+	segment_t	**table;
+
+	for (addr = (unsigned long)seg; addr < SEG_GET_LIMIT(seg); addr += SYS_HUGE_PAGE_SIZE) {
+		leaf = &seg_map[SEG_MAP_L1_INDEX(addr)];
+
+		if (*leaf == NULL) {
+			table = mmap(0, SEG_MAP_L2_ENTRIES * sizeof(segment_t *), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+			if (table == MAP_FAILED)
+				return -1;
+
+			/* Publish the table only once it is ready because free reads the map without the heap lock */
+			__atomic_store_n(leaf, table, __ATOMIC_RELEASE);
+		}
+
+		__atomic_store_n(&(*leaf)[SEG_MAP_L2_INDEX(addr)], seg, __ATOMIC_RELEASE);
+	}
+
+	return 0;
+}
+
+/*
+ *
+ * Name:
+ * clock_ms
+ *
+ * Description:
+ * This is a helper function which reads a cheap monotonic clock in
+ * milliseconds, good enough to tell how long memory has been idle
+ *
+ */
+static inline unsigned long clock_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ *
+ * Name:
+ * fixed_insert
+ *
+ * Description:
+ * This is a helper function which puts a range back into the holes of the
+ * fixed address space, merged with its neighbours. A hole reaching the end
+ * of the address space handed out moves the end back instead. The range is
+ * dropped if there is no room left for it, which only costs address space.
+ * It must be called with the fixed lock held
+ *
+ */
+static void fixed_insert(unsigned long addr, unsigned long size)
+{
+	unsigned int i;
+
+	/* Find the first hole above the range */
+	for (i = 0; i < fixed_count && fixed_holes[i].addr < addr; i++)
+		;
+
+	/* Merge with the hole below */
+	if (i > 0 && fixed_holes[i - 1].addr + fixed_holes[i - 1].size == addr) {
+		i--;
+		addr = fixed_holes[i].addr;
+		size += fixed_holes[i].size;
+		fixed_count--;
+		memmove(&fixed_holes[i], &fixed_holes[i + 1], (fixed_count - i) * sizeof(fixed_hole_t));
+	}
+
+	/* Merge with the hole above */
+	if (i < fixed_count && addr + size == fixed_holes[i].addr) {
+		size += fixed_holes[i].size;
+		fixed_count--;
+		memmove(&fixed_holes[i], &fixed_holes[i + 1], (fixed_count - i) * sizeof(fixed_hole_t));
+	}
+
+	if (addr + size == fixed_next) {
+		fixed_next = addr;
+		return;
+	}
+
+	if (fixed_count == FIXED_HOLES)
+		return;
+
+	memmove(&fixed_holes[i + 1], &fixed_holes[i], (fixed_count - i) * sizeof(fixed_hole_t));
+	fixed_holes[i].addr = addr;
+	fixed_holes[i].size = size;
+	fixed_count++;
+}
+
+/*
+ *
+ * Name:
+ * fixed_take
+ *
+ * Description:
+ * This is a helper function which picks the range of the fixed address space
+ * the next mapping of the given size and alignment goes to. The lowest hole
+ * it fits in wins, and the end of the address space handed out otherwise, so
+ * that the same sequence of mappings always lands at the same addresses
+ *
+ */
+static unsigned long fixed_take(unsigned long size, unsigned long align)
+{
+	unsigned long	addr, end, hole;
+	unsigned int	i;
+
+	pthread_mutex_lock(&fixed_lock);
+
+	for (i = 0; i < fixed_count; i++) {
+		hole = fixed_holes[i].addr;
+		end = hole + fixed_holes[i].size;
+		addr = SEG_ROUND(hole, align);
+
+		if (addr + size > end)
+			continue;
+
+		/* Whatever is left on either side stays a hole */
+		fixed_count--;
+		memmove(&fixed_holes[i], &fixed_holes[i + 1], (fixed_count - i) * sizeof(fixed_hole_t));
+
+		if (addr > hole)
+			fixed_insert(hole, addr - hole);
+
+		if (addr + size < end)
+			fixed_insert(addr + size, end - addr - size);
+
+		goto done;
+	}
+
+	addr = SEG_ROUND(fixed_next, align);
+
+	if (addr > fixed_next)
+		fixed_insert(fixed_next, addr - fixed_next);
+
+	fixed_next = addr + size;
+
+done:
+	pthread_mutex_unlock(&fixed_lock);
+
+	return addr;
+}
+
+/*
+ *
+ * Name:
+ * fixed_give
+ *
+ * Description:
+ * This is a helper function which gives a range which is no longer mapped
+ * back to the fixed address space. It does nothing unless the heap has a
+ * fixed base
+ *
+ */
+static void fixed_give(void *addr, unsigned long size)
+{
+	if (!fixed_base)
+		return;
+
+	pthread_mutex_lock(&fixed_lock);
+	fixed_insert((unsigned long)addr, size);
+	pthread_mutex_unlock(&fixed_lock);
+}
+
+/*
+ *
+ * Name:
+ * fixed_map
+ *
+ * Description:
+ * This is a helper function which maps anonymous memory of the given size
+ * and alignment in the fixed address space, without ever replacing a mapping
+ * which is already there. A range somebody else took is left alone and the
+ * next one is tried. It returns MAP_FAILED on failure
+ *
+ */
+static void *fixed_map(unsigned long size, unsigned long align, int prot, int flags)
+{
+	unsigned long	addr;
+	void		*ptr;
+	int		tries;
+
+	for (tries = 0; tries < FIXED_TRIES; tries++) {
+		addr = fixed_take(size, align);
+
+		if (addr + size > FIXED_LIMIT) {
+			fixed_give((void *)addr, size);
+			break;
+		}
+
+		ptr = mmap((void *)addr, size, prot, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE | flags, -1, 0);
+
+		if (ptr == (void *)addr)
+			return ptr;
+
+		/* Older kernels map somewhere else rather than failing */
+		if (ptr != MAP_FAILED)
+			munmap(ptr, size);
+		else if (errno != EEXIST) {
+			fixed_give((void *)addr, size);
+			break;
+		}
+	}
+
+	return MAP_FAILED;
+}
+
+/*
+ *
+ * Name:
+ * heap_unmap
+ *
+ * Description:
+ * This is a helper function which unmaps a range of the heap and gives it
+ * back to the fixed address space, if there is one
+ *
+ */
+static void heap_unmap(void *addr, unsigned long size)
+{
+	munmap(addr, size);
+	fixed_give(addr, size);
+}
+
+/*
+ *
+ * Name:
+ * map_aligned
+ *
+ * Description:
+ * This is a helper function which maps anonymous memory of the given size at
+ * an address aligned to the given power of two, at least SYS_HUGE_PAGE_SIZE,
+ * so that the segment map can find it and transparent huge pages can back it.
+ * It maps a little more than asked and trims the excess on both sides, unless
+ * the heap has a fixed base. It returns MAP_FAILED on failure
+ *
+ */
+static void *map_aligned(unsigned long size, unsigned long align, int prot, int flags)
+{
+	unsigned long	addr, aligned;
+
+	if (fixed_base)
+		return fixed_map(size, align, prot, flags);
+
+	addr = (unsigned long)mmap(0, size + align, prot, MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+
+	if ((void *)addr == MAP_FAILED)
+		return MAP_FAILED;
+
+	aligned = SEG_ROUND(addr, align);
+
+	if (aligned > addr)
+		munmap((void *)addr, aligned - addr);
+
+	munmap((void *)(aligned + size), addr + align - aligned);
+
+	return (void *)aligned;
+}
+
+/*
+ *
+ * Name:
+ * segment_map
+ *
+ * Description:
+ * This is a helper function which maps a new segment of at least the given
+ * size and makes it reachable from the addresses it covers. It tries huge
+ * pages of the given size first, then SYS_HUGE_PAGE_SIZE pages, and falls
+ * back to transparent huge pages and finally to normal pages when the
+ * hugetlbfs pool cannot back the segment. It returns NULL when we are out
+ * of memory
+ *
+ */
+static segment_t *segment_map(unsigned long size, unsigned long page)
+{
+	segment_t	*seg;
+	unsigned long	map_size;
+	int		tier = SEG_TIER_HUGETLB;
+
+	for (;;) {
+		map_size = SEG_ROUND(size, page);
+
+		/* The size of the huge pages is encoded in the flags as its log2 */
+		if (fixed_base)
+			seg = fixed_map(map_size, page, PROT_READ | PROT_WRITE, MAP_HUGETLB |
+					(__builtin_ctzl(page) << MAP_HUGE_SHIFT));
+		else
+			seg = mmap(0, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+					(__builtin_ctzl(page) << MAP_HUGE_SHIFT), -1, 0);
+
+		if (seg != MAP_FAILED || page == SYS_HUGE_PAGE_SIZE)
+			break;
+
+		page = SYS_HUGE_PAGE_SIZE;
+	}
+
+	if (seg == MAP_FAILED) {
+		/* The hugetlbfs pool is empty or missing, so let the kernel back the segment as it can */
+		seg = map_aligned(map_size, SYS_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, 0);
+
+		if (seg == MAP_FAILED)
+			return NULL;
+
+		tier = SEG_TIER_NORMAL;
+		if (thp_enabled && madvise(seg, map_size, MADV_HUGEPAGE) == 0)
+			tier = SEG_TIER_THP;
+	}
+
+	seg->size = map_size;
+	seg->page = page;
+	seg->tier = tier;
+	seg->start = SEG_GET_START(seg);
+	seg->top = seg->start;
+	seg->fresh = seg->start;
+	seg->last = NULL;
+	seg->large = 0;
+	seg->pinned = 0;
+	seg->slab = 0;
+	seg->colour = 0;
+
+	/* Make the segment reachable from the addresses it covers */
+	if (seg_map_insert(seg) < 0) {
+		heap_unmap(seg, map_size);
+		return NULL;
+	}
+
+	/* Keep track of the tiers backing our mappings */
+	PROFILE(ON, tier_maps[tier]++);
+
+	return seg;
+}
+
+/*
+ *
+ * Name:
+ * segment_link
+ *
+ * Description:
+ * This is a helper function which chains a mapped segment to the list of
+ * segments, after which new chunks are carved out of it. It must be called
+ * with the heap lock held
+ *
+ */
+static void segment_link(segment_t *seg)
+{
+	list_add_tail(&seg->list, &seg_list);
+
+	/* New chunks are carved out of the most recent segment */
+	cur_seg = seg;
+
+	/* Keep track of the number of segments */
+	PROFILE(ON, segments++);
+}
+
+/*
+ *
+ * Name:
+ * segment_create
+ *
+ * Description:
+ * This is a helper function which maps a new segment large enough to hold
+ * a chunk of the given size and chains it to the list of segments. It
+ * returns NULL when we are out of memory
+ *
+ */
+static segment_t *segment_create(unsigned long size)
+{
+	segment_t	*seg;
+
+	seg = segment_map(sizeof(segment_t) + CHUNK_ALIGN + size, page_size);
+
+	if (seg == NULL)
+		return NULL;
+
+	segment_link(seg);
+
+	return seg;
+}
+
+/*
+ *
+ * Name:
+ * seg_map_remove
+ *
+ * Description:
+ * This is a helper function which drops every huge page of a segment from
+ * the segment map
+ *
+ */
+static void seg_map_remove(segment_t *seg)
+{
+	unsigned long	addr;
+
+	for (addr = (unsigned long)seg; addr < SEG_GET_LIMIT(seg); addr += SYS_HUGE_PAGE_SIZE)
+		__atomic_store_n(&seg_map[SEG_MAP_L1_INDEX(addr)][SEG_MAP_L2_INDEX(addr)], NULL, __ATOMIC_RELEASE);
+}
+
+/*
+ *
+ * Name:
+ * segment_resize
+ *
+ * Description:
+ * This is a helper function which grows the mapping of a segment holding a
+ * single chunk so that the chunk can reach the given size. The kernel moves
+ * the pages along with the mapping if it has to, so nothing is copied. It
+ * returns the new location of the segment, or NULL if the mapping cannot grow
+ *
+ */
+static segment_t *segment_resize(segment_t *seg, unsigned long size)
+{
+	segment_t	*new_seg;
+	void		*dest = NULL;
+	unsigned long	map_size, offset, old_size = seg->size;
+
+	/* The chunk keeps its place in the mapping */
+	map_size = SEG_ROUND((unsigned long)seg->start - (unsigned long)seg + size, seg->page);
+
+	/* The segment may move, so take it out of the map and of the list first */
+	seg_map_remove(seg);
+	if (!seg->large) {
+		/* The purge thread goes on from the next segment if it was about to look at this one */
+		if (purge_next == seg)
+			purge_next = (seg->list.next != &seg_list) ? list_entry(seg->list.next, segment_t, list) : NULL;
+
+		list_del(&seg->list);
+	}
+
+	/* Only huge pages keep a moved mapping aligned, other tiers are moved over an aligned reservation.
+	   So is every tier of a heap with a fixed base, which must not let the kernel pick the address */
+	if (seg->tier != SEG_TIER_HUGETLB || fixed_base) {
+		dest = map_aligned(map_size, seg->page, PROT_NONE, MAP_NORESERVE);
+
+		if (dest == MAP_FAILED) {
+			new_seg = NULL;
+			goto restore;
+		}
+
+		new_seg = mremap(seg, old_size, map_size, MREMAP_MAYMOVE | MREMAP_FIXED, dest);
+	} else {
+		new_seg = mremap(seg, old_size, map_size, MREMAP_MAYMOVE);
+	}
+
+	if (new_seg == MAP_FAILED) {
+		if (dest != NULL)
+			heap_unmap(dest, map_size);
+
+		new_seg = NULL;
+		goto restore;
+	}
+
+	/* Every pointer into the segment moves along with it */
+	offset = (unsigned long)new_seg - (unsigned long)seg;
+	new_seg->size = map_size;
+	new_seg->start = (void *)((unsigned long)new_seg->start + offset);
+	new_seg->last = (track_t *)((unsigned long)new_seg->last + offset);
+	new_seg->top = (void *)((unsigned long)new_seg->top + offset);
+	new_seg->fresh = (void *)((unsigned long)new_seg->fresh + offset);
+
+	if (seg_map_insert(new_seg) == 0) {
+		fixed_give(seg, old_size);
+
+		if (cur_seg == seg)
+			cur_seg = new_seg;
+
+		if (!new_seg->large)
+			list_add_tail(&new_seg->list, &seg_list);
+		else
+			large_bytes += map_size - old_size;
+
+		return new_seg;
+	}
+
+	/* We could not map the new range so put the segment back where it was */
+	seg_map_remove(new_seg);
+	new_seg->size = old_size;
+	new_seg->start = (void *)((unsigned long)new_seg->start - offset);
+	new_seg->last = (track_t *)((unsigned long)new_seg->last - offset);
+	new_seg->top = (void *)((unsigned long)new_seg->top - offset);
+	new_seg->fresh = (void *)((unsigned long)new_seg->fresh - offset);
+
+	if (mremap(new_seg, map_size, old_size, MREMAP_MAYMOVE | MREMAP_FIXED, seg) == MAP_FAILED)
+		abort();
+
+	fixed_give(new_seg, map_size);
+
+	new_seg = NULL;
+
+restore:
+	seg_map_insert(seg);
+	if (!seg->large)
+		list_add_tail(&seg->list, &seg_list);
+
+	return new_seg;
+}
+
+
+static void tcache_destroy(void *arg);
+
+/*
+ *
+ * Name:
+ * parse_size
+ *
+ * Description:
+ * This is a helper function which parses a size given as a number of bytes
+ * with an optional K, M or G suffix. It returns 0 if the size is malformed
+ *
+ */
+static unsigned long parse_size(const char *str)
+{
+	unsigned long	size;
+	char		*end;
+
+	size = strtoul(str, &end, 10);
+
+	switch (*end) {
+	case 'g': case 'G':
+		size <<= 10;
+		/* Fall through */
+	case 'm': case 'M':
+		size <<= 10;
+		/* Fall through */
+	case 'k': case 'K':
+		size <<= 10;
+		end++;
+		break;
+	}
+
+	/* Allow 2MB, 1GiB or 2048kB as well */
+	if (*end == 'i')
+		end++;
+	if (*end == 'b' || *end == 'B')
+		end++;
+
+	return (end == str || *end != '\0') ? 0 : size;
+}
+
+/*
+ *
+ * Name:
+ * sys_read
+ *
+ * Description:
+ * This is a helper function which reads a small system file into the given
+ * buffer as a string. Plain system calls are used because the allocator
+ * must not allocate while it initializes. It returns -1 on failure
+ *
+ */
+static int sys_read(const char *path, char *buf, size_t size)
+{
+	ssize_t	len;
+	int	fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	len = read(fd, buf, size - 1);
+	close(fd);
+
+	if (len <= 0)
+		return -1;
+
+	buf[len] = '\0';
+
+	return 0;
+}
+
+/*
+ *
+ * Name:
+ * huge_pages_free
+ *
+ * Description:
+ * This is a helper function which reads how many huge pages of the given
+ * size are free in the pool. It returns -1 if the system does not offer
+ * pages of this size
+ *
+ */
+static long huge_pages_free(unsigned long page)
+{
+	char	buf[128];
+
+	snprintf(buf, sizeof(buf), SYS_HUGE_PAGE_DIR "/hugepages-%lukB/free_hugepages", page >> 10);
+
+	if (sys_read(buf, buf, sizeof(buf)) < 0)
+		return -1;
+
+	return strtol(buf, NULL, 10);
+}
+
+/*
+ *
+ * Name:
+ * page_size_init
+ *
+ * Description:
+ * This is a helper function which picks the size of the huge pages backing
+ * the heap. HG_MALLOC_PAGE_SIZE (e.g. 1G) asks for larger pages than the
+ * default. The request is honoured only if the system offers pages of that
+ * size and some of them are free
+ *
+ */
+static void page_size_init(void)
+{
+	const char	*str = getenv("HG_MALLOC_PAGE_SIZE");
+	unsigned long	page;
+
+	if (str == NULL)
+		return;
+
+	page = parse_size(str);
+
+	/* The segment map assumes that segments are made of whole SYS_HUGE_PAGE_SIZE pages */
+	if (page < SYS_HUGE_PAGE_SIZE || (page & (page - 1)) != 0)
+		return;
+
+	if (huge_pages_free(page) > 0)
+		page_size = page;
+}
+
+/*
+ *
+ * Name:
+ * thp_init
+ *
+ * Description:
+ * This is a helper function which finds out whether transparent huge pages
+ * can back the segments we cannot get from the hugetlbfs pool
+ *
+ */
+static void thp_init(void)
+{
+	char buf[128];
+
+	if (sys_read(SYS_THP_ENABLED, buf, sizeof(buf)) < 0)
+		return;
+
+	thp_enabled = (strstr(buf, "[never]") == NULL);
+}
+
+/*
+ *
+ * Name:
+ * purge_cond_init
+ *
+ * Description:
+ * This is a helper function which sets up the condition the purge thread
+ * waits on, against the monotonic clock
+ *
+ */
+static void purge_cond_init(void)
+{
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&purge_cond, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+/*
+ *
+ * Name:
+ * decay_init
+ *
+ * Description:
+ * This is a helper function which reads how long idle memory is kept
+ * around from HG_MALLOC_DECAY_MS and prepares the purge thread to wait on
+ * the monotonic clock
+ *
+ */
+static void decay_init(void)
+{
+	const char *str = getenv("HG_MALLOC_DECAY_MS");
+
+	if (str != NULL)
+		decay_ms = strtol(str, NULL, 10);
+
+	purge_cond_init();
+}
+
+/*
+ *
+ * Name:
+ * tlsf_init
+ *
+ * Description:
+ * This is a helper function which turns TLSF mode on when HG_MALLOC_TLSF=1.
+ * Every call to malloc and free then takes a bounded number of steps once
+ * the heap is large enough, which is why idle segments are not given back
+ * in this mode
+ *
+ */
+static void tlsf_init(void)
+{
+	const char *str = getenv("HG_MALLOC_TLSF");
+
+	if (str == NULL || strtol(str, NULL, 10) == 0)
+		return;
+
+	tlsf = 1;
+	decay_ms = -1;
+}
+
+/*
+ *
+ * Name:
+ * slab_init
+ *
+ * Description:
+ * This is a helper function which hands small requests to the slab runs
+ * from now on, unless HG_MALLOC_SLAB=0 leaves them to the thread caches.
+ * TLSF mode leaves them there too, as draining remote queues and adopting
+ * runs take any number of steps. It must be called after tlsf_init
+ *
+ */
+static void slab_init(void)
+{
+	const char *str = getenv("HG_MALLOC_SLAB");
+
+	if (tlsf)
+		return;
+
+	if (str == NULL || strtol(str, NULL, 10) != 0)
+		slab_on = 1;
+}
+
+/*
+ *
+ * Name:
+ * fixed_init
+ *
+ * Description:
+ * This is a helper function which lays the heap out from the address given
+ * in HG_MALLOC_BASE, e.g. 0x200000000000, instead of wherever the kernel and
+ * ASLR put it. Every segment then lands at the same address for the same
+ * sequence of requests, run after run. Idle memory is not purged in this
+ * mode, since when it goes depends on timing
+ *
+ */
+static void fixed_init(void)
+{
+	const char	*str = getenv("HG_MALLOC_BASE");
+	unsigned long	base;
+
+	if (str == NULL)
+		return;
+
+	base = strtoul(str, NULL, 0);
+
+	if (base == 0 || (base & (SYS_HUGE_PAGE_SIZE - 1)) != 0 || base >= FIXED_LIMIT)
+		return;
+
+	fixed_base = base;
+	fixed_next = base;
+	decay_ms = -1;
+}
+
+/*
+ *
+ * Name:
+ * colour_all
+ *
+ * Description:
+ * This is a helper function which gives the mask of every cache colour
+ *
+ */
+static inline unsigned long colour_all(void)
+{
+	return (colours >= 64) ? ~0UL : (1UL << colours) - 1;
+}
+
+/*
+ *
+ * Name:
+ * colour_init
+ *
+ * Description:
+ * This is a helper function which reads the geometry of the cache whose
+ * sets are split into colours, the last level one unless HG_MALLOC_COLOUR_LEVEL
+ * asks for another, and the colours every thread is restricted to from
+ * HG_MALLOC_COLOURS. Pages whose frames are one way of the cache apart share
+ * a colour, and a way is split into COLOUR_MAX colours at most
+ *
+ */
+static void colour_init(void)
+{
+	const char	*str = getenv("HG_MALLOC_COLOUR_LEVEL");
+	char		path[128], buf[64];
+	unsigned long	size, ways, best_size = 0, best_ways = 0, entry;
+	int		index, level, best_level = 0, wanted, fd;
+	unsigned int	colour, class;
+
+	INIT_LIST_HEAD(&colour_segs);
+
+	for (colour = 0; colour < COLOUR_MAX; colour++) {
+		INIT_LIST_HEAD(&colour_free[colour]);
+
+		for (class = 0; class < COLOUR_CLASSES; class++)
+			INIT_LIST_HEAD(&colour_partial[class][colour]);
+	}
+
+	wanted = (str != NULL) ? strtol(str, NULL, 10) : 0;
+
+	for (index = 0; ; index++) {
+		snprintf(path, sizeof(path), SYS_CACHE_DIR "/index%d/level", index);
+
+		if (sys_read(path, buf, sizeof(buf)) < 0)
+			break;
+
+		level = strtol(buf, NULL, 10);
+
+		/* Only caches holding data can be shared out */
+		snprintf(path, sizeof(path), SYS_CACHE_DIR "/index%d/type", index);
+
+		if (sys_read(path, buf, sizeof(buf)) < 0 || strncmp(buf, "Instruction", 11) == 0)
+			continue;
+
+		if (wanted != 0 ? level != wanted : level < best_level)
+			continue;
+
+		snprintf(path, sizeof(path), SYS_CACHE_DIR "/index%d/size", index);
+
+		if (sys_read(path, buf, sizeof(buf)) < 0)
+			continue;
+
+		buf[strcspn(buf, "\n")] = '\0';
+		size = parse_size(buf);
+
+		snprintf(path, sizeof(path), SYS_CACHE_DIR "/index%d/ways_of_associativity", index);
+
+		if (sys_read(path, buf, sizeof(buf)) < 0 || (ways = strtoul(buf, NULL, 10)) == 0 || size == 0)
+			continue;
+
+		best_level = level;
+		best_size = size;
+		best_ways = ways;
+	}
+
+	if (best_size == 0)
+		return;
+
+	colour_way = best_size / best_ways;
+	colour_unit = SEG_ROUND(colour_way / COLOUR_MAX, COLOUR_PAGE);
+
+	if (colour_unit < COLOUR_PAGE)
+		colour_unit = COLOUR_PAGE;
+
+	/* A cache whose ways fit in one page cannot be split by placing pages */
+	if (colour_way <= colour_unit)
+		return;
+
+	colours = (colour_way + colour_unit - 1) / colour_unit;
+	colour_ways = best_ways;
+
+	/* The frame of a page of our stack tells whether frames are shown to us */
+	fd = open(SYS_PAGEMAP, O_RDONLY | O_CLOEXEC);
+
+	if (fd >= 0) {
+		if (pread(fd, &entry, sizeof(entry), ((unsigned long)&entry / COLOUR_PAGE) * sizeof(entry)) == sizeof(entry))
+			colour_physical = ((entry & PAGEMAP_PFN_MASK) != 0);
+
+		close(fd);
+	}
+
+	str = getenv("HG_MALLOC_COLOURS");
+
+	if (str != NULL)
+		colour_default = strtoul(str, NULL, 0) & colour_all();
+
+	colour_on = (colour_default != 0);
+}
+
+/*
+ *
+ * Name:
+ * heap_init
+ *
+ * Description:
+ * This is a helper function which performs the one-time initialization of
+ * the heap. It must be called with the heap lock held
+ *
+ */
+static void heap_init(void)
+{
+	int class;
+
+	/* Initialize a linked list to track the segments of the heap */
+	INIT_LIST_HEAD(&seg_list);
+
+	/* Initialize the free lists of every size class */
+	for (class = 0; class < FREE_CLASS_COUNT; class++)
+		INIT_LIST_HEAD(&free_lists[class]);
+
+	/* And the lists of free slab runs and slab segments */
+	INIT_LIST_HEAD(&slab_pool);
+	INIT_LIST_HEAD(&slab_segs);
+
+	/* Give thread caches back to the heap when their thread exits */
+	pthread_key_create(&tcache_key, tcache_destroy);
+
+	/* Pick the size of the huge pages backing the heap */
+	page_size_init();
+	thp_init();
+
+	/* Idle memory is purged on a timer which follows the same clock */
+	decay_init();
+
+	/* Which may be turned off by TLSF mode or by a fixed base */
+	tlsf_init();
+	fixed_init();
+
+	/* Find out whether small requests get slab slots, which TLSF mode does not bound */
+	slab_init();
+
+	/* Find out how the cache can be shared out between threads */
+	colour_init();
+
+	__atomic_store_n(&init, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ *
+ * Name:
+ * heap_account
+ *
+ * Description:
+ * This is a helper function which accounts for memory taken from the top of
+ * a segment and records the peak heap usage. It must be called with the heap
+ * lock held
+ *
+ */
+static inline void heap_account(unsigned long size)
+{
+	heap_used += size;
+	if (heap_used > max_used) {
+		max_used = heap_used;
+
+		/* Remember how much of the peak went to trackers */
+		PROFILE(ON, max_used_trackers = trackers);
+	}
+}
+
+/*
+ *
+ * Name:
+ * heap_split
+ *
+ * Description:
+ * This is a helper function which trims a chunk taken off a free list down
+ * to the given size. The remainder becomes a free chunk of its own as long
+ * as it is large enough to be worth a tracker. It must be called with the
+ * heap lock held
+ *
+ */
+static void heap_split(track_t *tracker, unsigned long size)
+{
+	track_t *remainder;
+
+	if (CHUNK_SIZE(tracker) < size + CHUNK_MIN_SIZE)
+		return;
+
+	/* Place a tracker right after the part we keep. A free chunk is never the last one of its
+	   segment so the remainder always has a chunk after it */
+	remainder = (track_t *)((unsigned long)tracker + size);
+	remainder->prev_size = size / CHUNK_ALIGN;
+	remainder->size = tracker->size - size / CHUNK_ALIGN;
+	remainder->free = CHUNK_FREE;
+	CHUNK_NEXT(remainder)->prev_size = remainder->size;
+	free_list_insert(remainder);
+
+	tracker->size = size / CHUNK_ALIGN;
+
+	/* Increment the number of active trackers, and count the split as a step */
+	PROFILE(ON, PROFILE_ATOMIC_ADD(trackers, 1));
+	PROFILE(ON, max_trackers_new++);
+	PROFILE(ON, max_trackers = (max_trackers_new > max_trackers)? max_trackers_new : max_trackers);
+	PROFILE(ON, tcache.steps++);
+}
+
+/*
+ *
+ * Name:
+ * large_alloc
+ *
+ * Description:
+ * This is a helper function which gives a large chunk a segment of its own,
+ * either a cached one or a new mapping. The memory of the chunk is aligned
+ * to the given power of two. It must be called with the heap lock held and
+ * returns NULL when the huge page pool is exhausted
+ *
+ */
+static track_t *large_alloc(unsigned long size, unsigned long align)
+{
+	segment_t	*seg = NULL;
+	track_t		*tracker;
+	unsigned long	map_size;
+	unsigned int	i, slot = 0;
+
+	/* Leave room for the segment header and for moving the chunk up to an aligned address */
+	map_size = SEG_ROUND(sizeof(segment_t) + sizeof(track_t) + align + size, SYS_HUGE_PAGE_SIZE);
+
+	/* Take the smallest cached mapping which fits, unless it would waste more than half of itself */
+	for (i = 0; i < large_cached; i++) {
+		if (large_cache[i]->size < map_size || large_cache[i]->size > 2 * map_size)
+			continue;
+
+		if (seg == NULL || large_cache[i]->size < seg->size) {
+			seg = large_cache[i];
+			slot = i;
+		}
+	}
+
+	if (seg != NULL) {
+		large_cached--;
+		large_cached_bytes -= seg->size;
+		large_bytes += seg->size;
+		large_live++;
+		memmove(&large_cache[slot], &large_cache[slot + 1], (large_cached - slot) * sizeof(segment_t *));
+	} else {
+		/* Larger pages are only used for chunks which fill a good part of one */
+		seg = segment_map(map_size, (size >= page_size / 2) ? page_size : SYS_HUGE_PAGE_SIZE);
+
+		/* Out of Memory!!! */
+		if (seg == NULL)
+			return NULL;
+
+		seg->large = 1;
+		large_bytes += seg->size;
+		large_live++;
+		PROFILE(ON, large_maps++);
+	}
+
+	/* Place the chunk so that its memory is aligned */
+	tracker = (track_t *)((((unsigned long)seg + sizeof(segment_t) + sizeof(track_t) + align - 1) & ~(align - 1))
+			- sizeof(track_t));
+	seg->start = tracker;
+	seg->top = tracker;
+	seg->last = NULL;
+
+	populate_tracker(seg, tracker, size);
+	heap_account(size);
+
+	return tracker;
+}
+
+/*
+ *
+ * Name:
+ * large_free
+ *
+ * Description:
+ * This is a helper function which releases the chunk of a large segment.
+ * The segment is cached for later large requests, and the segments which
+ * do not fit in the cache anymore are queued on the given list so that
+ * they can be unmapped once the heap lock is dropped. It must be called
+ * with the heap lock held
+ *
+ */
+static void large_free(segment_t *seg, struct list_head *unmap)
+{
+	segment_t *victim;
+
+	heap_used -= CHUNK_SIZE(seg->last);
+	large_bytes -= seg->size;
+	large_live--;
+	seg->last = NULL;
+	seg->top = seg->start;
+
+	/* Decrement the number of trackers */
+	PROFILE(ON, PROFILE_ATOMIC_ADD(trackers, -1));
+
+	/* Mappings larger than the whole cache are not worth keeping */
+	if (seg->size > LARGE_CACHE_BYTES) {
+		victim = seg;
+		goto release;
+	}
+
+	/* Make room by dropping the oldest mappings */
+	while (large_cached == LARGE_CACHE_SLOTS || large_cached_bytes + seg->size > LARGE_CACHE_BYTES) {
+		victim = large_cache[0];
+		large_cached--;
+		large_cached_bytes -= victim->size;
+		memmove(&large_cache[0], &large_cache[1], large_cached * sizeof(segment_t *));
+
+		seg_map_remove(victim);
+		list_add_tail(&victim->list, unmap);
+		PROFILE(ON, large_maps--);
+		PROFILE(ON, tier_maps[victim->tier]--);
+	}
+
+	large_cache[large_cached++] = seg;
+	large_cached_bytes += seg->size;
+
+	/* A cached mapping starts to decay */
+	if (decay_ms >= 0) {
+		seg->idle = clock_ms();
+		purge_pending = 1;
+	}
+
+	return;
+
+release:
+	seg_map_remove(victim);
+	list_add_tail(&victim->list, unmap);
+	PROFILE(ON, large_maps--);
+	PROFILE(ON, tier_maps[victim->tier]--);
+}
+
+static void heap_free(segment_t *seg, track_t *tracker);
+
+/*
+ *
+ * Name:
+ * tlsf_seal
+ *
+ * Description:
+ * This is a helper function which hands the room left at the end of a segment
+ * to the free lists once TLSF mode stops carving chunks out of it. An in-use
+ * sentinel takes the last place so the segment never shrinks back and its
+ * room stays reachable without walking the segments
+ *
+ */
+static void tlsf_seal(segment_t *seg)
+{
+	track_t		*tracker = NULL;
+	unsigned long	room = SEG_GET_LIMIT(seg) - (unsigned long)seg->top;
+
+	if (room < CHUNK_ALIGN)
+		return;
+
+	/* Carve the room out of the segment, leaving the sentinel at the end */
+	if (room >= CHUNK_MIN_SIZE + CHUNK_ALIGN) {
+		tracker = (track_t *)seg->top;
+		populate_tracker(seg, tracker, room - CHUNK_ALIGN);
+	}
+
+	populate_tracker(seg, (track_t *)seg->top, CHUNK_ALIGN);
+	heap_account(room);
+
+	if (tracker != NULL)
+		heap_free(seg, tracker);
+}
+
+/*
+ *
+ * Name:
+ * heap_alloc
+ *
+ * Description:
+ * This is a helper function which carves a chunk of the given size out of
+ * the shared heap. It must be called with the heap lock held and returns
+ * NULL when the huge page pool is exhausted
+ *
+ */
+static track_t *heap_alloc(unsigned long size)
+{
+	track_t		*tracker = NULL;
+	segment_t	*seg;
+
+	/* Find out if this is the first call to malloc */
+	if (init == 0)
+		heap_init();
+
+	/* Large chunks stay out of the way of the small ones, except in TLSF mode where mappings come
+	   and go only with the segments */
+	if (size >= LARGE_MIN_SIZE && !tlsf) {
+		LATENCY(tcache.lat_path = HG_LAT_MALLOC_LARGE);
+		return large_alloc(size, CHUNK_ALIGN);
+	}
+
+	/* Look up the free lists to find an appropriate sized chunk */
+	tracker = free_list_search(size);
+
+	if (tracker != NULL) {
+		LATENCY(tcache.lat_path = HG_LAT_MALLOC_REUSE);
+
+		/* Found the right chunk. Give back whatever we do not need */
+		free_list_remove(tracker);
+		heap_split(tracker, size);
+		tracker->free = CHUNK_IN_USE;
+
+		/* Keep track of trackers reusage information */
+		PROFILE(ON, STATS_ADD(reused_trackers, 1));
+
+		/* Return the tracker to caller */
+		return tracker;
+	}
+
+	LATENCY(tcache.lat_path = HG_LAT_MALLOC_EXPAND);
+
+	/* Expand the current segment if it has enough room left at its end */
+	if (cur_seg != NULL) {
+		seg = cur_seg;
+
+		if (SEG_GET_LIMIT(seg) - (unsigned long)seg->top >= size + (tlsf ? CHUNK_ALIGN : 0))
+			goto expand;
+
+		/* TLSF mode does not come back to this segment, so hand its room to the free lists */
+		if (tlsf)
+			tlsf_seal(seg);
+	}
+
+	/* Otherwise expand the first segment which has enough room left at its end. TLSF mode does
+	   not walk the segments, the time it takes grows with the heap */
+	if (!tlsf) {
+		list_for_each_entry(seg, &seg_list, list) {
+			PROFILE(ON, tcache.steps++);
+
+			if (SEG_GET_LIMIT(seg) - (unsigned long)seg->top >= size) {
+				cur_seg = seg;
+				goto expand;
+			}
+		}
+	}
+
+	/* None of the segments can hold this request so map a new one */
+	LATENCY(tcache.lat_path = HG_LAT_MALLOC_SEGMENT);
+	seg = segment_create(size);
+
+	/* Out of Memory!!! */
+	if (seg == NULL)
+		return NULL;
+
+expand:
+	/* If the heap is empty, there are no trackers */
+	PROFILE(ON, max_trackers_new = (heap_used == 0) ? 0 : max_trackers_new);
+
+	/* Place a tracker at the current end of memory area */
+	tracker = (track_t *)seg->top;
+
+	/* Populate the tracker with information regaring this allocation */
+	populate_tracker(seg, tracker, size);
+
+	/* Since we are expanding the heap, this is the best place to record max heap usage */
+	heap_account(size);
+
+	return tracker;
+}
+
+/*
+ *
+ * Name:
+ * heap_free
+ *
+ * Description:
+ * This is a helper function which gives a chunk back to the shared heap. The
+ * chunk is merged with free neighbours on either side and the segment shrinks
+ * when the result sits at its end. It must be called with the heap lock held
+ *
+ */
+static void heap_free(segment_t *seg, track_t *tracker)
+{
+	track_t *neighbour;
+
+	/* Mark the tracker as free */
+	tracker->free = CHUNK_FREE;
+
+	/* Absorb the chunk right after this one if it is free */
+	if (tracker != seg->last) {
+		neighbour = CHUNK_NEXT(tracker);
+
+		if (neighbour->free == CHUNK_FREE) {
+			free_list_remove(neighbour);
+			tracker->size += neighbour->size;
+
+			/* Decrement the number of trackers, and count the merge as a step */
+			PROFILE(ON, PROFILE_ATOMIC_ADD(trackers, -1));
+			PROFILE(ON, tcache.steps++);
+		}
+	}
+
+	/* Let the chunk right before this one absorb it if it is free */
+	if (tracker->prev_size != 0) {
+		neighbour = CHUNK_PREV(tracker);
+
+		if (neighbour->free == CHUNK_FREE) {
+			free_list_remove(neighbour);
+			neighbour->size += tracker->size;
+
+			if (seg->last == tracker)
+				seg->last = neighbour;
+
+			tracker = neighbour;
+
+			/* Decrement the number of trackers, and count the merge as a step */
+			PROFILE(ON, PROFILE_ATOMIC_ADD(trackers, -1));
+			PROFILE(ON, tcache.steps++);
+		}
+	}
+
+	/* If the tracker is not the last chunk in the segment, make it available for reuse */
+	if (tracker != seg->last) {
+		CHUNK_NEXT(tracker)->prev_size = tracker->size;
+		free_list_insert(tracker);
+		return;
+	}
+
+	/* Otherwise delete it. Free neighbours were merged above so no other free chunk is left at the end */
+	heap_used -= CHUNK_SIZE(tracker);
+	seg->last = (tracker->prev_size != 0) ? CHUNK_PREV(tracker) : NULL;
+	__atomic_store_n(&seg->top, (void *)tracker, __ATOMIC_RELAXED);
+
+	/* An empty segment starts to decay, unless it is the one new chunks are carved out of */
+	if (seg->last == NULL && seg != cur_seg && !seg->pinned && decay_ms >= 0) {
+		seg->idle = clock_ms();
+		purge_pending = 1;
+	}
+
+	/* Decrement the number of trackers */
+	PROFILE(ON, PROFILE_ATOMIC_ADD(trackers, -1));
+}
+
+/*
+ *
+ * Name:
+ * heap_carve
+ *
+ * Description:
+ * This is a helper function which cuts an allocated chunk in two at the
+ * given offset. Both parts stay allocated and the second one is returned.
+ * It must be called with the heap lock held
+ *
+ */
+static track_t *heap_carve(segment_t *seg, track_t *tracker, unsigned long offset)
+{
+	track_t *second;
+
+	second = (track_t *)((unsigned long)tracker + offset);
+	second->prev_size = offset / CHUNK_ALIGN;
+	second->size = tracker->size - offset / CHUNK_ALIGN;
+	second->free = CHUNK_IN_USE;
+	tracker->size = offset / CHUNK_ALIGN;
+
+	if (seg->last == tracker)
+		seg->last = second;
+	else
+		CHUNK_NEXT(second)->prev_size = second->size;
+
+	/* Increment the number of active trackers, and count the split as a step */
+	PROFILE(ON, PROFILE_ATOMIC_ADD(trackers, 1));
+	PROFILE(ON, max_trackers_new++);
+	PROFILE(ON, max_trackers = (max_trackers_new > max_trackers)? max_trackers_new : max_trackers);
+	PROFILE(ON, tcache.steps++);
+
+	return second;
+}
+
+/*
+ *
+ * Name:
+ * heap_memalign
+ *
+ * Description:
+ * This is a helper function which carves a chunk whose memory is aligned to
+ * the given power of two out of the shared heap. It takes a chunk large
+ * enough to hold an aligned block anywhere inside it and frees the space
+ * on either side, which merges it with its free neighbours or gives it back
+ * to the top of the segment. It must be called with the heap lock held
+ *
+ */
+static track_t *heap_memalign(unsigned long align, unsigned long size)
+{
+	track_t		*tracker, *lead;
+	segment_t	*seg;
+	unsigned long	addr, gap, peak = max_used;
+
+	/* Large chunks are aligned within their own mapping. So are the ones which only become large
+	   with the padding, as the space given back around them must end up in a shared segment */
+	if (init == 0)
+		heap_init();
+
+	if (size + align + CHUNK_MIN_SIZE >= LARGE_MIN_SIZE && !tlsf)
+		return large_alloc(size, align);
+
+	tracker = heap_alloc(size + align + CHUNK_MIN_SIZE);
+
+	/* Out of Memory!!! */
+	if (tracker == NULL)
+		return NULL;
+
+	seg = seg_lookup(tracker);
+	addr = (unsigned long)MEM_GET_ADDRESS(tracker);
+
+	/* Start the block at the first aligned address which leaves room for a chunk in front of it */
+	if (addr & (align - 1)) {
+		gap = ((addr + align - 1) & ~(align - 1)) - addr;
+		if (gap < CHUNK_MIN_SIZE)
+			gap += align;
+
+		lead = tracker;
+		tracker = heap_carve(seg, lead, gap);
+		heap_free(seg, lead);
+	}
+
+	/* And give back whatever is left after it */
+	if (CHUNK_SIZE(tracker) >= size + CHUNK_MIN_SIZE)
+		heap_free(seg, heap_carve(seg, tracker, size));
+
+	/* The padding we gave back was never really used */
+	if (max_used > peak)
+		max_used = (heap_used > peak) ? heap_used : peak;
+
+	return tracker;
+}
+
+/*
+ *
+ * Name:
+ * heap_resize
+ *
+ * Description:
+ * This is a helper function which grows an allocated chunk in place, into
+ * the top of its segment or into the free chunk right after it. A chunk
+ * alone in its segment takes the whole mapping along when it cannot grow in
+ * place. It returns the chunk, or NULL if it cannot grow. It must be called
+ * with the heap lock held
+ *
+ */
+static track_t *heap_resize(segment_t *seg, track_t *tracker, unsigned long size)
+{
+	track_t *next;
+
+	if (tracker == seg->last) {
+		/* The last chunk grows into the top of its segment, TLSF mode keeps room for a sentinel */
+		if (SEG_GET_LIMIT(seg) - (unsigned long)tracker >= size + (tlsf ? CHUNK_ALIGN : 0))
+			goto grow;
+
+		if ((void *)tracker != seg->start || tlsf)
+			return NULL;
+
+		seg = segment_resize(seg, size);
+
+		if (seg == NULL)
+			return NULL;
+
+		tracker = seg->last;
+		goto grow;
+	}
+
+	/* Any other chunk can only absorb the chunk right after it */
+	next = CHUNK_NEXT(tracker);
+
+	if (next->free != CHUNK_FREE || CHUNK_SIZE(tracker) + CHUNK_SIZE(next) < size)
+		return NULL;
+
+	/* A free chunk is never the last one so there is always a chunk after it */
+	free_list_remove(next);
+	tracker->size += next->size;
+	CHUNK_NEXT(tracker)->prev_size = tracker->size;
+
+	/* Decrement the number of trackers, and count the merge as a step */
+	PROFILE(ON, PROFILE_ATOMIC_ADD(trackers, -1));
+	PROFILE(ON, tcache.steps++);
+
+	/* Give back whatever we do not need */
+	if (CHUNK_SIZE(tracker) >= size + CHUNK_MIN_SIZE)
+		heap_free(seg, heap_carve(seg, tracker, size));
+
+	return tracker;
+
+grow:
+	heap_account(size - CHUNK_SIZE(tracker));
+	tracker->size = size / CHUNK_ALIGN;
+	__atomic_store_n(&seg->top, (void *)CHUNK_NEXT(tracker), __ATOMIC_RELAXED);
+
+	if (seg->top > seg->fresh)
+		seg->fresh = seg->top;
+
+	return tracker;
+}
+
+static unsigned long slab_purge(unsigned long now, struct list_head *unmap);
+
+/*
+ *
+ * Name:
+ * heap_purge
+ *
+ * Description:
+ * This is a helper function which takes the empty segments, the cached
+ * large mappings and the free slab segments which have been idle for long
+ * enough out of the heap and queues them on the given list so that they can
+ * be unmapped once the heap lock is dropped. The current segment and pinned
+ * ones are kept. Each call looks at PURGE_SCAN segments at most and leaves
+ * purge_next at the one to go on from, or NULL once the walk is over. It
+ * returns when the next idle mapping among the ones it looked at is due, or
+ * 0 if there is none. It must be called with the heap lock held
+ *
+ */
+static unsigned long heap_purge(unsigned long now, struct list_head *unmap)
+{
+	segment_t	*seg = purge_next, *next;
+	unsigned long	due = 0;
+	unsigned int	i = 0, scanned;
+
+	/* The slab segments and the large mappings are looked at once per walk, when it starts */
+	if (seg == NULL) {
+		due = slab_purge(now, unmap);
+
+		while (i < large_cached) {
+			seg = large_cache[i];
+
+			if (now < seg->idle + decay_ms) {
+				if (due == 0 || seg->idle + decay_ms < due)
+					due = seg->idle + decay_ms;
+				i++;
+				continue;
+			}
+
+			large_cached--;
+			large_cached_bytes -= seg->size;
+			memmove(&large_cache[i], &large_cache[i + 1], (large_cached - i) * sizeof(segment_t *));
+
+			seg_map_remove(seg);
+			list_add_tail(&seg->list, unmap);
+			PROFILE(ON, large_maps--);
+			PROFILE(ON, tier_maps[seg->tier]--);
+			PROFILE(ON, purged_maps++);
+		}
+
+		seg = list_entry(seg_list.next, segment_t, list);
+	}
+
+	for (scanned = 0; &seg->list != &seg_list && scanned < PURGE_SCAN; scanned++, seg = next) {
+		next = list_entry(seg->list.next, segment_t, list);
+
+		if (seg == cur_seg || seg->pinned || seg->last != NULL)
+			continue;
+
+		if (now < seg->idle + decay_ms) {
+			if (due == 0 || seg->idle + decay_ms < due)
+				due = seg->idle + decay_ms;
+			continue;
+		}
+
+		list_del(&seg->list);
+		seg_map_remove(seg);
+		list_add_tail(&seg->list, unmap);
+		PROFILE(ON, segments--);
+		PROFILE(ON, tier_maps[seg->tier]--);
+		PROFILE(ON, purged_maps++);
+	}
+
+	purge_next = (&seg->list != &seg_list) ? seg : NULL;
+
+	return due;
+}
+
+/*
+ *
+ * Name:
+ * purge_thread
+ *
+ * Description:
+ * This function runs in the background and gives idle memory back to the
+ * system once it has decayed, so that neither malloc nor free ever pays
+ * for unmapping it. It sleeps until the next idle mapping is due, or until
+ * it is told that some memory went idle
+ *
+ */
+static void *purge_thread(void *arg)
+{
+	struct list_head	unmap;
+	struct timespec		ts;
+	segment_t		*seg, *next;
+	unsigned long		due = 0, when;
+
+	pthread_mutex_lock(&heap_lock);
+
+	for (;;) {
+		INIT_LIST_HEAD(&unmap);
+		when = heap_purge(clock_ms(), &unmap);
+
+		if (when != 0 && (due == 0 || when < due))
+			due = when;
+
+		/* Unmapping can take a while so it is done without holding the lock, and a long walk over the
+		   segments lets other threads in every now and then */
+		if (!list_empty(&unmap) || purge_next != NULL) {
+			pthread_mutex_unlock(&heap_lock);
+
+			list_for_each_entry_safe(seg, next, &unmap, list)
+				heap_unmap(seg, seg->size);
+
+			pthread_mutex_lock(&heap_lock);
+			continue;
+		}
+
+		if (due == 0) {
+			pthread_cond_wait(&purge_cond, &heap_lock);
+			continue;
+		}
+
+		/* The coarse clock lags behind a little, so we may wake up once more than needed */
+		ts.tv_sec = due / 1000;
+		ts.tv_nsec = (due % 1000) * 1000000;
+		pthread_cond_timedwait(&purge_cond, &heap_lock, &ts);
+		due = 0;
+	}
+
+	return arg;
+}
+
+/*
+ *
+ * Name:
+ * purge_kick
+ *
+ * Description:
+ * This is a helper function which tells the purge thread that some memory
+ * went idle, and starts the thread the first time around in this process.
+ * It must be called without holding the heap lock
+ *
+ */
+static void purge_kick(void)
+{
+	pthread_attr_t	attr;
+	pthread_t	tid;
+	int		start = 0;
+
+	pthread_mutex_lock(&heap_lock);
+
+	purge_pending = 0;
+
+	/* A forked child does not inherit the purge thread of its parent */
+	if (purge_pid != getpid()) {
+		purge_pid = getpid();
+		start = 1;
+	} else {
+		pthread_cond_signal(&purge_cond);
+	}
+
+	pthread_mutex_unlock(&heap_lock);
+
+	if (!start)
+		return;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	/* Try again next time if the thread cannot be started */
+	if (pthread_create(&tid, &attr, purge_thread, NULL) != 0)
+		__atomic_store_n(&purge_pid, 0, __ATOMIC_RELAXED);
+
+	pthread_attr_destroy(&attr);
+}
+
+/*
+ *
+ * Name:
+ * heap_free_cached
+ *
+ * Description:
+ * This is a helper function which gives a chain of cached chunks back to the
+ * shared heap. It must be called with the heap lock held
+ *
+ */
+static void heap_free_cached(track_t *chain)
+{
+	track_t *tracker;
+
+	while (chain != NULL) {
+		tracker = chain;
+		chain = CACHE_NEXT(tracker);
+
+		heap_free(seg_lookup(tracker), tracker);
+	}
+}
+
+/*
+ *
+ * Name:
+ * depot_take
+ *
+ * Description:
+ * This is a helper function which detaches up to the given number of chunks
+ * from the depot of a class and returns them as a chain
+ *
+ */
+static track_t *depot_take(unsigned int class, unsigned int count, unsigned int *taken)
+{
+	track_t		*chain, *tracker;
+	unsigned int	i = 0;
+
+	pthread_mutex_lock(&depot[class].lock);
+
+	chain = tracker = depot[class].head;
+
+	if (chain != NULL) {
+		/* Walk to the last chunk we are going to take */
+		for (i = 1; i < count && CACHE_NEXT(tracker) != NULL; i++)
+			tracker = CACHE_NEXT(tracker);
+
+		depot[class].head = CACHE_NEXT(tracker);
+		depot[class].count -= i;
+		CACHE_NEXT(tracker) = NULL;
+	}
+
+	pthread_mutex_unlock(&depot[class].lock);
+
+	*taken = i;
+
+	return chain;
+}
+
+/*
+ *
+ * Name:
+ * heap_unblock
+ *
+ * Description:
+ * This is a helper function which is called when cached chunks stop a segment
+ * from shrinking. It gives back the chunks of the blocking class held by this
+ * thread and by the depot so that the segment can shrink further. Chunks held
+ * by the caches of other threads are left alone. It must be called with the
+ * heap lock held
+ *
+ */
+static void heap_unblock(segment_t *seg)
+{
+	track_t		*tracker, *chain;
+	unsigned int	class, taken;
+
+	while (seg->last != NULL && seg->last->free == CHUNK_CACHED) {
+		tracker = seg->last;
+
+		/* Give back our own cached chunks of this class */
+		class = TCACHE_CHUNK_CLASS(tracker);
+		chain = tcache.head[class];
+		PROFILE(ON, tcache.steps += tcache.count[class]);
+		tcache.head[class] = NULL;
+		tcache.count[class] = 0;
+		heap_free_cached(chain);
+
+		/* And the ones sitting in the depot */
+		heap_free_cached(depot_take(class, ~0U, &taken));
+		PROFILE(ON, tcache.steps += taken);
+
+		/* Stop if the blocking chunk belongs to another thread */
+		if (seg->last == tracker)
+			break;
+	}
+}
+
+/*
+ *
+ * Name:
+ * tcache_refill
+ *
+ * Description:
+ * This is a helper function which refills an empty thread cache class, first
+ * from the depot and otherwise from the shared heap, and takes one chunk out
+ * of it for the caller. It returns NULL when the huge page pool is exhausted
+ *
+ */
+static track_t *tcache_refill(unsigned int class)
+{
+	track_t		*tracker;
+	unsigned int	taken;
+
+	/* A whole batch from the depot costs a single lock round trip */
+	tcache.head[class] = depot_take(class, TCACHE_BATCH, &taken);
+	tcache.count[class] = (tcache.head[class] != NULL) ? taken : 0;
+
+	if (tcache.head[class] != NULL) {
+		LATENCY(tcache.lat_path = HG_LAT_MALLOC_REFILL);
+		goto reuse;
+	}
+
+	LATENCY(tcache.lat_path = HG_LAT_MALLOC_REUSE);
+
+	pthread_mutex_lock(&heap_lock);
+
+	/* Otherwise move a batch of suitable free chunks out of the heap */
+	while (init && tcache.count[class] < TCACHE_BATCH) {
+		tracker = free_list_search(TCACHE_CLASS_SIZE(class));
+
+		if (tracker == NULL)
+			break;
+
+		/* Large chunks are split so that small classes do not hold on to them */
+		free_list_remove(tracker);
+		heap_split(tracker, TCACHE_CLASS_SIZE(class));
+		tracker->free = CHUNK_CACHED;
+		CACHE_NEXT(tracker) = tcache.head[class];
+		tcache.head[class] = tracker;
+		tcache.count[class]++;
+	}
+
+	/* Or carve a fresh chunk for the caller if the heap has none */
+	if (tcache.head[class] == NULL) {
+		tracker = heap_alloc(TCACHE_CLASS_SIZE(class));
+		pthread_mutex_unlock(&heap_lock);
+
+		return tracker;
+	}
+
+	pthread_mutex_unlock(&heap_lock);
+
+reuse:
+	tracker = tcache.head[class];
+	tcache.head[class] = CACHE_NEXT(tracker);
+	tcache.count[class]--;
+
+	tracker->free = CHUNK_IN_USE;
+
+	/* Keep track of trackers reusage information */
+	PROFILE(ON, STATS_ADD(reused_trackers, 1));
+
+	return tracker;
+}
+
+/*
+ *
+ * Name:
+ * tcache_flush
+ *
+ * Description:
+ * This is a helper function which moves a batch of chunks from a full thread
+ * cache class to the depot. When the depot itself gets too full, the excess
+ * goes back to the shared heap
+ *
+ */
+static void tcache_flush(unsigned int class)
+{
+	track_t		*chain, *tracker;
+	unsigned int	i, taken = 0;
+
+	/* Detach a batch from the thread cache */
+	chain = tracker = tcache.head[class];
+
+	for (i = 1; i < TCACHE_BATCH; i++)
+		tracker = CACHE_NEXT(tracker);
+
+	tcache.head[class] = CACHE_NEXT(tracker);
+	tcache.count[class] -= TCACHE_BATCH;
+
+	/* Hand it over to the depot */
+	pthread_mutex_lock(&depot[class].lock);
+
+	CACHE_NEXT(tracker) = depot[class].head;
+	depot[class].head = chain;
+	depot[class].count += TCACHE_BATCH;
+
+	pthread_mutex_unlock(&depot[class].lock);
+
+	/* Keep the depot bounded by returning a batch to the heap. Reading the count without
+	   the lock is only a hint */
+	if (depot[class].count > DEPOT_LIMIT) {
+		chain = depot_take(class, TCACHE_BATCH, &taken);
+
+		pthread_mutex_lock(&heap_lock);
+		heap_free_cached(chain);
+		pthread_mutex_unlock(&heap_lock);
+	}
+}
+
+/*
+ *
+ * Name:
+ * slab_pool_add
+ *
+ * Description:
+ * This is a helper function which puts a slab run whose slots are all free
+ * in the pool of free runs. A segment whose runs are all in the pool starts
+ * to decay. It must be called with the slab lock held
+ *
+ */
+static void slab_pool_add(slab_run_t *run)
+{
+	slab_segment_t *slab = SLAB_SEGMENT(run);
+
+	run->listed = 1;
+	list_add(&run->list, &slab_pool);
+
+	if (++slab->pooled == SLAB_RUNS - 1 && decay_ms >= 0) {
+		slab->seg.idle = clock_ms();
+		__atomic_store_n(&purge_pending, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ *
+ * Name:
+ * slab_segment_create
+ *
+ * Description:
+ * This is a helper function which maps a new slab segment and adds its runs
+ * to the pool of free runs, from where the purge thread takes the segment
+ * back once they have all been free for long enough. It returns -1 when we
+ * are out of memory
+ *
+ */
+static int slab_segment_create(void)
+{
+	slab_segment_t	*slab;
+	segment_t	*seg;
+	unsigned int	i;
+
+	pthread_mutex_lock(&heap_lock);
+
+	if (init == 0)
+		heap_init();
+
+	seg = segment_map(SYS_HUGE_PAGE_SIZE, SYS_HUGE_PAGE_SIZE);
+
+	if (seg != NULL)
+		seg->slab = 1;
+
+	pthread_mutex_unlock(&heap_lock);
+
+	if (seg == NULL)
+		return -1;
+
+	/* The headers of a fresh mapping are zeroed already, which leaves every run unowned */
+	slab = (slab_segment_t *)seg;
+
+	for (i = 1; i < SLAB_RUNS; i++)
+		slab->runs[i].base = (char *)seg + i * SLAB_RUN_SIZE;
+
+	pthread_mutex_lock(&slab_lock);
+
+	for (i = SLAB_RUNS - 1; i > 0; i--)
+		slab_pool_add(&slab->runs[i]);
+
+	list_add_tail(&seg->list, &slab_segs);
+
+	pthread_mutex_unlock(&slab_lock);
+
+	return 0;
+}
+
+/*
+ *
+ * Name:
+ * slab_collect
+ *
+ * Description:
+ * This is a helper function which merges the slots given back to a slab run
+ * by other threads into the bitmap of its owner. It must be called by the
+ * owner of the run, or with the slab lock held while the run is listed, and
+ * returns the number of free slots
+ *
+ */
+static unsigned int slab_collect(slab_run_t *run)
+{
+	unsigned long	bits;
+	unsigned int	word;
+
+	/* Other threads raise the pending flag once they have set their bits */
+	if (__atomic_load_n(&run->pending, __ATOMIC_RELAXED) == 0 || !__atomic_exchange_n(&run->pending, 0, __ATOMIC_ACQUIRE))
+		return run->free;
+
+	for (word = 0; word < run->words; word++) {
+		if (__atomic_load_n(&run->remote[word], __ATOMIC_RELAXED) == 0)
+			continue;
+
+		bits = __atomic_exchange_n(&run->remote[word], 0, __ATOMIC_ACQUIRE);
+		run->local[word] |= bits;
+		run->free += __builtin_popcountl(bits);
+	}
+
+	run->hint = 0;
+
+	return run->free;
+}
+
+/*
+ *
+ * Name:
+ * slab_take
+ *
+ * Description:
+ * This is a helper function which hands out the first free slot of a slab
+ * run owned by the calling thread. The run must have a free slot, and no
+ * word below the hint has one
+ *
+ */
+static inline void *slab_take(slab_run_t *run)
+{
+	unsigned int	word = run->hint;
+	unsigned int	bit;
+
+	while (run->local[word] == 0)
+		word++;
+
+	bit = __builtin_ctzl(run->local[word]);
+	run->local[word] &= run->local[word] - 1;
+	run->free--;
+	run->hint = word;
+
+	return run->base + (word * 64 + bit) * run->size;
+}
+
+/*
+ *
+ * Name:
+ * slab_disown
+ *
+ * Description:
+ * This is a helper function which hands a slab run owned by the calling
+ * thread, and on no remote queue, over to the other threads. A run whose
+ * slots are all free goes back to the pool, and one which has some free
+ * slots goes to the partial list of its class. A full run is left for the
+ * next thread which frees one of its slots to list
+ *
+ */
+static void slab_disown(slab_run_t *run)
+{
+	unsigned long	remote = 0;
+	unsigned int	word;
+
+	pthread_mutex_lock(&slab_lock);
+
+	/* Either we see the slots other threads give back from now on, or they see that the run is
+	   not owned any more and list it themselves */
+	__atomic_store_n(&run->owner, NULL, __ATOMIC_SEQ_CST);
+
+	for (word = 0; word < run->words; word++)
+		remote |= __atomic_load_n(&run->remote[word], __ATOMIC_SEQ_CST);
+
+	if (run->free == run->slots) {
+		slab_pool_add(run);
+
+		PROFILE(ON, slab_runs--);
+	} else if (run->free != 0 || remote != 0) {
+		run->listed = 1;
+		run->next = slab_partial[run->class];
+		slab_partial[run->class] = run;
+
+		/* The purge thread collects the slots given back to listed runs from now on */
+		if (decay_ms >= 0)
+			__atomic_store_n(&purge_pending, 1, __ATOMIC_RELAXED);
+	}
+
+	pthread_mutex_unlock(&slab_lock);
+}
+
+static void remote_drain(void);
+
+/*
+ *
+ * Name:
+ * slab_detach
+ *
+ * Description:
+ * This is a helper function which gives up the ownership of a slab run. A
+ * run still on our remote queue has to come off it before it changes hands,
+ * or it would never be pushed onto the queue of its next owner. We never
+ * wait for a thread which is still pushing the run, the run is left on our
+ * queue for whoever takes it off to give up
+ *
+ */
+static void slab_detach(slab_run_t *run)
+{
+	remote_queue_t *queue = tcache.queue;
+
+	/* Nobody pushes the run again once it has no queue */
+	run->full = 0;
+	__atomic_store_n(&run->queue, NULL, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&run->queued, __ATOMIC_SEQ_CST))
+		remote_drain();
+
+	/* The run stays owned, by the queue, so that nobody lists it in the meantime */
+	if (__atomic_load_n(&run->queued, __ATOMIC_SEQ_CST)) {
+		__atomic_store_n(&run->owner, queue, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&queue->orphans, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	slab_disown(run);
+}
+
+/*
+ *
+ * Name:
+ * slab_purge
+ *
+ * Description:
+ * This is a helper function which collects the slots given back to the runs
+ * of the partial lists, moves the runs whose slots are all free again to the
+ * pool, and takes the slab segments whose runs have all been in the pool for
+ * long enough out of it. They are queued on the given list so that they can
+ * be unmapped once the locks are dropped. Listed runs are collected once per
+ * decay time at most, and a segment stays mapped while any thread is still
+ * giving a slot back to one of its runs. The orphans left on the queues of
+ * threads which exited are given up first. It returns when it should be
+ * called again, or 0 if there is no need to. It must be called with the heap
+ * lock held
+ *
+ */
+static unsigned long slab_purge(unsigned long now, struct list_head *unmap)
+{
+	remote_queue_t	*queue, *own = tcache.queue;
+	slab_segment_t	*slab;
+	slab_run_t	*run, **link;
+	segment_t	*seg, *next;
+	unsigned long	due = 0;
+	unsigned int	class, i;
+
+	/* A queue no thread has claimed is ours while we hold it, and its orphans come off it once the threads
+	   pushing them are done. We look again shortly while some are still on their way */
+	for (i = 0; i < REMOTE_QUEUES; i++) {
+		queue = &remote_queues[i];
+
+		if (__atomic_load_n(&queue->orphans, __ATOMIC_RELAXED) == 0 ||
+		    !(__atomic_fetch_and(&remote_free_queues, ~(1UL << i), __ATOMIC_ACQUIRE) & (1UL << i)))
+			continue;
+
+		tcache.queue = queue;
+		remote_drain();
+		tcache.queue = own;
+
+		if (__atomic_load_n(&queue->orphans, __ATOMIC_RELAXED) != 0 && (due == 0 || now + 1 < due))
+			due = now + 1;
+
+		__atomic_or_fetch(&remote_free_queues, 1UL << i, __ATOMIC_RELEASE);
+	}
+
+	pthread_mutex_lock(&slab_lock);
+
+	/* Nobody owns a listed run, so the slots given back to it are collected here. The first slot given back
+	   to a listed run since we last looked wakes us up, which happens once per decay time at most */
+	if (now < slab_collected + decay_ms) {
+		due = slab_collected + decay_ms;
+	} else {
+		slab_collected = now;
+
+		for (class = 0; class < SLAB_CLASSES; class++) {
+			link = &slab_partial[class];
+
+			while ((run = *link) != NULL) {
+				if (slab_collect(run) != run->slots) {
+					link = &run->next;
+					continue;
+				}
+
+				*link = run->next;
+				slab_pool_add(run);
+
+				PROFILE(ON, slab_runs--);
+			}
+		}
+	}
+
+	list_for_each_entry_safe(seg, next, &slab_segs, list) {
+		slab = (slab_segment_t *)seg;
+
+		if (slab->pooled != SLAB_RUNS - 1)
+			continue;
+
+		if (now < seg->idle + decay_ms) {
+			if (due == 0 || seg->idle + decay_ms < due)
+				due = seg->idle + decay_ms;
+			continue;
+		}
+
+		/* The thread which gave back the last slot of a run may not be done with the run yet */
+		for (i = 1; i < SLAB_RUNS && __atomic_load_n(&slab->runs[i].releasing, __ATOMIC_ACQUIRE) == 0; i++);
+
+		if (i < SLAB_RUNS) {
+			if (due == 0 || now + 1 < due)
+				due = now + 1;
+			continue;
+		}
+
+		for (i = 1; i < SLAB_RUNS; i++)
+			list_del(&slab->runs[i].list);
+
+		list_del(&seg->list);
+		seg_map_remove(seg);
+		list_add_tail(&seg->list, unmap);
+		PROFILE(ON, tier_maps[seg->tier]--);
+		PROFILE(ON, purged_maps++);
+	}
+
+	pthread_mutex_unlock(&slab_lock);
+
+	return due;
+}
+
+/*
+ *
+ * Name:
+ * slab_adopt
+ *
+ * Description:
+ * This is a helper function which hands the calling thread a slab run of the
+ * given class which nobody owns. Runs from the partial list of the class
+ * come first, then runs from the pool, and a new slab segment is mapped as
+ * a last resort. It returns NULL when we are out of memory
+ *
+ */
+static slab_run_t *slab_adopt(unsigned int class)
+{
+	slab_run_t	*run;
+	unsigned int	size, word;
+
+	for (;;) {
+		pthread_mutex_lock(&slab_lock);
+
+		/* Partial runs are adopted as they are */
+		run = slab_partial[class];
+
+		if (run != NULL) {
+			slab_partial[class] = run->next;
+			run->listed = 0;
+			__atomic_store_n(&run->owner, &tcache, __ATOMIC_RELAXED);
+			__atomic_store_n(&run->queue, tcache.queue, __ATOMIC_RELAXED);
+
+			pthread_mutex_unlock(&slab_lock);
+
+			slab_collect(run);
+
+			return run;
+		}
+
+		/* Free runs are cut into slots of the class first */
+		if (!list_empty(&slab_pool)) {
+			run = list_entry(slab_pool.next, slab_run_t, list);
+			list_del(&run->list);
+			run->listed = 0;
+			SLAB_SEGMENT(run)->pooled--;
+			__atomic_store_n(&run->owner, &tcache, __ATOMIC_RELAXED);
+			__atomic_store_n(&run->queue, tcache.queue, __ATOMIC_RELAXED);
+
+			PROFILE(ON, slab_runs++);
+
+			pthread_mutex_unlock(&slab_lock);
+
+			size = SLAB_CLASS_SIZE(class);
+			run->size = size;
+			run->inv = (unsigned int)((1UL << 32) / size + 1);
+			run->class = class;
+			run->slots = SLAB_RUN_SIZE / size;
+			run->words = (run->slots + 63) / 64;
+			run->free = run->slots;
+			run->hint = 0;
+
+			for (word = 0; word < run->words; word++)
+				run->local[word] = ~0UL;
+
+			if (run->slots % 64 != 0)
+				run->local[run->words - 1] = (1UL << (run->slots % 64)) - 1;
+
+			return run;
+		}
+
+		pthread_mutex_unlock(&slab_lock);
+
+		if (slab_segment_create() < 0)
+			return NULL;
+	}
+}
+
+static void slab_release(void *ptr);
+
+/*
+ *
+ * Name:
+ * remote_claim
+ *
+ * Description:
+ * This is a helper function which gives the calling thread a remote queue of
+ * its own, if any is left. The thread cache is registered on the way so that
+ * the queue is given back when the thread exits
+ *
+ */
+static void remote_claim(void)
+{
+	unsigned long free_queues = __atomic_load_n(&remote_free_queues, __ATOMIC_RELAXED);
+
+	/* The thread cache cannot be registered before the heap is set up */
+	pthread_mutex_lock(&heap_lock);
+
+	if (init == 0)
+		heap_init();
+
+	pthread_mutex_unlock(&heap_lock);
+
+	while (free_queues != 0) {
+		if (__atomic_compare_exchange_n(&remote_free_queues, &free_queues, free_queues & (free_queues - 1),
+						0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			tcache.queue = &remote_queues[__builtin_ctzl(free_queues)];
+			break;
+		}
+	}
+
+	if (!tcache.registered) {
+		tcache.registered = 1;
+		pthread_setspecific(tcache_key, &tcache);
+	}
+}
+
+/*
+ *
+ * Name:
+ * remote_drain
+ *
+ * Description:
+ * This is a helper function which takes every run other threads pushed onto
+ * the remote queue of the calling thread in one go, and merges the slots
+ * they gave back. Full runs which got slots back can be taken from again.
+ * Runs never change hands while they are on a queue, except for the orphans
+ * of the queue, which are given up here once they come off it
+ *
+ */
+static void remote_drain(void)
+{
+	remote_queue_t	*queue = tcache.queue;
+	slab_run_t	*run, *next;
+	void		*owner;
+
+	if (queue == NULL || __atomic_load_n(&queue->head, __ATOMIC_RELAXED) == NULL)
+		return;
+
+	run = __atomic_exchange_n(&queue->head, NULL, __ATOMIC_ACQUIRE);
+
+	while (run != NULL) {
+		next = run->remote_next;
+
+		/* Slots given back from now on push the run again */
+		__atomic_store_n(&run->queued, 0, __ATOMIC_SEQ_CST);
+
+		owner = __atomic_load_n(&run->owner, __ATOMIC_SEQ_CST);
+
+		if (owner == &tcache && slab_collect(run) != 0 && run->full) {
+			run->full = 0;
+			list_move(&run->list, &tcache.slab_avail[run->class]);
+		} else if (owner == queue) {
+			__atomic_store_n(&run->owner, &tcache, __ATOMIC_RELAXED);
+			__atomic_sub_fetch(&queue->orphans, 1, __ATOMIC_RELAXED);
+			slab_collect(run);
+			slab_disown(run);
+		}
+
+		run = next;
+	}
+}
+
+/*
+ *
+ * Name:
+ * remote_free
+ *
+ * Description:
+ * This is a helper function which gives a slot freed by a thread which does
+ * not own its run straight back to the run, instead of caching it here. It
+ * returns -1 if the run is ours, has no owner or its owner has no queue, in
+ * which case the slot is freed as usual
+ *
+ */
+static inline int remote_free(void *ptr)
+{
+	slab_run_t	*run = SLAB_RUN(ptr);
+	remote_queue_t	*queue = __atomic_load_n(&run->queue, __ATOMIC_RELAXED);
+
+	if (queue == NULL || queue == tcache.queue)
+		return -1;
+
+	PROFILE(ON, STATS_ADD(slab_used, -(unsigned long)run->size));
+	PROFILE(ON, STATS_ADD(remote_frees, 1));
+
+	slab_release(ptr);
+
+	return 0;
+}
+
+/*
+ *
+ * Name:
+ * slab_refill
+ *
+ * Description:
+ * This is a helper function which hands out a slot once the current slab run
+ * of the calling thread has none left. The runs on our remote queue get the
+ * slots other threads gave back first. Then the slots given back to the
+ * current run come first, then the other runs of the thread which had slots
+ * given back, then a few of its full runs, which matters to threads without
+ * a remote queue, and a run nobody owns as a last resort
+ *
+ */
+static void *slab_refill(unsigned int class)
+{
+	slab_run_t	*run = tcache.slab[class];
+	unsigned int	i;
+
+	if (!tcache.slab_ready) {
+		for (i = 0; i < SLAB_CLASSES; i++) {
+			INIT_LIST_HEAD(&tcache.slab_avail[i]);
+			INIT_LIST_HEAD(&tcache.slab_full[i]);
+		}
+
+		tcache.slab_ready = 1;
+		remote_claim();
+	}
+
+	remote_drain();
+
+	if (run != NULL) {
+		if (slab_collect(run) != 0)
+			return slab_take(run);
+
+		/* The run stays ours, it gets slots back as its blocks are freed */
+		run->full = 1;
+		list_add(&run->list, &tcache.slab_full[class]);
+		tcache.slab[class] = NULL;
+	}
+
+	if (!list_empty(&tcache.slab_avail[class])) {
+		run = list_entry(tcache.slab_avail[class].next, slab_run_t, list);
+		list_del(&run->list);
+
+		goto found;
+	}
+
+	/* The runs which went full first had the most time to get slots back from other threads */
+	for (i = 0; i < SLAB_SCAN && !list_empty(&tcache.slab_full[class]); i++) {
+		run = list_entry(tcache.slab_full[class].prev, slab_run_t, list);
+		list_move(&run->list, &tcache.slab_full[class]);
+
+		if (slab_collect(run) != 0) {
+			list_del(&run->list);
+			run->full = 0;
+
+			goto found;
+		}
+	}
+
+	run = slab_adopt(class);
+
+	if (run == NULL)
+		return NULL;
+
+found:
+	tcache.slab[class] = run;
+
+	/* Register the thread cache so that its runs are given up when the thread exits */
+	if (!tcache.registered) {
+		tcache.registered = 1;
+		pthread_setspecific(tcache_key, &tcache);
+	}
+
+	return slab_take(run);
+}
+
+/*
+ *
+ * Name:
+ * slab_alloc
+ *
+ * Description:
+ * This is a helper function which hands out a slot of the given class from
+ * the thread cache, or from the current slab run of the calling thread,
+ * without taking any lock
+ *
+ */
+static inline void *slab_alloc(unsigned int class)
+{
+	slab_run_t	*run = tcache.slab[class];
+	void		*ptr = tcache.slab_head[class];
+
+	/* Runs other threads pushed onto our remote queue get their slots back on our next malloc */
+	if (tcache.queue != NULL && __atomic_load_n(&tcache.queue->head, __ATOMIC_RELAXED) != NULL)
+		remote_drain();
+
+	if (ptr != NULL) {
+		tcache.slab_head[class] = SLAB_NEXT(ptr);
+		tcache.slab_count[class]--;
+
+		return ptr;
+	}
+
+	if (run == NULL || run->free == 0)
+		return slab_refill(class);
+
+	return slab_take(run);
+}
+
+/*
+ *
+ * Name:
+ * slab_release
+ *
+ * Description:
+ * This is a helper function which gives a slot back to its slab run. The
+ * owner of the run sets its bit without atomic operations, while any other
+ * thread sets it in the remote bitmap and either pushes the run onto the
+ * remote queue of its owner or lists the run if nobody owns it. Once the
+ * run is listed, the purge thread is told that it has slots to collect
+ *
+ */
+static void slab_release(void *ptr)
+{
+	slab_run_t	*run = SLAB_RUN(ptr), *head;
+	remote_queue_t	*queue;
+	unsigned long	index, bit;
+	unsigned int	word;
+
+	/* Slots are multiples of SLAB_STEP, so the reciprocal gives the exact index */
+	index = (((unsigned long)ptr - (unsigned long)run->base) * run->inv) >> 32;
+	word = index / 64;
+	bit = 1UL << (index % 64);
+
+	if (__atomic_load_n(&run->owner, __ATOMIC_RELAXED) == &tcache) {
+		run->local[word] |= bit;
+		run->free++;
+
+		if (word < run->hint)
+			run->hint = word;
+
+		/* Full runs can be taken from again, and empty ones are left for any thread to use */
+		if (run->full) {
+			run->full = 0;
+			list_move(&run->list, &tcache.slab_avail[run->class]);
+		} else if (run->free == run->slots && run != tcache.slab[run->class]) {
+			list_del(&run->list);
+			slab_detach(run);
+		}
+
+		return;
+	}
+
+	/* Our slot may be the last one the run was waiting for, so that it goes back to the pool and its segment
+	   is unmapped as soon as the bit is set. We count ourselves in until we are done with the run */
+	__atomic_fetch_add(&run->releasing, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_or(&run->remote[word], bit, __ATOMIC_SEQ_CST);
+
+	/* Nobody but the purge thread looks at a listed run, so it is told about the first slot given back */
+	if (__atomic_load_n(&run->pending, __ATOMIC_RELAXED) == 0 && !__atomic_exchange_n(&run->pending, 1, __ATOMIC_RELEASE) &&
+	    __atomic_load_n(&run->listed, __ATOMIC_RELAXED) && decay_ms >= 0)
+		__atomic_store_n(&purge_pending, 1, __ATOMIC_RELAXED);
+
+	/* The first slot given back since the owner last looked pushes the run onto its remote queue */
+	queue = __atomic_load_n(&run->queue, __ATOMIC_RELAXED);
+
+	if (queue != NULL && !__atomic_load_n(&run->queued, __ATOMIC_SEQ_CST) && !__atomic_exchange_n(&run->queued, 1, __ATOMIC_SEQ_CST)) {
+		head = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+
+		do {
+			run->remote_next = head;
+		} while (!__atomic_compare_exchange_n(&queue->head, &head, run, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	}
+
+	if (__atomic_load_n(&run->owner, __ATOMIC_SEQ_CST) != NULL || __atomic_load_n(&run->listed, __ATOMIC_RELAXED))
+		goto done;
+
+	pthread_mutex_lock(&slab_lock);
+
+	if (run->owner == NULL && !run->listed) {
+		run->listed = 1;
+		run->next = slab_partial[run->class];
+		slab_partial[run->class] = run;
+
+		if (decay_ms >= 0)
+			__atomic_store_n(&purge_pending, 1, __ATOMIC_RELAXED);
+	}
+
+	pthread_mutex_unlock(&slab_lock);
+
+done:
+	__atomic_fetch_sub(&run->releasing, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ *
+ * Name:
+ * slab_flush
+ *
+ * Description:
+ * This is a helper function which gives a batch of the slots cached by the
+ * calling thread back to their slab runs
+ *
+ */
+static void slab_flush(unsigned int class)
+{
+	void		*ptr;
+	unsigned int	i;
+
+	for (i = 0; i < TCACHE_BATCH && tcache.slab_count[class] > 0; i++) {
+		ptr = tcache.slab_head[class];
+		tcache.slab_head[class] = SLAB_NEXT(ptr);
+		tcache.slab_count[class]--;
+
+		slab_release(ptr);
+	}
+}
+
+/*
+ *
+ * Name:
+ * slab_free
+ *
+ * Description:
+ * This is a helper function which puts a freed slot in the thread cache, from
+ * where it is handed out again first. The cache overflows back to the slab
+ * runs TCACHE_BATCH slots at a time
+ *
+ */
+static inline void slab_free(void *ptr)
+{
+	slab_run_t	*run = SLAB_RUN(ptr);
+	unsigned int	class = run->class;
+
+	PROFILE(ON, STATS_ADD(slab_used, -(unsigned long)run->size));
+
+	/* Register the thread cache so that it is given back when the thread exits */
+	if (!tcache.registered) {
+		tcache.registered = 1;
+		pthread_setspecific(tcache_key, &tcache);
+	}
+
+	SLAB_NEXT(ptr) = tcache.slab_head[class];
+	tcache.slab_head[class] = ptr;
+
+	if (++tcache.slab_count[class] > TCACHE_LIMIT)
+		slab_flush(class);
+}
+
+/*
+ *
+ * Name:
+ * colour_read
+ *
+ * Description:
+ * This is a helper function which reads the pagemap entries of the given
+ * number of pages starting at the given address. Once the frame numbers
+ * turn out to be hidden from us, or the pagemap cannot be read, the entries
+ * read as zero from then on and colours follow the virtual addresses. The
+ * pagemap is opened the first time it is needed. It must be called with the
+ * colour lock held
+ *
+ */
+static void colour_read(unsigned long addr, unsigned long *entries, unsigned int count)
+{
+	size_t	size = count * sizeof(entries[0]);
+
+	if (colour_physical && colour_fd < 0)
+		colour_fd = open(SYS_PAGEMAP, O_RDONLY | O_CLOEXEC);
+
+	if (colour_physical && pread(colour_fd, entries, size, (addr / COLOUR_PAGE) * sizeof(entries[0])) == (ssize_t)size) {
+		/* A page which is present has a frame, unless we are not allowed to see it */
+		if (!(entries[0] & PAGEMAP_PRESENT) || (entries[0] & PAGEMAP_PFN_MASK) != 0)
+			return;
+	}
+
+	if (colour_physical) {
+		colour_physical = 0;
+
+		if (colour_fd >= 0)
+			close(colour_fd);
+
+		colour_fd = -1;
+	}
+
+	memset(entries, 0, size);
+}
+
+/*
+ *
+ * Name:
+ * colour_frame
+ *
+ * Description:
+ * This is a helper function which gives the cache colour of the page at the
+ * given address from its pagemap entry. The virtual address stands in for
+ * the frame when the entry has none
+ *
+ */
+static inline unsigned int colour_frame(unsigned long addr, unsigned long entry)
+{
+	if ((entry & PAGEMAP_PRESENT) && (entry & PAGEMAP_PFN_MASK) != 0)
+		addr = (entry & PAGEMAP_PFN_MASK) * COLOUR_PAGE;
+
+	return (addr % colour_way) / colour_unit;
+}
+
+/*
+ *
+ * Name:
+ * colour_segment_create
+ *
+ * Description:
+ * This is a helper function which maps a new colour segment, finds out the
+ * colour of each of its pages and adds them to the free lists of their
+ * colours. The pages are touched first so that they have frames, and the
+ * colours hold as long as the kernel does not move the frames, which it
+ * does not do for huge pages. It must be called with the colour lock held
+ * and returns -1 when we are out of memory or COLOUR_SEG_LIMIT segments are
+ * mapped already
+ *
+ */
+static int colour_segment_create(void)
+{
+	colour_segment_t	*cseg;
+	colour_page_t		*page;
+	segment_t		*seg;
+	unsigned long		entries[COLOUR_PAGES];
+	unsigned int		i;
+
+	if (colour_segments == COLOUR_SEG_LIMIT)
+		return -1;
+
+	pthread_mutex_lock(&heap_lock);
+
+	seg = segment_map(SYS_HUGE_PAGE_SIZE, SYS_HUGE_PAGE_SIZE);
+
+	if (seg != NULL) {
+		seg->colour = 1;
+		seg->pinned = 1;
+	}
+
+	pthread_mutex_unlock(&heap_lock);
+
+	if (seg == NULL)
+		return -1;
+
+	cseg = (colour_segment_t *)seg;
+
+	for (i = COLOUR_HEADER_PAGES; i < COLOUR_PAGES; i++)
+		*(volatile char *)((unsigned long)seg + i * COLOUR_PAGE) = 0;
+
+	colour_read((unsigned long)seg + COLOUR_HEADER_PAGES * COLOUR_PAGE, entries + COLOUR_HEADER_PAGES,
+		    COLOUR_PAGES - COLOUR_HEADER_PAGES);
+
+	/* The headers of a fresh mapping are zeroed already, which leaves the header pages as they are */
+	for (i = COLOUR_HEADER_PAGES; i < COLOUR_PAGES; i++) {
+		page = &cseg->pages[i];
+		page->colour = colour_frame((unsigned long)seg + i * COLOUR_PAGE, entries[i]);
+		page->state = COLOUR_PAGE_FREE;
+		list_add_tail(&page->list, &colour_free[page->colour]);
+	}
+
+	list_add_tail(&seg->list, &colour_segs);
+	colour_segments++;
+
+	return 0;
+}
+
+/*
+ *
+ * Name:
+ * colour_slot_alloc
+ *
+ * Description:
+ * This is a helper function which hands out a slot of the class of the given
+ * size from a page of one of the given colours. The thread keeps filling the
+ * page it took slots from last, and moves on to the next of its colours once
+ * that page is full, so that its blocks are spread over all of its colours.
+ * It must be called with the colour lock held and returns NULL when none of
+ * the colours has a page left
+ *
+ */
+static void *colour_slot_alloc(size_t size, unsigned long mask)
+{
+	colour_page_t	*page;
+	unsigned int	class = COLOUR_CLASS(size);
+	unsigned int	colour, word, bit, n;
+
+	for (;;) {
+		colour = tcache.colour_next % colours;
+
+		if ((mask & (1UL << colour)) && !list_empty(&colour_partial[class][colour]))
+			goto found;
+
+		for (n = 1; n <= colours; n++) {
+			colour = (tcache.colour_next + n) % colours;
+
+			if (!(mask & (1UL << colour)))
+				continue;
+
+			if (!list_empty(&colour_partial[class][colour]))
+				goto found;
+
+			/* Cut a free page of this colour into slots of the class */
+			if (!list_empty(&colour_free[colour])) {
+				page = list_entry(colour_free[colour].next, colour_page_t, list);
+				page->state = COLOUR_PAGE_SLOTS;
+				page->class = class;
+				page->size = COLOUR_SLOT_MIN << class;
+				page->slots = COLOUR_PAGE / page->size;
+				page->free = page->slots;
+
+				for (word = 0; word < COLOUR_WORDS; word++)
+					page->map[word] = (word * 64 < page->slots) ? ~0UL : 0;
+
+				if (page->slots < 64)
+					page->map[0] = (1UL << page->slots) - 1;
+
+				list_move(&page->list, &colour_partial[class][colour]);
+
+				PROFILE(ON, colour_pages++);
+
+				goto found;
+			}
+		}
+
+		if (colour_segment_create() < 0)
+			return NULL;
+	}
+
+found:
+	tcache.colour_next = colour;
+	page = list_entry(colour_partial[class][colour].next, colour_page_t, list);
+
+	for (word = 0; page->map[word] == 0; word++);
+
+	bit = __builtin_ctzl(page->map[word]);
+	page->map[word] &= page->map[word] - 1;
+
+	/* Full pages are on no list until a slot is given back */
+	if (--page->free == 0)
+		list_del(&page->list);
+
+	return COLOUR_PAGE_ADDR(page) + (word * 64 + bit) * page->size;
+}
+
+/*
+ *
+ * Name:
+ * colour_span_alloc
+ *
+ * Description:
+ * This is a helper function which hands out a span of consecutive free pages
+ * which are all of the given colours and together hold the given size. The
+ * colour segments are scanned for one. It must be called with the colour
+ * lock held and returns NULL when there is no such span
+ *
+ */
+static void *colour_span_alloc(size_t size, unsigned long mask)
+{
+	colour_segment_t	*cseg = NULL;
+	colour_page_t		*page;
+	segment_t		*seg;
+	unsigned long		pages = (size + COLOUR_PAGE - 1) / COLOUR_PAGE;
+	unsigned int		i, run;
+
+	for (;;) {
+		list_for_each_entry(seg, &colour_segs, list) {
+			cseg = (colour_segment_t *)seg;
+
+			for (i = COLOUR_HEADER_PAGES, run = 0; i < COLOUR_PAGES; i++) {
+				page = &cseg->pages[i];
+
+				if (page->state != COLOUR_PAGE_FREE || !(mask & (1UL << page->colour)))
+					run = 0;
+				else if (++run == pages)
+					goto found;
+			}
+		}
+
+		if (colour_segment_create() < 0)
+			return NULL;
+	}
+
+found:
+	page = &cseg->pages[i + 1 - pages];
+
+	for (i = 0; i < pages; i++) {
+		list_del(&page[i].list);
+		page[i].state = COLOUR_PAGE_TAIL;
+	}
+
+	page->state = COLOUR_PAGE_SPAN;
+	page->pages = pages;
+	page->size = pages * COLOUR_PAGE;
+
+	PROFILE(ON, colour_pages += pages);
+
+	return COLOUR_PAGE_ADDR(page);
+}
+
+/*
+ *
+ * Name:
+ * colour_span_limit
+ *
+ * Description:
+ * This is a helper function which gives the largest span the given colours
+ * can ever hold. Pages of a segment go through the colours in turn, a unit
+ * at a time, so a span cannot be longer than the longest run of colours in
+ * the mask, counting the ones which wrap around
+ *
+ */
+static unsigned long colour_span_limit(unsigned long mask)
+{
+	unsigned long	limit = (COLOUR_PAGES - COLOUR_HEADER_PAGES) * COLOUR_PAGE;
+	unsigned int	colour, run = 0, best = 0;
+
+	if (mask == colour_all())
+		return limit;
+
+	for (colour = 0; colour < 2 * colours; colour++) {
+		run = (mask & (1UL << (colour % colours))) ? run + 1 : 0;
+
+		if (run > best)
+			best = run;
+	}
+
+	return (best * colour_unit < limit) ? best * colour_unit : limit;
+}
+
+/*
+ *
+ * Name:
+ * colour_alloc
+ *
+ * Description:
+ * This is a helper function which hands out a block from pages of the cache
+ * colours the calling thread is restricted to. It returns NULL when the
+ * thread is not restricted, or the block cannot be placed in its colours,
+ * in which case it comes from the regular heap instead. Blocks which no
+ * span of its colours can ever hold are turned away before any segment is
+ * mapped for them
+ *
+ */
+static void *colour_alloc(size_t size)
+{
+	unsigned long	mask = tcache.colours_set ? tcache.colours : colour_default;
+	void		*ptr;
+
+	if (mask == 0 || (size > COLOUR_SLOT_MAX && size > colour_span_limit(mask)))
+		return NULL;
+
+	pthread_mutex_lock(&colour_lock);
+
+	if (size <= COLOUR_SLOT_MAX)
+		ptr = colour_slot_alloc(size, mask);
+	else
+		ptr = colour_span_alloc(size, mask);
+
+	PROFILE(ON, colour_used += (ptr != NULL) ? COLOUR_PAGE_OF(ptr)->size : 0);
+
+	pthread_mutex_unlock(&colour_lock);
+
+	return ptr;
+}
+
+/*
+ *
+ * Name:
+ * colour_release
+ *
+ * Description:
+ * This is a helper function which gives a block back to its colour pages.
+ * Pages which hold no block any more go back to the free list of their
+ * colour, from where any thread restricted to that colour takes them
+ *
+ */
+static void colour_release(void *ptr)
+{
+	colour_page_t	*page = COLOUR_PAGE_OF(ptr);
+	unsigned long	index;
+	unsigned int	i;
+
+	pthread_mutex_lock(&colour_lock);
+
+	PROFILE(ON, colour_used -= page->size);
+
+	if (page->state == COLOUR_PAGE_SPAN) {
+		for (i = 0; i < page->pages; i++) {
+			page[i].state = COLOUR_PAGE_FREE;
+			list_add(&page[i].list, &colour_free[page[i].colour]);
+		}
+
+		PROFILE(ON, colour_pages -= page->pages);
+
+		goto done;
+	}
+
+	/* Slots are powers of two, so the index is a plain division */
+	index = ((unsigned long)ptr - (unsigned long)COLOUR_PAGE_ADDR(page)) / page->size;
+	page->map[index / 64] |= 1UL << (index % 64);
+
+	if (++page->free == page->slots) {
+		page->state = COLOUR_PAGE_FREE;
+		list_move(&page->list, &colour_free[page->colour]);
+
+		PROFILE(ON, colour_pages--);
+	} else if (page->free == 1) {
+		list_add(&page->list, &colour_partial[page->class][page->colour]);
+	}
+
+done:
+	pthread_mutex_unlock(&colour_lock);
+}
+
+/*
+ *
+ * Name:
+ * stats_claim
+ *
+ * Description:
+ * This is a helper function which hands the calling thread a stats shard
+ * of its own, or the shared one if they are all taken. The thread cache is
+ * registered on the way so that the shard is given back when the thread
+ * exits
+ *
+ */
+static void stats_claim(void)
+{
+	unsigned long free_shards = __atomic_load_n(&stats_free_shards, __ATOMIC_RELAXED);
+
+	tcache.stats_shared = 1;
+	tcache.stats = &stats_shards[STATS_SHARDS];
+
+	while (free_shards != 0) {
+		if (__atomic_compare_exchange_n(&stats_free_shards, &free_shards, free_shards & (free_shards - 1),
+						0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			tcache.stats_shared = 0;
+			tcache.stats = &stats_shards[__builtin_ctzl(free_shards)];
+			break;
+		}
+	}
+
+	if (!tcache.registered) {
+		tcache.registered = 1;
+		pthread_setspecific(tcache_key, &tcache);
+	}
+}
+
+/*
+ *
+ * Name:
+ * tcache_destroy
+ *
+ * Description:
+ * This is a helper function which gives every chunk cached by an exiting
+ * thread back to the shared heap, and hands its slab runs and its stats
+ * shard back
+ *
+ */
+static void tcache_destroy(void *arg)
+{
+	slab_run_t	*run;
+	unsigned int	class;
+
+	(void)arg;
+
+	/* Slots pushed by other threads go back to our runs first */
+	remote_drain();
+
+	/* Cached slots go back to their runs, which are left for other threads to adopt */
+	for (class = 0; class < SLAB_CLASSES; class++) {
+		while (tcache.slab_count[class] > 0)
+			slab_flush(class);
+
+		if (tcache.slab[class] != NULL)
+			slab_detach(tcache.slab[class]);
+
+		tcache.slab[class] = NULL;
+
+		if (!tcache.slab_ready)
+			continue;
+
+		/* Draining our remote queue on the way may move full runs over to the available ones */
+		for (;;) {
+			if (!list_empty(&tcache.slab_avail[class]))
+				run = list_entry(tcache.slab_avail[class].next, slab_run_t, list);
+			else if (!list_empty(&tcache.slab_full[class]))
+				run = list_entry(tcache.slab_full[class].next, slab_run_t, list);
+			else
+				break;
+
+			list_del(&run->list);
+			slab_detach(run);
+		}
+	}
+
+	/* Runs which other threads were still pushing as we left them are given up by the next thread which
+	   claims the queue, or by the purge thread */
+	if (tcache.queue != NULL && __atomic_load_n(&tcache.queue->orphans, __ATOMIC_RELAXED) != 0 && decay_ms >= 0)
+		__atomic_store_n(&purge_pending, 1, __ATOMIC_RELAXED);
+
+	if (tcache.queue != NULL)
+		__atomic_or_fetch(&remote_free_queues, 1UL << (tcache.queue - remote_queues), __ATOMIC_RELEASE);
+
+	tcache.queue = NULL;
+
+	/* The shard keeps its counts for the next thread which claims it */
+	if (tcache.stats != NULL && !tcache.stats_shared)
+		__atomic_or_fetch(&stats_free_shards, 1UL << (tcache.stats - stats_shards), __ATOMIC_RELEASE);
+
+	tcache.stats = NULL;
+	tcache.stats_shared = 0;
+
+	pthread_mutex_lock(&heap_lock);
+
+	for (class = 0; class < TCACHE_CLASSES; class++) {
+		heap_free_cached(tcache.head[class]);
+		tcache.head[class] = NULL;
+		tcache.count[class] = 0;
+	}
+
+	pthread_mutex_unlock(&heap_lock);
+
+	/* Slots given back to listed runs and memory which went idle on the way wait for the purge thread */
+	if (__atomic_load_n(&purge_pending, __ATOMIC_RELAXED))
+		purge_kick();
+
+	tcache.registered = 0;
+}
+
+
+/*********************************************
+ * Function Definitions
+ ********************************************/
+
+/* 
+ *
+ * Name:
+ * malloc_common
+ *
+ * Description:
+ * This is a helper function which performs dynamic memory allocation on
+ * behalf of malloc and of the calls built on top of it
+ *
+ */
+static inline void *malloc_common(size_t size)
+{
+	track_t		*tracker = NULL;
+	unsigned int	class;
+	void		*ptr;
+	LATENCY(unsigned long start = lat_now());
+	LATENCY(int first = !init);
+
+	/* Requests this large can never be satisfied */
+	if (size > MEM_MAX_REQUEST) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	PROFILE(ON, tcache.steps = 0);
+
+	/* The settings which pick the path below are read when the heap is set up */
+	if (__atomic_load_n(&init, __ATOMIC_ACQUIRE) == 0) {
+		pthread_mutex_lock(&heap_lock);
+
+		if (init == 0)
+			heap_init();
+
+		pthread_mutex_unlock(&heap_lock);
+	}
+
+	/* Threads kept to some cache colours get their blocks from pages of those colours */
+	if (colour_on) {
+		LATENCY(tcache.lat_path = HG_LAT_MALLOC_COLOUR);
+		ptr = colour_alloc(size);
+
+		if (ptr != NULL)
+			goto counted;
+	}
+
+	/* The smallest requests get a slot in a slab run, which carries no tracker */
+	if (size <= SLAB_MAX_SIZE && slab_on) {
+		LATENCY(tcache.lat_path = HG_LAT_MALLOC_SLAB);
+		class = SLAB_CLASS(size);
+		ptr = slab_alloc(class);
+
+		/* Out of Memory!!! */
+		if (ptr == NULL) {
+			errno = ENOMEM;
+			return NULL;
+		}
+
+		PROFILE(ON, STATS_ADD(slab_used, SLAB_CLASS_SIZE(class)));
+
+		goto counted;
+	}
+
+	LATENCY(tcache.lat_path = HG_LAT_MALLOC_CACHE);
+
+	/* Small requests are served from the thread cache without taking any lock */
+	if (size <= TCACHE_MAX_SIZE) {
+		class = TCACHE_CLASS(size);
+		tracker = tcache.head[class];
+
+		if (tracker == NULL) {
+			tracker = tcache_refill(class);
+			goto checked;
+		}
+
+		tcache.head[class] = CACHE_NEXT(tracker);
+		tcache.count[class]--;
+
+		tracker->free = CHUNK_IN_USE;
+
+		/* Keep track of trackers reusage information */
+		PROFILE(ON, STATS_ADD(reused_trackers, 1));
+
+		goto done;
+	}
+
+	pthread_mutex_lock(&heap_lock);
+	tracker = heap_alloc(CHUNK_ROUND((unsigned long)size));
+	pthread_mutex_unlock(&heap_lock);
+
+checked:
+	/* Out of Memory!!! */
+	if (tracker == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+done:
+	ptr = MEM_GET_ADDRESS(tracker);
+
+counted:
+	/* Find out if this the largest allocation request so far, and the longest walk */
+	PROFILE(ON, STATS_MAX(max_req, size));
+	PROFILE(ON, STATS_MAX(max_steps, tcache.steps));
+	PROFILE(ON, STATS_ADD(mallocs, 1));
+
+	/* Count the time this call took against the path it took */
+	LATENCY(lat_record(first ? HG_LAT_MALLOC_INIT : tcache.lat_path, start));
+
+	/* Return the address to caller */
+	return ptr;
+}
+
+/* 
+ *
+ * Name:
+ * __wrap_malloc
+ *
+ * Description:
+ * This function intercepts the call to malloc and performs
+ * dynamic memory allocation on behalf of the caller
+ *
+ */
+void *HG_SYM(malloc)(size_t size)
+{
+	void		*ptr = malloc_common(size);
+
+	/* Allocations are recorded once they have returned */
+	TRACE(trace_record(TRACE_OP_MALLOC, ptr, NULL, size));
+
+	return ptr;
+}
+
+/* 
+ *
+ * Name:
+ * free_common
+ *
+ * Description:
+ * This is a helper function which frees the allocated memory on behalf of
+ * free and realloc, and performs defragmentation whenever possible
+ *
+ */
+static inline void free_common(void *ptr)
+{
+	track_t		*tracker;
+	segment_t	*seg, *victim;
+	struct list_head unmap;
+	unsigned int	class;
+	LATENCY(unsigned long start = lat_now());
+	LATENCY(unsigned int path = HG_LAT_FREE_CACHE);
+
+	/* Freeing a NULL pointer is a no-op */
+	if (ptr == NULL)
+		return;
+
+	PROFILE(ON, tcache.steps = 0);
+
+	/* Find the segment holding this chunk. Pointers outside of our segments belong to someone else */
+	seg = seg_lookup(ptr);
+
+	if (seg == NULL) {
+		HG_REAL(free)(ptr);
+		return;
+	}
+
+	/* Blocks in colour pages go back to their page */
+	if (seg->colour) {
+		LATENCY(path = HG_LAT_FREE_COLOUR);
+		colour_release(ptr);
+
+		goto done;
+	}
+
+	/* Slots go back to their run, which is found from the address alone. Slots of runs other threads
+	   own are not cached here, so that they go back to their owner */
+	if (seg->slab) {
+		LATENCY(path = HG_LAT_FREE_REMOTE);
+
+		if (remote_free(ptr) == 0)
+			goto done;
+
+		LATENCY(path = HG_LAT_FREE_SLAB);
+		slab_free(ptr);
+
+		goto done;
+	}
+
+	/* Get the tracker from the address */
+	tracker = MEM_GET_TRACKER(ptr);
+
+	/* Large chunks give their whole segment back */
+	if (seg->large) {
+		LATENCY(path = HG_LAT_FREE_LARGE);
+		INIT_LIST_HEAD(&unmap);
+
+		pthread_mutex_lock(&heap_lock);
+		large_free(seg, &unmap);
+		pthread_mutex_unlock(&heap_lock);
+
+		/* Unmapping can take a while so it is done without holding the lock */
+		list_for_each_entry_safe(seg, victim, &unmap, list)
+			heap_unmap(seg, seg->size);
+
+		goto done;
+	}
+
+	/* Small chunks go to the thread cache unless they sit at the end of their segment, where
+	   freeing them shrinks the heap. The end of the segment may move under us but then it
+	   only moves away from this chunk. Chunks of the classes slabs take over would never be
+	   handed out again, so the odd one left by memalign or realloc goes back to the heap */
+	if (CHUNK_SIZE(tracker) <= TCACHE_CLASS_SIZE(TCACHE_CLASSES - 1) && (void *)CHUNK_NEXT(tracker) != __atomic_load_n(&seg->top, __ATOMIC_RELAXED) &&
+	    (!slab_on || TCACHE_CHUNK_CLASS(tracker) >= TCACHE_CLASS(SLAB_MAX_SIZE + 1))) {
+		class = TCACHE_CHUNK_CLASS(tracker);
+
+		/* Register the thread cache so that it is given back when the thread exits */
+		if (!tcache.registered) {
+			tcache.registered = 1;
+			pthread_setspecific(tcache_key, &tcache);
+		}
+
+		tracker->free = CHUNK_CACHED;
+		CACHE_NEXT(tracker) = tcache.head[class];
+		tcache.head[class] = tracker;
+
+		if (++tcache.count[class] > TCACHE_LIMIT) {
+			LATENCY(path = HG_LAT_FREE_FLUSH);
+			tcache_flush(class);
+		}
+
+		goto done;
+	}
+
+	LATENCY(path = HG_LAT_FREE_HEAP);
+
+	pthread_mutex_lock(&heap_lock);
+
+	heap_free(seg, tracker);
+
+	/* Cached chunks may be in the way of shrinking the segment any further. There may be any number
+	   of them, so TLSF mode leaves them where they are */
+	if (!tlsf)
+		heap_unblock(seg);
+
+	pthread_mutex_unlock(&heap_lock);
+
+done:
+	/* Idle memory is given back by the purge thread, never here */
+	if (__atomic_load_n(&purge_pending, __ATOMIC_RELAXED))
+		purge_kick();
+
+	/* Keep track of the number of deallocations, and of the longest walk */
+	PROFILE(ON, STATS_ADD(frees, 1));
+	PROFILE(ON, STATS_MAX(max_steps, tcache.steps));
+
+	/* Count the time this call took against the path it took */
+	LATENCY(lat_record(path, start));
+
+	return;
+}
+
+/* 
+ *
+ * Name:
+ * __wrap_free
+ *
+ * Description:
+ * This function intercepts the call to free. It frees the allocated memory
+ * and performs defragmentation whenever possible 
+ *
+ */
+void HG_SYM(free)(void *ptr)
+{
+	/* Frees are recorded before the block can be handed out again */
+	TRACE(if (ptr != NULL) trace_record(TRACE_OP_FREE, ptr, NULL, 0));
+
+	free_common(ptr);
+}
+
+/*
+ *
+ * Name:
+ * realloc_common
+ *
+ * Description:
+ * This is a helper function which resizes a block on behalf of realloc.
+ * Blocks are resized in place whenever their neighbourhood allows it and
+ * are only moved as a last resort
+ *
+ */
+static inline void *realloc_common(void *ptr, size_t size)
+{
+	track_t		*tracker, *resized;
+	segment_t	*seg;
+	unsigned long	chunk_size, usable;
+	void		*new_ptr;
+
+	/* These are plain calls to malloc and free */
+	if (ptr == NULL)
+		return malloc_common(size);
+
+	if (size == 0) {
+		free_common(ptr);
+		return NULL;
+	}
+
+	/* Pointers outside of our segments belong to someone else */
+	seg = seg_lookup(ptr);
+
+	if (seg == NULL)
+		return HG_REAL(realloc)(ptr, size);
+
+	/* Requests this large can never be satisfied */
+	if (size > MEM_MAX_REQUEST) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	/* Slots and colour pages never change size, so blocks only move out of them once they outgrow them */
+	if (seg->slab || seg->colour) {
+		usable = seg->slab ? SLAB_RUN(ptr)->size : COLOUR_PAGE_OF(ptr)->size;
+
+		if (size <= usable) {
+			PROFILE(ON, STATS_MAX(max_req, size));
+			return ptr;
+		}
+
+		new_ptr = malloc_common(size);
+
+		if (new_ptr == NULL)
+			return NULL;
+
+		memcpy(new_ptr, ptr, usable);
+		free_common(ptr);
+
+		return new_ptr;
+	}
+
+	tracker = MEM_GET_TRACKER(ptr);
+	chunk_size = CHUNK_ROUND((unsigned long)size);
+
+	PROFILE(ON, tcache.steps = 0);
+
+	/* Small chunks which are still large enough are left alone */
+	if (chunk_size <= CHUNK_SIZE(tracker) && CHUNK_SIZE(tracker) <= TCACHE_CLASS_SIZE(TCACHE_CLASSES - 1)) {
+		resized = tracker;
+		goto done;
+	}
+
+	pthread_mutex_lock(&heap_lock);
+
+	if (chunk_size <= CHUNK_SIZE(tracker)) {
+		/* Shrinking gives back the end of the chunk if it is worth a tracker */
+		if (CHUNK_SIZE(tracker) >= chunk_size + CHUNK_MIN_SIZE)
+			heap_free(seg, heap_carve(seg, tracker, chunk_size));
+
+		resized = tracker;
+	} else {
+		resized = heap_resize(seg, tracker, chunk_size);
+	}
+
+	pthread_mutex_unlock(&heap_lock);
+
+	if (resized != NULL)
+		goto done;
+
+	/* Otherwise move the data to a new chunk */
+	new_ptr = malloc_common(size);
+
+	if (new_ptr == NULL)
+		return NULL;
+
+	memcpy(new_ptr, ptr, MEM_SIZE(tracker));
+	free_common(ptr);
+
+	return new_ptr;
+
+done:
+	/* Find out if this the largest allocation request so far, and the longest walk */
+	PROFILE(ON, STATS_MAX(max_req, size));
+	PROFILE(ON, STATS_MAX(max_steps, tcache.steps));
+
+	return MEM_GET_ADDRESS(resized);
+}
+
+/*
+ *
+ * Name:
+ * __wrap_realloc
+ *
+ * Description:
+ * This function intercepts the call to realloc. Blocks are resized in place
+ * whenever their neighbourhood allows it and are only moved as a last resort
+ *
+ */
+void *HG_SYM(realloc)(void *ptr, size_t size)
+{
+	void		*new_ptr = realloc_common(ptr, size);
+
+	TRACE(trace_record(TRACE_OP_REALLOC, new_ptr, ptr, size));
+
+	return new_ptr;
+}
+
+/*
+ *
+ * Name:
+ * calloc_common
+ *
+ * Description:
+ * This is a helper function which allocates zeroed memory on behalf of
+ * calloc. Memory carved out of the part of a segment which was never
+ * handed out is still zeroed by the kernel, so only the part of a chunk
+ * which is being reused is cleared
+ *
+ */
+static inline void *calloc_common(size_t nmemb, size_t size)
+{
+	track_t		*tracker;
+	size_t		total;
+	void		*ptr, *fresh;
+
+	if (__builtin_mul_overflow(nmemb, size, &total) || total > MEM_MAX_REQUEST) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	/* Small chunks are most likely reused from a cache and cheap to clear anyway */
+	if (total <= TCACHE_MAX_SIZE) {
+		ptr = malloc_common(total);
+
+		if (ptr != NULL)
+			memset(ptr, 0, total);
+
+		return ptr;
+	}
+
+	/* Colour pages are reused, so blocks in them are always cleared */
+	if (colour_on && (ptr = colour_alloc(total)) != NULL) {
+		memset(ptr, 0, total);
+		goto done;
+	}
+
+	PROFILE(ON, tcache.steps = 0);
+
+	pthread_mutex_lock(&heap_lock);
+
+	/* The allocation tells us where untouched memory starts if it expands the heap */
+	fresh_start = NULL;
+	tracker = heap_alloc(CHUNK_ROUND((unsigned long)total));
+	fresh = fresh_start;
+
+	pthread_mutex_unlock(&heap_lock);
+
+	/* Out of Memory!!! */
+	if (tracker == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	ptr = MEM_GET_ADDRESS(tracker);
+
+	if (fresh == NULL)
+		memset(ptr, 0, total);
+	else if (fresh > ptr)
+		memset(ptr, 0, ((unsigned long)fresh - (unsigned long)ptr < total) ? (unsigned long)fresh - (unsigned long)ptr : total);
+
+	PROFILE(ON, STATS_MAX(max_steps, tcache.steps));
+
+done:
+	/* Find out if this the largest allocation request so far */
+	PROFILE(ON, STATS_MAX(max_req, total));
+	PROFILE(ON, STATS_ADD(mallocs, 1));
+
+	return ptr;
+}
+
+/*
+ *
+ * Name:
+ * __wrap_calloc
+ *
+ * Description:
+ * This function intercepts the call to calloc. Memory carved out of the
+ * part of a segment which was never handed out is still zeroed by the
+ * kernel, so only the part of a chunk which is being reused is cleared
+ *
+ */
+void *HG_SYM(calloc)(size_t nmemb, size_t size)
+{
+	void		*ptr = calloc_common(nmemb, size);
+
+	TRACE(trace_record(TRACE_OP_CALLOC, ptr, NULL, nmemb * size));
+
+	return ptr;
+}
+
+/*
+ *
+ * Name:
+ * memalign_common
+ *
+ * Description:
+ * This is a helper function for the aligned allocation calls. It returns
+ * memory aligned to the given power of two, or NULL with errno set
+ *
+ */
+static void *memalign_common(size_t alignment, size_t size)
+{
+	track_t		*tracker;
+	void		*ptr = NULL;
+
+	/* Every chunk is aligned this much anyway */
+	if (alignment <= CHUNK_ALIGN) {
+		ptr = malloc_common(size);
+		goto done;
+	}
+
+	/* Requests this large can never be satisfied */
+	if (size > MEM_MAX_REQUEST || alignment > MEM_MAX_REQUEST - size) {
+		errno = ENOMEM;
+		goto done;
+	}
+
+	/* Slots are aligned to their size and spans to a page, so colour pages need no padding */
+	if (colour_on && alignment <= COLOUR_PAGE && (ptr = colour_alloc((size < alignment) ? alignment : size)) != NULL) {
+		PROFILE(ON, STATS_MAX(max_req, size));
+		PROFILE(ON, STATS_ADD(mallocs, 1));
+
+		goto done;
+	}
+
+	PROFILE(ON, tcache.steps = 0);
+
+	pthread_mutex_lock(&heap_lock);
+	tracker = heap_memalign(alignment, CHUNK_ROUND((unsigned long)size));
+	pthread_mutex_unlock(&heap_lock);
+
+	PROFILE(ON, STATS_MAX(max_steps, tcache.steps));
+
+	/* Out of Memory!!! */
+	if (tracker == NULL) {
+		errno = ENOMEM;
+		goto done;
+	}
+
+	/* Find out if this the largest allocation request so far */
+	PROFILE(ON, STATS_MAX(max_req, size));
+	PROFILE(ON, STATS_ADD(mallocs, 1));
+
+	ptr = MEM_GET_ADDRESS(tracker);
+
+done:
+	TRACE(trace_record(TRACE_OP_MEMALIGN, ptr, (void *)alignment, size));
+
+	return ptr;
+}
+
+/*
+ *
+ * Name:
+ * __wrap_posix_memalign
+ *
+ * Description:
+ * This function intercepts the call to posix_memalign. The alignment must
+ * be a power of two multiple of sizeof(void *)
+ *
+ */
+int HG_SYM(posix_memalign)(void **memptr, size_t alignment, size_t size)
+{
+	void		*ptr;
+	int		saved_errno = errno;
+
+	if (alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0)
+		return EINVAL;
+
+	ptr = memalign_common(alignment, size);
+
+	/* posix_memalign reports errors through its return value only */
+	if (ptr == NULL) {
+		errno = saved_errno;
+		return ENOMEM;
+	}
+
+	*memptr = ptr;
+
+	return 0;
+}
+
+/*
+ *
+ * Name:
+ * __wrap_aligned_alloc
+ *
+ * Description:
+ * This function intercepts the call to aligned_alloc. The alignment must be
+ * a power of two
+ *
+ */
+void *HG_SYM(aligned_alloc)(size_t alignment, size_t size)
+{
+	if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return memalign_common(alignment, size);
+}
+
+/*
+ *
+ * Name:
+ * __wrap_memalign
+ *
+ * Description:
+ * This function intercepts the call to memalign. Like glibc, an alignment
+ * which is not a power of two is rounded up to the next one
+ *
+ */
+void *HG_SYM(memalign)(size_t alignment, size_t size)
+{
+	if (alignment > (SIZE_MAX >> 1) + 1) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (alignment > 1 && (alignment & (alignment - 1)) != 0)
+		alignment = 1UL << (64 - __builtin_clzl(alignment));
+
+	return memalign_common(alignment, size);
+}
+
+/*
+ *
+ * Name:
+ * __wrap_malloc_usable_size
+ *
+ * Description:
+ * This function intercepts the call to malloc_usable_size. It reports the
+ * whole chunk or slot as usable, which may be a little more than was
+ * requested
+ *
+ */
+size_t HG_SYM(malloc_usable_size)(void *ptr)
+{
+	segment_t	*seg;
+
+	if (ptr == NULL)
+		return 0;
+
+	/* Pointers outside of our segments belong to someone else */
+	seg = seg_lookup(ptr);
+
+	if (seg == NULL)
+		return HG_REAL(malloc_usable_size)(ptr);
+
+	if (seg->slab)
+		return SLAB_RUN(ptr)->size;
+
+	if (seg->colour)
+		return COLOUR_PAGE_OF(ptr)->size;
+
+	return MEM_SIZE((track_t *)MEM_GET_TRACKER(ptr));
+}
+
+/*
+ *
+ * Name:
+ * pool_prefault
+ *
+ * Description:
+ * This is a helper function which faults in one slice of a pool. The kernel
+ * is asked to do it first, and pages are touched one by one on kernels
+ * which cannot. The pool is not in use yet, so writing to it is safe
+ *
+ */
+static void *pool_prefault(void *arg)
+{
+	unsigned long	*slice = arg;
+	volatile char	*addr;
+
+	if (madvise((void *)slice[0], slice[1] - slice[0], MADV_POPULATE_WRITE) == 0)
+		return NULL;
+
+	for (addr = (char *)slice[0]; addr < (char *)slice[1]; addr += 4096)
+		*addr = 0;
+
+	return NULL;
+}
+
+/*
+ *
+ * Name:
+ * hg_malloc_pool
+ *
+ * Description:
+ * This function reserves a segment of at least the given size, optionally
+ * faults it in with the given number of threads, and makes it the segment
+ * new chunks are carved out of. The segment is only published once it is
+ * faulted in, so the threads never race with the allocator
+ *
+ */
+int hg_malloc_pool(size_t size, unsigned int threads)
+{
+	segment_t	*seg;
+	pthread_t	tids[POOL_MAX_THREADS];
+	unsigned long	slices[POOL_MAX_THREADS][2];
+	unsigned long	base, end, step;
+	unsigned int	i, started;
+
+	if (size > MEM_MAX_REQUEST) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	pthread_mutex_lock(&heap_lock);
+
+	if (init == 0)
+		heap_init();
+
+	seg = segment_map(sizeof(segment_t) + CHUNK_ALIGN + size, page_size);
+
+	pthread_mutex_unlock(&heap_lock);
+
+	/* Out of Memory!!! */
+	if (seg == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	if (threads > POOL_MAX_THREADS)
+		threads = POOL_MAX_THREADS;
+
+	if (threads > 0) {
+		/* Split the pool into whole huge pages, one slice per thread */
+		base = (unsigned long)seg;
+		end = SEG_GET_LIMIT(seg);
+		step = SEG_ROUND((end - base + threads - 1) / threads, seg->page);
+
+		for (i = 0; i < threads && base < end; i++, base += step) {
+			slices[i][0] = base;
+			slices[i][1] = (base + step < end) ? base + step : end;
+		}
+
+		/* This thread takes the first slice and whatever the others could not be started for */
+		for (started = 1; started < i; started++)
+			if (pthread_create(&tids[started], NULL, pool_prefault, slices[started]) != 0)
+				break;
+
+		pool_prefault(slices[0]);
+
+		for (threads = started; threads < i; threads++)
+			pool_prefault(slices[threads]);
+
+		while (--started > 0)
+			pthread_join(tids[started], NULL);
+	}
+
+	/* The pool is meant to stay warm, so it never decays */
+	seg->pinned = 1;
+
+	pthread_mutex_lock(&heap_lock);
+	segment_link(seg);
+	pthread_mutex_unlock(&heap_lock);
+
+	return 0;
+}
+
+/*
+ *
+ * Name:
+ * hg_malloc_colours
+ *
+ * Description:
+ * This function restricts the blocks the calling thread allocates from now
+ * on to pages of the given cache colours, or lifts the restriction when the
+ * mask is 0. Blocks allocated before keep their place
+ *
+ */
+int hg_malloc_colours(unsigned long mask)
+{
+	pthread_mutex_lock(&heap_lock);
+
+	if (init == 0)
+		heap_init();
+
+	pthread_mutex_unlock(&heap_lock);
+
+	if (colours == 0) {
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	if ((mask & ~colour_all()) != 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	tcache.colours = mask;
+	tcache.colours_set = 1;
+
+	/* Threads which are not restricted never look at their colours until some thread is */
+	if (mask != 0)
+		__atomic_store_n(&colour_on, 1, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+/*
+ *
+ * Name:
+ * hg_malloc_colour
+ *
+ * Description:
+ * This function gives the cache colour of the page holding the given
+ * address. Colour pages know theirs, and any other page is looked up in the
+ * pagemap, in which case it must have been touched to have a frame
+ *
+ */
+int hg_malloc_colour(const void *addr)
+{
+	segment_t	*seg;
+	unsigned long	entry;
+
+	pthread_mutex_lock(&heap_lock);
+
+	if (init == 0)
+		heap_init();
+
+	pthread_mutex_unlock(&heap_lock);
+
+	if (colours == 0) {
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	seg = seg_lookup((void *)addr);
+
+	if (seg != NULL && seg->colour)
+		return COLOUR_PAGE_OF(addr)->colour;
+
+	pthread_mutex_lock(&colour_lock);
+	colour_read((unsigned long)addr, &entry, 1);
+	pthread_mutex_unlock(&colour_lock);
+
+	return colour_frame((unsigned long)addr, entry);
+}
+
+/*
+ *
+ * Name:
+ * hg_malloc_stats
+ *
+ * Description:
+ * This function takes a snapshot of the allocator stats. The sharded
+ * counters are added up on the way
+ *
+ */
+void hg_malloc_stats(hg_malloc_stats_t *stats)
+{
+	unsigned int shard;
+
+	memset(stats, 0, sizeof(*stats));
+
+	stats->heap_used = heap_used;
+	stats->page_size = page_size;
+	stats->large_cached = large_cached;
+	stats->tlsf = tlsf;
+	stats->fixed_base = (void *)fixed_base;
+	stats->colours = colours;
+	stats->colour_size = (colours != 0) ? colour_unit * colour_ways : 0;
+	stats->colour_physical = colour_physical;
+	stats->colour_segments = colour_segments;
+
+	PROFILE(ON, stats->max_heap_used = max_used - (max_used_trackers * CHUNK_OVERHEAD));
+	PROFILE(OFF, stats->max_heap_used = max_used);
+
+	for (shard = 0; shard <= STATS_SHARDS; shard++) {
+		stats->mallocs += __atomic_load_n(&stats_shards[shard].mallocs, __ATOMIC_RELAXED);
+		stats->frees += __atomic_load_n(&stats_shards[shard].frees, __ATOMIC_RELAXED);
+		stats->reused_trackers += __atomic_load_n(&stats_shards[shard].reused_trackers, __ATOMIC_RELAXED);
+		stats->slab_used += __atomic_load_n(&stats_shards[shard].slab_used, __ATOMIC_RELAXED);
+		stats->remote_frees += __atomic_load_n(&stats_shards[shard].remote_frees, __ATOMIC_RELAXED);
+
+		if (stats_shards[shard].max_req > stats->max_request)
+			stats->max_request = stats_shards[shard].max_req;
+
+		if (stats_shards[shard].max_steps > stats->max_steps)
+			stats->max_steps = stats_shards[shard].max_steps;
+	}
+
+	PROFILE(ON, stats->trackers = trackers);
+	PROFILE(ON, stats->max_trackers = max_trackers);
+	PROFILE(ON, stats->segments = segments);
+	PROFILE(ON, stats->hugetlb_mappings = tier_maps[SEG_TIER_HUGETLB]);
+	PROFILE(ON, stats->thp_mappings = tier_maps[SEG_TIER_THP]);
+	PROFILE(ON, stats->normal_mappings = tier_maps[SEG_TIER_NORMAL]);
+	PROFILE(ON, stats->large_mappings = large_maps);
+	PROFILE(ON, stats->purged_mappings = purged_maps);
+	PROFILE(ON, stats->slab_runs = slab_runs);
+	PROFILE(ON, stats->colour_used = colour_used);
+	PROFILE(ON, stats->colour_pages = colour_pages);
+}
+
+static void lat_print(int fd);
+
+/*
+ *
+ * Name:
+ * fd_write
+ *
+ * Description:
+ * This is a helper function which writes a whole buffer out to the given
+ * file descriptor, giving up on errors
+ *
+ */
+static void fd_write(int fd, const char *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = write(fd, buf, len);
+
+		if (ret <= 0)
+			break;
+
+		buf += ret;
+		len -= ret;
+	}
+}
+
+/*
+ *
+ * Name:
+ * hg_malloc_stats_print
+ *
+ * Description:
+ * This function prints the allocator stats to the given file descriptor.
+ * The text is formatted on the stack and written out in one go, so that it
+ * never goes through stdio or allocates
+ *
+ */
+void hg_malloc_stats_print(int fd)
+{
+	hg_malloc_stats_t	stats;
+	char			buf[2048];
+	int			len;
+
+	hg_malloc_stats(&stats);
+
+	len = snprintf(buf, sizeof(buf),
+		"\n***** Allocator Stats\n"
+		"Heap Usage        : %zu Bytes\n"
+		"Max Heap Used     : %zu Bytes\n"
+		"Max Request       : %zu Bytes\n"
+		"Mallocs           : %zu\n"
+		"Frees             : %zu\n"
+		"Trackers          : %zu\n"
+		"Tracker Overhead  : %zu Bytes\n"
+		"Max Trackers      : %zu\n"
+		"Reused Trackers   : %zu\n"
+		"Slab Usage        : %zu Bytes in %zu Runs\n"
+		"Remote Frees      : %zu\n"
+		"Page Size         : %zu kB\n"
+		"Segments          : %zu\n"
+		"Page Tiers        : %zu HugeTLB, %zu THP, %zu Normal\n"
+		"Large Mappings    : %zu (%zu Cached)\n"
+		"Purged Mappings   : %zu\n"
+		"Max Steps         : %zu%s\n"
+		"Fixed Base        : %p\n"
+		"Colour Usage      : %zu Bytes in %zu Pages of %zu Segments\n"
+		"Cache Colours     : %u of %zu kB (%s)\n\n",
+		stats.heap_used, stats.max_heap_used, stats.max_request, stats.mallocs, stats.frees,
+		stats.trackers, stats.trackers * sizeof(track_t), stats.max_trackers, stats.reused_trackers,
+		stats.slab_used, stats.slab_runs, stats.remote_frees, stats.page_size >> 10, stats.segments, stats.hugetlb_mappings,
+		stats.thp_mappings, stats.normal_mappings, stats.large_mappings, stats.large_cached, stats.purged_mappings,
+		stats.max_steps, stats.tlsf ? " (TLSF)" : "", stats.fixed_base, stats.colour_used, stats.colour_pages, stats.colour_segments, stats.colours,
+		stats.colour_size >> 10, stats.colour_physical ? "Physical" : "Virtual");
+
+	fd_write(fd, buf, (len < (int)sizeof(buf)) ? len : (int)sizeof(buf) - 1);
+
+	/* Followed by the latency percentiles if they are measured */
+	lat_print(fd);
+}
+
+#if (LATENCY_MASTER_CONTROL == 1)
+/*
+ *
+ * Name:
+ * lat_cycles_per_ns
+ *
+ * Description:
+ * This is a helper function which measures how many TSC cycles make a
+ * nanosecond. It spins for a few milliseconds the first time around
+ *
+ */
+static double lat_cycles_per_ns(void)
+{
+	static double	ratio;
+	struct timespec	ts;
+	unsigned long	ns, start_ns, start;
+
+#if !defined(__x86_64__) && !defined(__i386__)
+	/* The clock already counts nanoseconds */
+	ratio = 1.0;
+#endif
+
+	if (ratio != 0)
+		return ratio;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	start_ns = ts.tv_sec * 1000000000UL + ts.tv_nsec;
+	start = lat_now();
+
+	do {
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ns = ts.tv_sec * 1000000000UL + ts.tv_nsec;
+	} while (ns - start_ns < 5000000);
+
+	ratio = (double)(lat_now() - start) / (ns - start_ns);
+
+	return ratio;
+}
+#endif
+
+/*
+ *
+ * Name:
+ * hg_malloc_latency
+ *
+ * Description:
+ * This function adds up the latency histograms of every thread and reads
+ * the percentiles of each path off them. A percentile is reported as the
+ * upper end of the bucket it falls in
+ *
+ */
+int hg_malloc_latency(hg_malloc_latency_t lat[HG_LAT_PATHS])
+{
+#if (LATENCY_MASTER_CONTROL == 1)
+	static const unsigned int	per_mille[3] = { 500, 990, 999 };
+	unsigned long			hist[LAT_BUCKETS], max, seen, target, value[3];
+	unsigned int			path, shard, bucket, i;
+	double				ratio = lat_cycles_per_ns();
+
+	for (path = 0; path < HG_LAT_PATHS; path++) {
+		memset(hist, 0, sizeof(hist));
+		max = 0;
+
+		for (shard = 0; shard <= STATS_SHARDS; shard++) {
+			for (bucket = 0; bucket < LAT_BUCKETS; bucket++)
+				hist[bucket] += __atomic_load_n(&lat_shards[shard].count[path][bucket], __ATOMIC_RELAXED);
+
+			if (lat_shards[shard].max[path] > max)
+				max = lat_shards[shard].max[path];
+		}
+
+		lat[path].count = 0;
+		for (bucket = 0; bucket < LAT_BUCKETS; bucket++)
+			lat[path].count += hist[bucket];
+
+		/* Walk up the buckets once, picking each percentile on the way */
+		seen = 0;
+		bucket = 0;
+		for (i = 0; i < 3; i++) {
+			target = (lat[path].count * per_mille[i] + 999) / 1000;
+
+			while (bucket < LAT_BUCKETS && seen + hist[bucket] < target)
+				seen += hist[bucket++];
+
+			value[i] = (bucket < LAT_BUCKETS && lat_bucket_limit(bucket) < max) ? lat_bucket_limit(bucket) : max;
+		}
+
+		lat[path].p50 = value[0] / ratio;
+		lat[path].p99 = value[1] / ratio;
+		lat[path].p999 = value[2] / ratio;
+		lat[path].max = max / ratio;
+	}
+
+	return 0;
+#else
+	(void)lat;
+	errno = ENOSYS;
+
+	return -1;
+#endif
+}
+
+/*
+ *
+ * Name:
+ * lat_print
+ *
+ * Description:
+ * This is a helper function which prints the latency percentiles of every
+ * path taken so far to the given file descriptor, without allocating
+ *
+ */
+static void lat_print(int fd)
+{
+#if (LATENCY_MASTER_CONTROL == 1)
+	static const char	*names[HG_LAT_PATHS] = {
+		"malloc/init", "malloc/colour", "malloc/slab", "malloc/cache", "malloc/refill", "malloc/reuse",
+		"malloc/expand", "malloc/segment", "malloc/large", "free/colour", "free/slab", "free/remote", "free/cache",
+		"free/flush", "free/heap", "free/large"
+	};
+	hg_malloc_latency_t	lat[HG_LAT_PATHS];
+	char			buf[2048];
+	int			len, path;
+
+	hg_malloc_latency(lat);
+
+	len = snprintf(buf, sizeof(buf), "Latency (ns)      : %10s %10s %10s %10s %10s\n",
+			"Count", "p50", "p99", "p99.9", "Max");
+
+	for (path = 0; path < HG_LAT_PATHS; path++) {
+		if (lat[path].count == 0)
+			continue;
+
+		len += snprintf(buf + len, sizeof(buf) - len, "  %-16s: %10zu %10zu %10zu %10zu %10zu\n", names[path],
+				lat[path].count, lat[path].p50, lat[path].p99, lat[path].p999, lat[path].max);
+	}
+
+	len += snprintf(buf + len, sizeof(buf) - len, "\n");
+
+	fd_write(fd, buf, (len < (int)sizeof(buf)) ? len : (int)sizeof(buf) - 1);
+#else
+	(void)fd;
+#endif
+}
+
+/*
+ *
+ * Name:
+ * stats_signal
+ *
+ * Description:
+ * This function runs when the signal picked through HG_MALLOC_STATS_SIGNAL
+ * is received. Formatting the stats is not safe in a signal handler, and the
+ * signal may land in the middle of an update, so the handler only asks the
+ * stats thread to print them
+ *
+ */
+static void stats_signal(int sig)
+{
+	int saved_errno = errno;
+
+	(void)sig;
+
+	__atomic_store_n(&stats_asked, 1, __ATOMIC_RELEASE);
+	sem_post(&stats_sem);
+
+	errno = saved_errno;
+}
+
+/*
+ *
+ * Name:
+ * stats_thread
+ *
+ * Description:
+ * This function runs in the background once HG_MALLOC_STATS_SIGNAL is set,
+ * and prints the stats each time the signal handler asks for them
+ *
+ */
+static void *stats_thread(void *arg)
+{
+	for (;;) {
+		if (sem_wait(&stats_sem) != 0)
+			continue;
+
+		if (__atomic_exchange_n(&stats_asked, 0, __ATOMIC_ACQUIRE))
+			hg_malloc_stats_print(STDERR_FILENO);
+	}
+
+	return arg;
+}
+
+/*
+ *
+ * Name:
+ * __wrap_mallinfo2
+ *
+ * Description:
+ * This function intercepts the call to mallinfo2. The fields are filled in
+ * from our heap the way glibc fills them in from its arenas: segments play
+ * the part of the arena and large mappings the part of mmapped chunks
+ *
+ */
+struct mallinfo2 HG_SYM(mallinfo2)(void)
+{
+	struct mallinfo2	info;
+	struct list_head	*node;
+	segment_t		*seg;
+	unsigned int		class;
+
+	memset(&info, 0, sizeof(info));
+
+	pthread_mutex_lock(&heap_lock);
+
+	if (init == 0)
+		goto done;
+
+	list_for_each_entry(seg, &seg_list, list) {
+		info.arena += seg->size;
+		info.fordblks += SEG_GET_LIMIT(seg) - (unsigned long)seg->top;
+	}
+
+	for (class = 0; class < FREE_CLASS_COUNT; class++) {
+		list_for_each(node, &free_lists[class]) {
+			info.ordblks++;
+			info.fordblks += CHUNK_SIZE(FREE_TRACKER(node));
+		}
+	}
+
+	info.hblks = large_live;
+	info.hblkhd = large_bytes;
+	info.usmblks = max_used;
+	info.uordblks = heap_used;
+
+	if (cur_seg != NULL)
+		info.keepcost = SEG_GET_LIMIT(cur_seg) - (unsigned long)cur_seg->top;
+
+done:
+	pthread_mutex_unlock(&heap_lock);
+
+	return info;
+}
+
+/*
+ *
+ * Name:
+ * fork_prepare
+ *
+ * Description:
+ * This is a helper function which takes every lock of the allocator before
+ * the process forks, in the order they nest in, so that none of them is
+ * held by a thread which does not exist in the child
+ *
+ */
+static void fork_prepare(void)
+{
+	unsigned int class;
+
+	pthread_mutex_lock(&colour_lock);
+	pthread_mutex_lock(&heap_lock);
+	pthread_mutex_lock(&slab_lock);
+
+	for (class = 0; class < TCACHE_CLASSES; class++)
+		pthread_mutex_lock(&depot[class].lock);
+
+	pthread_mutex_lock(&fixed_lock);
+}
+
+/*
+ *
+ * Name:
+ * fork_parent
+ *
+ * Description:
+ * This is a helper function which releases the locks taken by fork_prepare
+ * in the parent once the process has forked
+ *
+ */
+static void fork_parent(void)
+{
+	unsigned int class;
+
+	pthread_mutex_unlock(&fixed_lock);
+
+	for (class = TCACHE_CLASSES; class-- > 0;)
+		pthread_mutex_unlock(&depot[class].lock);
+
+	pthread_mutex_unlock(&slab_lock);
+	pthread_mutex_unlock(&heap_lock);
+	pthread_mutex_unlock(&colour_lock);
+}
+
+/*
+ *
+ * Name:
+ * fork_child
+ *
+ * Description:
+ * This is a helper function which sets the locks taken by fork_prepare up
+ * afresh in the child. So is the condition of the purge thread, which the
+ * child starts again the first time some memory goes idle
+ *
+ */
+static void fork_child(void)
+{
+	unsigned int class;
+
+	pthread_mutex_init(&fixed_lock, NULL);
+
+	for (class = 0; class < TCACHE_CLASSES; class++)
+		pthread_mutex_init(&depot[class].lock, NULL);
+
+	pthread_mutex_init(&slab_lock, NULL);
+	pthread_mutex_init(&heap_lock, NULL);
+	pthread_mutex_init(&colour_lock, NULL);
+
+	purge_cond_init();
+}
+
+/*
+ *
+ * Name:
+ * hg_malloc_setup
+ *
+ * Description:
+ * This function runs when the allocator is loaded. It makes fork safe for
+ * the allocator, and sets up the pool asked for through HG_MALLOC_POOL and
+ * HG_MALLOC_PREFAULT, the stats dumps asked for through HG_MALLOC_STATS
+ * and HG_MALLOC_STATS_SIGNAL, and the trace asked for through
+ * HG_MALLOC_TRACE
+ *
+ */
+static void __attribute__((constructor)) hg_malloc_setup(void)
+{
+	const char		*pool = getenv("HG_MALLOC_POOL");
+	const char		*prefault = getenv("HG_MALLOC_PREFAULT");
+	const char		*dump = getenv("HG_MALLOC_STATS");
+	const char		*sig = getenv("HG_MALLOC_STATS_SIGNAL");
+	struct sigaction	action;
+	pthread_attr_t		attr;
+	pthread_t		tid;
+	unsigned long		size;
+
+	/* The purge thread may hold the heap lock at any time, so fork has to wait for it */
+	pthread_atfork(fork_prepare, fork_parent, fork_child);
+
+	TRACE(trace_open(getenv("HG_MALLOC_TRACE")));
+
+	if (dump != NULL)
+		stats_dump = (strtol(dump, NULL, 10) != 0);
+
+	if (sig != NULL && strtol(sig, NULL, 10) > 0) {
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		sem_init(&stats_sem, 0, 0);
+
+		/* Without the thread nobody would print the stats, so the signal is left alone */
+		if (pthread_create(&tid, &attr, stats_thread, NULL) == 0) {
+			memset(&action, 0, sizeof(action));
+			action.sa_handler = stats_signal;
+			action.sa_flags = SA_RESTART;
+			sigemptyset(&action.sa_mask);
+			sigaction(strtol(sig, NULL, 10), &action, NULL);
+		}
+
+		pthread_attr_destroy(&attr);
+	}
+
+	if (pool == NULL)
+		return;
+
+	size = parse_size(pool);
+
+	if (size == 0)
+		return;
+
+	hg_malloc_pool(size, (prefault != NULL) ? strtoul(prefault, NULL, 10) : 0);
+}
+
+/*
+ *
+ * Name:
+ * hg_malloc_teardown
+ *
+ * Description:
+ * This function runs at exit and prints the stats if we were asked to
+ *
+ */
+static void __attribute__((destructor)) hg_malloc_teardown(void)
+{
+	/* The stats thread may not have got to the last signal before we exit */
+	if (__atomic_exchange_n(&stats_asked, 0, __ATOMIC_ACQUIRE))
+		hg_malloc_stats_print(STDERR_FILENO);
+
+	if (stats_dump)
+		hg_malloc_stats_print(STDERR_FILENO);
 }
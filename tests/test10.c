@@ -0,0 +1,61 @@
+/**************************************************************************************************** 
+ * 
+ * Test Number 10 : Zeroed Allocations
+ *
+ * Description:
+ * - Allocate 512 x 1024 zeroed bytes with calloc
+ * - Fill it and deallocate it
+ * - Allocate 1024 bytes with malloc and fill it
+ * - Allocate 512 x 1024 zeroed bytes with calloc again
+ * - Ask calloc for a size which overflows
+ * - Deallocate all memory
+ *
+ * Results:
+ * - Sanity Check -> Heap usage at the end of program should be zero
+ * - Expected     -> Both zeroed allocations should only contain zeroes, even though the second one
+ *                   reuses memory written by the first one
+ * - Expected     -> calloc should fail with ENOMEM for the overflowing size
+ * - Expected     -> Largest allocation should be 524288 bytes
+ * 
+ ****************************************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+#define SIZE	(512 * 1024)
+
+int main(void)
+{
+	char *ptr1, *ptr2, *ptr3;
+	int i;
+
+	/* Memory which was never handed out */
+	ptr1 = calloc(512, 1024);
+	for (i = 0; i < SIZE; i++)
+		assert(ptr1[i] == 0);
+
+	memset(ptr1, 0xab, SIZE);
+	free(ptr1);
+
+	/* The heap now reuses memory which was written to */
+	ptr2 = malloc(1024);
+	memset(ptr2, 0xcd, 1024);
+
+	ptr3 = calloc(512, 1024);
+	for (i = 0; i < SIZE; i++)
+		assert(ptr3[i] == 0);
+
+	/* The multiplication overflows */
+	errno = 0;
+	assert(calloc(SIZE_MAX / 2, 4) == NULL);
+	assert(errno == ENOMEM);
+
+	/* Now deallocate everything */
+	free(ptr3);
+	free(ptr2);
+
+	return 0;
+}
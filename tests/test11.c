@@ -0,0 +1,44 @@
+/**************************************************************************************************** 
+ * 
+ * Test Number 11 : Pointers From Another Allocator
+ *
+ * Description:
+ * - Duplicate a string with strdup, which allocates from inside libc
+ * - Reallocate the duplicate to 4096 bytes
+ * - Allocate 100 bytes
+ * - Ask for the usable size of both blocks
+ * - Deallocate all memory
+ *
+ * Results:
+ * - Sanity Check -> Heap usage at the end of program should be zero
+ * - Expected     -> The memory allocated inside libc is not ours, so reallocating and freeing it
+ *                   should be handed over to libc instead of touching our heap
+ * - Expected     -> The usable size of our block should be at least 100 bytes
+ * - Expected     -> Largest allocation should be 100 bytes
+ * 
+ ****************************************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <assert.h>
+
+int main(void)
+{
+	char *ptr1, *ptr2, *ptr3;
+
+	/* libc allocates this one for us */
+	ptr1 = strdup("huge pages");
+	ptr2 = realloc(ptr1, 4096);
+	assert(ptr2 != NULL && strcmp(ptr2, "huge pages") == 0);
+	assert(malloc_usable_size(ptr2) >= 4096);
+
+	ptr3 = malloc(100);
+	assert(malloc_usable_size(ptr3) >= 100);
+
+	/* Now deallocate everything */
+	free(ptr2);
+	free(ptr3);
+
+	return 0;
+}
@@ -0,0 +1,49 @@
+/**************************************************************************************************** 
+ * 
+ * Test Number 12 : Dedicated Mappings for Large Allocations
+ *
+ * Description:
+ * - Allocate 1024 bytes
+ * - Allocate 1MB
+ * - Allocate 1024 bytes
+ * - Deallocate 1MB
+ * - Allocate 1MB
+ * - Deallocate all memory
+ *
+ * Results:
+ * - Sanity Check -> Heap usage at the end of program should be zero
+ * - Expected     -> The 1MB allocation should get a mapping of its own, so the two small allocations
+ *                   should be carved out of the heap back to back
+ * - Expected     -> The mapping of the first 1MB allocation should be cached when it is freed and
+ *                   reused for the second one
+ * - Expected     -> Segments should be 1 and Large Mappings should be 1 (1 Cached)
+ * - Expected     -> Largest allocation should be 1048576 bytes
+ * 
+ ****************************************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+int main(void)
+{
+	char *ptr1, *ptr2, *ptr3, *ptr4;
+
+	ptr1 = malloc(1024);
+	ptr2 = malloc(1024 * 1024);
+	ptr3 = malloc(1024);
+
+	/* The large allocation is not in the way */
+	assert(ptr3 > ptr1 && ptr3 < ptr1 + 2048);
+
+	/* Its mapping is kept for the next large allocation */
+	free(ptr2);
+	ptr4 = malloc(1024 * 1024);
+	assert(ptr4 == ptr2);
+
+	/* Now deallocate everything */
+	free(ptr3);
+	free(ptr1);
+	free(ptr4);
+
+	return 0;
+}
@@ -0,0 +1,49 @@
+/**************************************************************************************************** 
+ * 
+ * Test Number 13 : Fallback When the Huge Page Pool is Empty
+ *
+ * Description:
+ * - Empty the huge page pool first (echo 0 > /proc/sys/vm/nr_hugepages)
+ * - Allocate 1024 bytes
+ * - Allocate 1MB
+ * - Reallocate 1MB to 8MB
+ * - Deallocate all memory
+ *
+ * Results:
+ * - Sanity Check -> Heap usage at the end of program should be zero
+ * - Expected     -> The allocations should succeed even though the huge page pool is empty
+ * - Expected     -> The 8MB block should keep the contents of the 1MB block
+ * - Expected     -> Page Tiers should be 0 HugeTLB, 2 THP, 0 Normal (or 2 Normal when transparent
+ *                   huge pages are disabled)
+ * - Expected     -> Largest allocation should be 8388608 bytes
+ * 
+ ****************************************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+int main(void)
+{
+	char *ptr1, *ptr2;
+	int i;
+
+	ptr1 = malloc(1024);
+	ptr2 = malloc(1024 * 1024);
+	assert(ptr1 != NULL && ptr2 != NULL);
+
+	memset(ptr2, 0x5a, 1024 * 1024);
+
+	/* The mapping is moved along with its contents */
+	ptr2 = realloc(ptr2, 8 * 1024 * 1024);
+	assert(ptr2 != NULL);
+
+	for (i = 0; i < 1024 * 1024; i++)
+		assert(ptr2[i] == 0x5a);
+
+	/* Now deallocate everything */
+	free(ptr1);
+	free(ptr2);
+
+	return 0;
+}
@@ -0,0 +1,65 @@
+/**************************************************************************************************** 
+ * 
+ * Test Number 14 : Pre-faulted Pool
+ *
+ * Description:
+ * - Reserve a 64MB pool and pre-fault it with 4 threads
+ * - Allocate 1024 bytes
+ * - Allocate 32MB worth of 1024 byte blocks
+ * - Deallocate all memory
+ *
+ * Results:
+ * - Sanity Check -> Heap usage at the end of program should be zero
+ * - Expected     -> All the allocations should be carved out of the pool, without taking a
+ *                   single page fault
+ * - Expected     -> Segments should be 1
+ * - Expected     -> Largest allocation should be 1024 bytes
+ * 
+ ****************************************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/resource.h>
+#include "hg_malloc.h"
+
+#define BLOCKS	(32 * 1024)
+
+static char *ptrs[BLOCKS];
+
+static long minor_faults(void)
+{
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+
+	return usage.ru_minflt;
+}
+
+int main(void)
+{
+	char *ptr;
+	long faults;
+	int i;
+
+	assert(hg_malloc_pool(64 * 1024 * 1024, 4) == 0);
+
+	ptr = malloc(1024);
+
+	/* The pool is already faulted in, and so is our array once it is cleared */
+	memset(ptrs, 0, sizeof(ptrs));
+	faults = minor_faults();
+
+	for (i = 0; i < BLOCKS; i++)
+		ptrs[i] = malloc(1024);
+
+	assert(minor_faults() == faults);
+
+	/* Now deallocate everything */
+	for (i = 0; i < BLOCKS; i++)
+		free(ptrs[i]);
+
+	free(ptr);
+
+	return 0;
+}
@@ -0,0 +1,55 @@
+/**************************************************************************************************** 
+ * 
+ * Test Number 15 : Purging Idle Memory
+ *
+ * Description:
+ * - Set the decay time to 100ms (HG_MALLOC_DECAY_MS=100)
+ * - Allocate 6MB worth of 64kB blocks, which takes four segments
+ * - Allocate 1MB
+ * - Deallocate all memory
+ * - Wait for 500ms
+ *
+ * Results:
+ * - Sanity Check -> Heap usage at the end of program should be zero
+ * - Expected     -> The empty segments and the cached 1MB mapping should be unmapped once
+ *                   they have been idle for 100ms, except for the current segment
+ * - Expected     -> Segments should be 1, Large Mappings should be 0 (0 Cached) and Purged
+ *                   Mappings should be 4
+ * - Expected     -> Largest allocation should be 1048576 bytes
+ * 
+ ****************************************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <assert.h>
+#include <sys/mman.h>
+
+#define BLOCKS	96
+
+int main(void)
+{
+	char *ptrs[BLOCKS], *big;
+	unsigned char vec;
+	int i;
+
+	setenv("HG_MALLOC_DECAY_MS", "100", 1);
+
+	for (i = 0; i < BLOCKS; i++)
+		ptrs[i] = malloc(64 * 1024);
+
+	big = malloc(1024 * 1024);
+
+	/* Now deallocate everything */
+	free(big);
+
+	for (i = 0; i < BLOCKS; i++)
+		free(ptrs[i]);
+
+	usleep(500 * 1000);
+
+	/* The first segment and the large mapping are gone */
+	assert(mincore((void *)((unsigned long)ptrs[0] & ~4095UL), 4096, &vec) < 0);
+	assert(mincore((void *)((unsigned long)big & ~4095UL), 4096, &vec) < 0);
+
+	return 0;
+}
@@ -0,0 +1,76 @@
+/**************************************************************************************************** 
+ * 
+ * Test Number 16 : Stats Query API
+ *
+ * Description:
+ * - Allocate 1024 bytes from 4 threads, 1000 times each, and keep the blocks
+ * - Query the stats and mallinfo2
+ * - Deallocate all memory
+ * - Query the stats again, and print them through a signal (HG_MALLOC_STATS_SIGNAL=10)
+ *
+ * Results:
+ * - Sanity Check -> Heap usage at the end of program should be zero
+ * - Expected     -> The counters of every thread should be added up, i.e. Mallocs should be 4000
+ *                   and Frees should be 4000 at the end
+ * - Expected     -> mallinfo2 should report the same heap usage as the stats
+ * - Expected     -> The stats should be printed twice, once for the signal and once at exit
+ * - Expected     -> Largest allocation should be 1024 bytes
+ * 
+ ****************************************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <assert.h>
+#include <pthread.h>
+#include <malloc.h>
+#include "hg_malloc.h"
+
+#define THREADS	4
+#define BLOCKS	1000
+
+static char *ptrs[THREADS][BLOCKS];
+
+static void *worker(void *arg)
+{
+	char **blocks = arg;
+	int i;
+
+	for (i = 0; i < BLOCKS; i++)
+		blocks[i] = malloc(1024);
+
+	return NULL;
+}
+
+int main(void)
+{
+	pthread_t tids[THREADS];
+	hg_malloc_stats_t stats;
+	struct mallinfo2 info;
+	int i, j;
+
+	for (i = 0; i < THREADS; i++)
+		pthread_create(&tids[i], NULL, worker, ptrs[i]);
+
+	for (i = 0; i < THREADS; i++)
+		pthread_join(tids[i], NULL);
+
+	hg_malloc_stats(&stats);
+	info = mallinfo2();
+
+	assert(stats.mallocs == THREADS * BLOCKS);
+	assert(stats.heap_used == info.uordblks && stats.heap_used >= THREADS * BLOCKS * 1024);
+
+	/* Now deallocate everything */
+	for (i = 0; i < THREADS; i++)
+		for (j = 0; j < BLOCKS; j++)
+			free(ptrs[i][j]);
+
+	hg_malloc_stats(&stats);
+	assert(stats.frees == THREADS * BLOCKS && stats.heap_used == 0);
+
+	/* The handler is only installed when the allocator is told to */
+	if (getenv("HG_MALLOC_STATS_SIGNAL") != NULL)
+		raise(atoi(getenv("HG_MALLOC_STATS_SIGNAL")));
+
+	return 0;
+}
@@ -0,0 +1,61 @@
+/**************************************************************************************************** 
+ * 
+ * Test Number 17 : Latency Histograms
+ *
+ * Description:
+ * - Build the allocator with -DLATENCY_MASTER_CONTROL=1
+ * - Allocate 1024 bytes 10000 times
+ * - Allocate 1MB
+ * - Deallocate all memory
+ * - Query the latency percentiles
+ *
+ * Results:
+ * - Sanity Check -> Heap usage at the end of program should be zero
+ * - Expected     -> The first allocation should be counted as malloc/init, the large one as
+ *                   malloc/large and its deallocation as free/large
+ * - Expected     -> Every path should have p50 <= p99 <= p99.9 <= max
+ * - Expected     -> The stats printed at exit should end with the latency percentiles
+ * - Expected     -> Without the instrumentation the query should fail with ENOSYS
+ * 
+ ****************************************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <assert.h>
+#include "hg_malloc.h"
+
+#define BLOCKS	10000
+
+static char *ptrs[BLOCKS];
+
+int main(void)
+{
+	hg_malloc_latency_t lat[HG_LAT_PATHS];
+	char *big;
+	int i;
+
+	for (i = 0; i < BLOCKS; i++)
+		ptrs[i] = malloc(1024);
+
+	big = malloc(1024 * 1024);
+
+	/* Now deallocate everything */
+	for (i = 0; i < BLOCKS; i++)
+		free(ptrs[i]);
+
+	free(big);
+
+	if (hg_malloc_latency(lat) < 0) {
+		assert(errno == ENOSYS);
+		return 0;
+	}
+
+	assert(lat[HG_LAT_MALLOC_INIT].count == 1);
+	assert(lat[HG_LAT_MALLOC_LARGE].count == 1);
+	assert(lat[HG_LAT_FREE_LARGE].count == 1);
+
+	for (i = 0; i < HG_LAT_PATHS; i++)
+		assert(lat[i].p50 <= lat[i].p99 && lat[i].p99 <= lat[i].p999 && lat[i].p999 <= lat[i].max);
+
+	return 0;
+}
@@ -0,0 +1,57 @@
+/**************************************************************************************************** 
+ * 
+ * Test Number 18 : Performance Counters
+ *
+ * Description:
+ * - Start the performance counters
+ * - Allocate 64MB with one request and touch one byte per 4kB page of it
+ * - Stop the counters
+ * - Deallocate all memory
+ *
+ * Results:
+ * - Sanity Check -> Heap usage at the end of program should be zero
+ * - Expected     -> The page fault count should always be valid, from perf or from getrusage,
+ *                   and should be non-zero
+ * - Expected     -> Counters which the system does not offer should be reported as invalid
+ *                   instead of failing the measurement
+ * 
+ ****************************************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include "hg_malloc.h"
+
+#define SIZE	(64UL * 1024 * 1024)
+
+int main(void)
+{
+	static const char	*names[HG_PERF_EVENTS] = { "dTLB Misses", "LLC Misses", "Page Faults" };
+	hg_perf_t		perf;
+	unsigned long		i;
+	int			available, valid, event;
+	char			*ptr;
+
+	available = hg_perf_begin(&perf);
+
+	ptr = malloc(SIZE);
+	for (i = 0; i < SIZE; i += 4096)
+		ptr[i] = 1;
+
+	valid = hg_perf_end(&perf);
+
+	free(ptr);
+
+	printf("Perf Events  : %d available, %d valid\n", available, valid);
+	for (event = 0; event < HG_PERF_EVENTS; event++) {
+		if (perf.valid[event])
+			printf("%-12s : %llu\n", names[event], perf.count[event]);
+		else
+			printf("%-12s : n/a\n", names[event]);
+	}
+
+	assert(perf.valid[HG_PERF_PAGE_FAULTS]);
+	assert(perf.count[HG_PERF_PAGE_FAULTS] > 0);
+	assert(valid >= available);
+
+	return 0;
+}
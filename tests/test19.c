@@ -0,0 +1,112 @@
+/**************************************************************************************************** 
+ * 
+ * Test Number 19 : Allocation Trace
+ *
+ * Description:
+ * - Build the allocator with -DTRACE_MASTER_CONTROL=1
+ * - Run the test again with HG_MALLOC_TRACE pointing at a temporary file
+ * - Allocate 100 bytes, 10 x 10 zeroed bytes and 200 bytes aligned to 64 bytes
+ * - Grow the first block to 5000 bytes
+ * - Deallocate all memory
+ * - Read the trace back
+ *
+ * Results:
+ * - Sanity Check -> Heap usage at the end of program should be zero
+ * - Expected     -> The trace should hold the calls in order, malloc, calloc, posix_memalign,
+ *                   realloc and three frees, all from the same thread, with the sizes asked for
+ *                   and the pointers handed out
+ * - Expected     -> Without the recorder no trace should be written
+ * 
+ ****************************************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <assert.h>
+#include <sys/wait.h>
+#include "hg_trace.h"
+
+#define TRACE_FILE	"/tmp/hg_malloc_test19.trace"
+
+int main(int argc, char *argv[])
+{
+	trace_record_t	records[16];
+	void		*ptrs[4];
+	FILE		*file;
+	int		count = 0, status, i;
+
+	if (argc > 1) {
+		/* Traced run, the pointers are handed back through stdout */
+		ptrs[0] = malloc(100);
+		ptrs[1] = calloc(10, 10);
+		assert(posix_memalign(&ptrs[2], 64, 200) == 0);
+		ptrs[3] = realloc(ptrs[0], 5000);
+
+		printf("%p %p %p %p\n", ptrs[0], ptrs[1], ptrs[2], ptrs[3]);
+
+		free(ptrs[3]);
+		free(ptrs[1]);
+		free(ptrs[2]);
+
+		return 0;
+	}
+
+	unlink(TRACE_FILE);
+
+	if (fork() == 0) {
+		setenv("HG_MALLOC_TRACE", TRACE_FILE, 1);
+		setenv("HG_MALLOC_STATS", "0", 1);
+		freopen("/tmp/hg_malloc_test19.out", "w", stdout);
+		execl(argv[0], argv[0], "traced", NULL);
+		_exit(1);
+	}
+
+	wait(&status);
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	file = fopen(TRACE_FILE, "r");
+
+	if (file == NULL) {
+		printf("Tracing is not built in\n");
+		return 0;
+	}
+
+	fseek(file, TRACE_HEADER_SIZE, SEEK_SET);
+
+	while (count < 16 && fread(&records[count], sizeof(records[0]), 1, file) == 1 && records[count].op != TRACE_OP_NONE)
+		count++;
+
+	fclose(file);
+
+	file = fopen("/tmp/hg_malloc_test19.out", "r");
+	assert(fscanf(file, "%p %p %p %p", &ptrs[0], &ptrs[1], &ptrs[2], &ptrs[3]) == 4);
+	fclose(file);
+
+	for (i = 0; i < count; i++)
+		printf("Record %d : op %u, size %lu, ptr %#lx, arg %#lx, thread %u\n", i, (unsigned int)records[i].op,
+		       (unsigned long)records[i].size, (unsigned long)records[i].ptr, (unsigned long)records[i].arg,
+		       (unsigned int)records[i].thread);
+
+	/* The traced run may allocate a little more on its own, e.g. the buffer of stdout */
+	for (i = 0; i < count && records[i].ptr != (uintptr_t)ptrs[0]; i++);
+
+	assert(i + 7 <= count);
+	assert(records[i].op == TRACE_OP_MALLOC && records[i].size == 100);
+	assert(records[i + 1].op == TRACE_OP_CALLOC && records[i + 1].size == 100 && records[i + 1].ptr == (uintptr_t)ptrs[1]);
+	assert(records[i + 2].op == TRACE_OP_MEMALIGN && records[i + 2].arg == 64 && records[i + 2].ptr == (uintptr_t)ptrs[2]);
+	assert(records[i + 3].op == TRACE_OP_REALLOC && records[i + 3].size == 5000 && records[i + 3].ptr == (uintptr_t)ptrs[3] &&
+	       records[i + 3].arg == (uintptr_t)ptrs[0]);
+
+	for (; i < count && records[i].op != TRACE_OP_FREE; i++);
+
+	assert(records[i].ptr == (uintptr_t)ptrs[3]);
+	assert(records[i + 1].op == TRACE_OP_FREE && records[i + 1].ptr == (uintptr_t)ptrs[1]);
+	assert(records[i + 2].op == TRACE_OP_FREE && records[i + 2].ptr == (uintptr_t)ptrs[2]);
+
+	for (i = 1; i < count; i++)
+		assert(records[i].thread == 0 && records[i].time >= records[i - 1].time);
+
+	unlink(TRACE_FILE);
+
+	return 0;
+}
@@ -0,0 +1,195 @@
+/**************************************************************************************************** 
+ * 
+ * Test Number 20 : Slab Allocations
+ *
+ * Description:
+ * - Allocate 1 to 256 bytes from 4 threads, 10000 times each, fill the blocks and keep them
+ * - Check the blocks from the main thread once the threads have exited
+ * - Grow a 100 bytes block to 112 bytes and then to 1000 bytes
+ * - Deallocate all memory from another thread
+ * - Allocate the same blocks again from the 4 threads, one after the other, and deallocate them
+ *   from another thread
+ * - Wait for 500ms, with the decay time set to 100ms (HG_MALLOC_DECAY_MS=100)
+ * - Allocate 1000 blocks of 64 bytes from a thread, deallocate one of them from another thread,
+ *   wait for 300ms and deallocate the others from a third thread, then wait for 500ms
+ *
+ * Results:
+ * - Sanity Check -> Heap usage at the end of program should be zero
+ * - Expected     -> Every block should be 16 bytes aligned and keep its contents
+ * - Expected     -> malloc_usable_size should round every block up to 16 bytes at most
+ * - Expected     -> The block should stay in place at 112 bytes and keep its contents when it
+ *                   moves at 1000 bytes
+ * - Expected     -> Slab usage should be back to zero once everything is freed, and the blocks
+ *                   freed by the other thread should be reused without taking more runs
+ * - Expected     -> The slab segments whose runs are all free again should be unmapped once
+ *                   they have been idle for 100ms, i.e. Purged Mappings should not be 0, also
+ *                   when their last slots come back after the purge thread went idle
+ * - Expected     -> Largest allocation should be 1000 bytes
+ * 
+ ****************************************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <pthread.h>
+#include <malloc.h>
+#include "hg_malloc.h"
+
+#define THREADS	4
+#define BLOCKS	10000
+
+/* Blocks of 64 bytes which take most of a single run of 64 KBytes */
+#define RUN_BLOCKS	1000
+
+static unsigned char *ptrs[THREADS][BLOCKS];
+
+static void *worker(void *arg)
+{
+	unsigned char **blocks = arg;
+	int i;
+
+	for (i = 0; i < BLOCKS; i++) {
+		blocks[i] = malloc(i % 256 + 1);
+		memset(blocks[i], i & 0xff, i % 256 + 1);
+	}
+
+	return NULL;
+}
+
+static void *fill(void *arg)
+{
+	int j;
+
+	(void)arg;
+
+	for (j = 0; j < RUN_BLOCKS; j++)
+		ptrs[0][j] = malloc(64);
+
+	return NULL;
+}
+
+static void *release(void *arg)
+{
+	int i, j;
+
+	(void)arg;
+
+	for (i = 0; i < THREADS; i++)
+		for (j = 0; j < BLOCKS; j++)
+			free(ptrs[i][j]);
+
+	return NULL;
+}
+
+static void *release_first(void *arg)
+{
+	(void)arg;
+
+	free(ptrs[0][0]);
+
+	return NULL;
+}
+
+static void *release_rest(void *arg)
+{
+	int j;
+
+	(void)arg;
+
+	for (j = 1; j < RUN_BLOCKS; j++)
+		free(ptrs[0][j]);
+
+	return NULL;
+}
+
+int main(void)
+{
+	pthread_t tids[THREADS];
+	hg_malloc_stats_t stats;
+	unsigned char *ptr, *moved;
+	size_t runs, purged;
+	int i, j, k;
+
+	setenv("HG_MALLOC_DECAY_MS", "100", 1);
+
+	for (i = 0; i < THREADS; i++)
+		pthread_create(&tids[i], NULL, worker, ptrs[i]);
+
+	for (i = 0; i < THREADS; i++)
+		pthread_join(tids[i], NULL);
+
+	/* Blocks have no header, so a block running over its slot would show in its neighbour */
+	for (i = 0; i < THREADS; i++) {
+		for (j = 0; j < BLOCKS; j++) {
+			assert((uintptr_t)ptrs[i][j] % 16 == 0);
+			assert(malloc_usable_size(ptrs[i][j]) >= (size_t)(j % 256 + 1));
+			assert(malloc_usable_size(ptrs[i][j]) < (size_t)(j % 256 + 1) + 16);
+
+			for (k = 0; k <= j % 256; k++)
+				assert(ptrs[i][j][k] == (j & 0xff));
+		}
+	}
+
+	hg_malloc_stats(&stats);
+	runs = stats.slab_runs;
+
+	/* Now deallocate everything, from a thread which owns none of the runs */
+	pthread_create(&tids[0], NULL, release, NULL);
+	pthread_join(tids[0], NULL);
+
+	hg_malloc_stats(&stats);
+	assert(stats.slab_used == 0);
+
+	/* Runs left behind by the threads are adopted again, and so is the last run of each thread by the next */
+	for (i = 0; i < THREADS; i++) {
+		pthread_create(&tids[i], NULL, worker, ptrs[i]);
+		pthread_join(tids[i], NULL);
+	}
+
+	hg_malloc_stats(&stats);
+	assert(stats.slab_runs <= runs);
+
+	/* The thread keeps none of the slots it freed once it exits, so whole segments fall idle */
+	pthread_create(&tids[0], NULL, release, NULL);
+	pthread_join(tids[0], NULL);
+
+	usleep(500 * 1000);
+
+	hg_malloc_stats(&stats);
+	assert(stats.slab_used == 0 && stats.purged_mappings > 0);
+
+	/* A run left behind gets its last slots back from another thread long after the purge thread last looked */
+	purged = stats.purged_mappings;
+
+	pthread_create(&tids[0], NULL, fill, NULL);
+	pthread_join(tids[0], NULL);
+	pthread_create(&tids[0], NULL, release_first, NULL);
+	pthread_join(tids[0], NULL);
+
+	usleep(300 * 1000);
+
+	pthread_create(&tids[0], NULL, release_rest, NULL);
+	pthread_join(tids[0], NULL);
+
+	usleep(500 * 1000);
+
+	hg_malloc_stats(&stats);
+	assert(stats.slab_runs == 0 && stats.purged_mappings > purged);
+
+	/* Slots are only left once they are outgrown */
+	ptr = malloc(100);
+	memset(ptr, 0x5a, 100);
+	assert(realloc(ptr, 112) == ptr);
+
+	moved = realloc(ptr, 1000);
+	assert(moved != NULL);
+
+	for (k = 0; k < 100; k++)
+		assert(moved[k] == 0x5a);
+
+	free(moved);
+
+	return 0;
+}
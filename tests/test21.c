@@ -0,0 +1,122 @@
+/**************************************************************************************************** 
+ * 
+ * Test Number 21 : Bounded Time Allocations
+ * 
+ * Description:
+ * - Run the test again with HG_MALLOC_TLSF=1
+ * - Allocate 200 blocks of 900 KBytes, so that every segment is left with little room at its end
+ * - Deallocate every other block to leave holes all over the heap
+ * - Allocate 4000 blocks of 16 to 60015 bytes in between, fill them and keep them
+ * - Allocate a block of 4 MBytes
+ * - Deallocate all memory
+ * - Do the same in the default mode
+ * 
+ * Results:
+ * - Expected     -> Every block should keep its contents
+ * - Expected     -> TLSF mode should be on in the run which asked for it and no malloc or free
+ *                   should take more than STEP_LIMIT steps there. Small blocks should come from
+ *                   the heap there too, i.e. no slab run should be in use
+ * - Expected     -> The default mode should walk over the segments to find room, which takes more
+ *                   than STEP_LIMIT steps
+ * 
+ ****************************************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <sys/wait.h>
+#include "hg_malloc.h"
+
+#define BIG_BLOCKS	200
+#define BIG_SIZE	(900 * 1024)
+#define BLOCKS		4000
+
+/* A thread cache moves 16 chunks at a time to or from the heap. Each one takes a bitmap lookup of two
+   scans, a free list removal, a split and a free list insertion, or two merges with a free list removal
+   each and a free list insertion. Anything else TLSF mode does takes fewer steps */
+#define STEP_LIMIT	(16 * 5)
+
+static unsigned char *big[BIG_BLOCKS];
+static unsigned char *ptrs[BLOCKS];
+
+static void churn(void)
+{
+	unsigned char *huge;
+	size_t size;
+	int i, k;
+
+	for (i = 0; i < BIG_BLOCKS; i++) {
+		big[i] = malloc(BIG_SIZE);
+		assert(big[i] != NULL);
+		memset(big[i], i & 0xff, BIG_SIZE);
+	}
+
+	for (i = 0; i < BIG_BLOCKS; i += 2)
+		free(big[i]);
+
+	for (i = 0; i < BLOCKS; i++) {
+		size = 16 + (i * 7919UL) % 60000;
+		ptrs[i] = malloc(size);
+		assert(ptrs[i] != NULL);
+		memset(ptrs[i], i & 0xff, size);
+	}
+
+	huge = malloc(4 << 20);
+	assert(huge != NULL);
+	memset(huge, 0xa5, 4 << 20);
+
+	for (i = 0; i < BLOCKS; i++) {
+		size = 16 + (i * 7919UL) % 60000;
+
+		for (k = 0; k < (int)size; k += 97)
+			assert(ptrs[i][k] == (i & 0xff));
+
+		free(ptrs[i]);
+	}
+
+	for (i = 1; i < BIG_BLOCKS; i += 2) {
+		for (k = 0; k < BIG_SIZE; k += 4096)
+			assert(big[i][k] == (i & 0xff));
+
+		free(big[i]);
+	}
+
+	free(huge);
+}
+
+int main(int argc, char *argv[])
+{
+	hg_malloc_stats_t stats;
+	int status;
+
+	if (argc > 1) {
+		churn();
+
+		hg_malloc_stats(&stats);
+		assert(stats.tlsf == 1 && stats.max_steps > 0 && stats.max_steps <= STEP_LIMIT);
+		assert(stats.slab_runs == 0);
+
+		return 0;
+	}
+
+	if (fork() == 0) {
+		setenv("HG_MALLOC_TLSF", "1", 1);
+		setenv("HG_MALLOC_STATS", "0", 1);
+		execl(argv[0], argv[0], "tlsf", NULL);
+		_exit(1);
+	}
+
+	wait(&status);
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	churn();
+
+	hg_malloc_stats(&stats);
+	printf("Max Steps : %zu\n", stats.max_steps);
+
+	if (!stats.tlsf)
+		assert(stats.max_steps > STEP_LIMIT);
+
+	return 0;
+}
@@ -0,0 +1,183 @@
+/**************************************************************************************************** 
+ * 
+ * Test Number 22 : Cache Colour Allocations
+ * 
+ * Description:
+ * - Restrict two threads to the lower and to the upper half of the cache colours
+ * - Allocate 1 to 2048 bytes 2000 times and 5000 to 16000 bytes 20 times from each thread, fill the
+ *   blocks and keep them
+ * - Grow a block of each thread from 100 to 3000 bytes
+ * - Allocate 100 bytes aligned to 256 bytes, and clear 1000 bytes with calloc where a filled block was
+ * - Deallocate all memory from the main thread
+ * - Restrict the main thread to every other colour, and allocate and deallocate 300000 bytes 200 times
+ * - Ask for colours the cache does not have, and lift the restriction
+ * 
+ * Results:
+ * - Sanity Check -> Heap usage at the end of program should be zero
+ * - Expected     -> Every page of every block should be of a colour of its thread, so that the two
+ *                   threads never share a colour, and every block should keep its contents
+ * - Expected     -> The grown blocks should keep their contents and colours
+ * - Expected     -> The aligned block should be aligned and the calloc block should be zeroed
+ * - Expected     -> Colour usage should be back to zero once everything is freed
+ * - Expected     -> No colour segments should be mapped after the first of the 300000 byte blocks
+ * - Expected     -> Colours the cache does not have should be refused with EINVAL
+ * 
+ ****************************************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+#include <malloc.h>
+#include "hg_malloc.h"
+
+#define THREADS	2
+#define BLOCKS	2000
+#define SPANS	20
+#define ROUNDS	200
+
+typedef struct {
+	unsigned long	mask;
+	unsigned char	*blocks[BLOCKS + SPANS];
+	size_t		sizes[BLOCKS + SPANS];
+	unsigned char	*grown;
+	void		*aligned;
+} task_t;
+
+static task_t tasks[THREADS];
+
+/* Every page the block touches must be of one of the given colours */
+static void check_colours(const unsigned char *ptr, size_t size, unsigned long mask)
+{
+	size_t off;
+
+	for (off = 0; off < size; off += 4096)
+		assert(mask & (1UL << hg_malloc_colour(ptr + off)));
+
+	assert(mask & (1UL << hg_malloc_colour(ptr + size - 1)));
+}
+
+static void *worker(void *arg)
+{
+	task_t		*task = arg;
+	unsigned char	*ptr, *zeroed;
+	size_t		size;
+	int		i, k;
+
+	assert(hg_malloc_colours(task->mask) == 0);
+
+	for (i = 0; i < BLOCKS + SPANS; i++) {
+		size = (i < BLOCKS) ? (size_t)(i % 2048 + 1) : (size_t)(5000 + (i - BLOCKS) * 550);
+		task->sizes[i] = size;
+		task->blocks[i] = malloc(size);
+		assert(task->blocks[i] != NULL && malloc_usable_size(task->blocks[i]) >= size);
+		memset(task->blocks[i], i & 0xff, size);
+	}
+
+	ptr = malloc(100);
+	memset(ptr, 0x5a, 100);
+	task->grown = realloc(ptr, 3000);
+
+	for (k = 0; k < 100; k++)
+		assert(task->grown[k] == 0x5a);
+
+	task->aligned = aligned_alloc(256, 100);
+	assert(task->aligned != NULL && (uintptr_t)task->aligned % 256 == 0);
+
+	/* Colour pages are reused, calloc must clear them */
+	ptr = malloc(1000);
+	memset(ptr, 0xff, 1000);
+	free(ptr);
+
+	zeroed = calloc(1, 1000);
+
+	for (k = 0; k < 1000; k++)
+		assert(zeroed[k] == 0);
+
+	check_colours(zeroed, 1000, task->mask);
+	free(zeroed);
+
+	return NULL;
+}
+
+int main(void)
+{
+	pthread_t		tids[THREADS];
+	hg_malloc_stats_t	stats;
+	unsigned long		all, mapped = 0;
+	unsigned char		*ptr;
+	int			i, j;
+	size_t			k;
+
+	if (hg_malloc_colours(0) < 0) {
+		assert(errno == ENOTSUP);
+		printf("Cache colours are not known\n");
+		return 0;
+	}
+
+	hg_malloc_stats(&stats);
+
+	printf("Cache Colours : %u of %zu kB (%s)\n", stats.colours, stats.colour_size >> 10,
+	       stats.colour_physical ? "Physical" : "Virtual");
+
+	all = (stats.colours >= 64) ? ~0UL : (1UL << stats.colours) - 1;
+	tasks[0].mask = all & ((1UL << (stats.colours / 2)) - 1);
+	tasks[1].mask = all & ~tasks[0].mask;
+
+	for (i = 0; i < THREADS; i++)
+		pthread_create(&tids[i], NULL, worker, &tasks[i]);
+
+	for (i = 0; i < THREADS; i++)
+		pthread_join(tids[i], NULL);
+
+	for (i = 0; i < THREADS; i++) {
+		for (j = 0; j < BLOCKS + SPANS; j++) {
+			check_colours(tasks[i].blocks[j], tasks[i].sizes[j], tasks[i].mask);
+
+			for (k = 0; k < tasks[i].sizes[j]; k++)
+				assert(tasks[i].blocks[j][k] == (j & 0xff));
+
+			free(tasks[i].blocks[j]);
+		}
+
+		check_colours(tasks[i].grown, 3000, tasks[i].mask);
+		check_colours(tasks[i].aligned, 100, tasks[i].mask);
+		free(tasks[i].grown);
+		free(tasks[i].aligned);
+	}
+
+	hg_malloc_stats(&stats);
+	assert(stats.colour_used == 0 && stats.colour_pages == 0);
+
+	/* Spans longer than a colour cannot be placed, and must not map segments over and over again */
+	assert(hg_malloc_colours(all & 0x5555555555555555UL) == 0);
+
+	for (i = 0; i < ROUNDS; i++) {
+		ptr = malloc(300000);
+		assert(ptr != NULL);
+		memset(ptr, i & 0xff, 300000);
+		free(ptr);
+
+		hg_malloc_stats(&stats);
+
+		if (i == 0)
+			mapped = stats.colour_segments;
+
+		assert(stats.colour_segments == mapped);
+	}
+
+	printf("Colour Segments : %zu\n", stats.colour_segments);
+
+	if (stats.colours < 64)
+		assert(hg_malloc_colours(1UL << stats.colours) == -1 && errno == EINVAL);
+
+	/* Without a restriction blocks come from the regular heap again */
+	assert(hg_malloc_colours(0) == 0);
+	ptr = malloc(100);
+	assert(hg_malloc_colour(ptr) >= 0);
+	free(ptr);
+
+	return 0;
+}
@@ -0,0 +1,123 @@
+/**************************************************************************************************** 
+ * 
+ * Test Number 23 : Fixed Heap Base
+ * 
+ * Description:
+ * - Run the test again twice with HG_MALLOC_BASE=0x200000000000, each run laid out by ASLR on its own
+ * - Allocate 3000 blocks of 1 to 3000 bytes, 20 blocks of 1 to 8 MBytes and 20 blocks aligned to
+ *   64 to 32768 bytes, and deallocate every third block
+ * - Grow 10 blocks up to 40 MBytes and allocate 1000 more blocks of 1 to 100000 bytes
+ * - Record the address of every block and deallocate all memory
+ * 
+ * Results:
+ * - Expected     -> Both runs should have their heap at the base asked for, and every block should lie
+ *                   above it
+ * - Expected     -> Both runs should hand out every block at the same address
+ * 
+ ****************************************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <sys/wait.h>
+#include "hg_malloc.h"
+
+#define BASE		0x200000000000UL
+#define SMALL		3000
+#define LARGE		20
+#define ALIGNED		20
+#define GROWN		10
+#define MORE		1000
+#define BLOCKS		(SMALL + LARGE + ALIGNED + GROWN + MORE)
+
+static void *ptrs[BLOCKS];
+static unsigned long addrs[BLOCKS];
+
+static void layout(void)
+{
+	hg_malloc_stats_t	stats;
+	int			i, n = 0;
+
+	for (i = 0; i < SMALL; i++)
+		ptrs[n++] = malloc(i + 1);
+
+	for (i = 0; i < LARGE; i++)
+		ptrs[n++] = malloc((1 + i % 8) << 20);
+
+	for (i = 0; i < ALIGNED; i++)
+		ptrs[n++] = aligned_alloc(64UL << (i % 10), 1000 + i * 100);
+
+	for (i = 0; i < n; i += 3) {
+		free(ptrs[i]);
+		ptrs[i] = NULL;
+	}
+
+	for (i = 0; i < GROWN; i++) {
+		ptrs[n] = malloc(100000);
+		ptrs[n] = realloc(ptrs[n], (4UL << 20) * (i + 1));
+		n++;
+	}
+
+	for (i = 0; i < MORE; i++)
+		ptrs[n++] = malloc(1 + (i * 7919UL) % 100000);
+
+	hg_malloc_stats(&stats);
+	assert(stats.fixed_base == (void *)BASE);
+
+	for (i = 0; i < n; i++) {
+		addrs[i] = (unsigned long)ptrs[i];
+		assert(ptrs[i] == NULL || addrs[i] >= BASE);
+		free(ptrs[i]);
+	}
+}
+
+/* Run the test again with a fixed base and collect the addresses it hands out */
+static void spawn(char *prog, unsigned long *out)
+{
+	size_t	len = 0;
+	ssize_t	ret;
+	int	fds[2], status;
+
+	assert(pipe(fds) == 0);
+
+	if (fork() == 0) {
+		dup2(fds[1], STDOUT_FILENO);
+		setenv("HG_MALLOC_BASE", "0x200000000000", 1);
+		setenv("HG_MALLOC_STATS", "0", 1);
+		execl(prog, prog, "fixed", NULL);
+		_exit(1);
+	}
+
+	close(fds[1]);
+
+	while ((ret = read(fds[0], (char *)out + len, BLOCKS * sizeof(*out) - len)) > 0)
+		len += ret;
+
+	close(fds[0]);
+	wait(&status);
+
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	assert(len == BLOCKS * sizeof(*out));
+}
+
+int main(int argc, char *argv[])
+{
+	static unsigned long first[BLOCKS], second[BLOCKS];
+
+	if (argc > 1) {
+		layout();
+		assert(write(STDOUT_FILENO, addrs, sizeof(addrs)) == sizeof(addrs));
+
+		return 0;
+	}
+
+	spawn(argv[0], first);
+	spawn(argv[0], second);
+
+	assert(memcmp(first, second, sizeof(first)) == 0);
+
+	printf("Same Layout Twice From : %p\n", (void *)BASE);
+
+	return 0;
+}
@@ -0,0 +1,203 @@
+/**************************************************************************************************** 
+ * 
+ * Test Number 24 : Remote Frees
+ * 
+ * Description:
+ * - Allocate 5000 blocks of 16 to 1000 bytes from a producer thread, fill them and keep the thread alive
+ * - Deallocate them from a consumer thread, and allocate and deallocate 5000 blocks of its own there
+ * - Allocate 5000 more blocks from the producer thread and deallocate them
+ * - Pass 100000 messages of 16 to 255 bytes from 2 producer threads to 2 consumer threads, which check
+ *   and deallocate them, with new producer threads taking over every 10000 messages
+ * 
+ * Results:
+ * - Expected     -> The blocks the consumer frees should go back to the producer, so that the consumer
+ *                   never gets them for its own blocks
+ * - Expected     -> Every block freed by the consumer should go through the remote queue of the producer
+ * - Expected     -> Every message should keep its contents, and slab usage should be back to zero once
+ *                   all of them are freed
+ * 
+ ****************************************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include "hg_malloc.h"
+
+#define BLOCKS		5000
+#define PAIRS		2
+#define MESSAGES	100000
+#define HANDOVER	10000
+#define RING		1024
+
+static unsigned char		*blocks[BLOCKS];
+static pthread_barrier_t	barrier;
+
+/* Messages travel from producers to consumers through a ring */
+static struct {
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	unsigned char	*slots[RING];
+	unsigned long	head;
+	unsigned long	tail;
+} ring = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, { NULL }, 0, 0 };
+
+static void *producer(void *arg)
+{
+	int i;
+
+	(void)arg;
+
+	for (i = 0; i < BLOCKS; i++) {
+		blocks[i] = malloc(16 + i % 985);
+		memset(blocks[i], i & 0xff, 16 + i % 985);
+	}
+
+	pthread_barrier_wait(&barrier);
+	pthread_barrier_wait(&barrier);
+
+	/* The blocks freed by the consumer are waiting on our queue */
+	for (i = 0; i < BLOCKS; i++)
+		blocks[i] = malloc(16 + i % 985);
+
+	for (i = 0; i < BLOCKS; i++)
+		free(blocks[i]);
+
+	return NULL;
+}
+
+static int compare(const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long *)a, y = *(const unsigned long *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void *consumer(void *arg)
+{
+	static unsigned long	freed[BLOCKS];
+	unsigned char		*ptr;
+	unsigned long		key;
+	int			i, k;
+
+	(void)arg;
+
+	pthread_barrier_wait(&barrier);
+
+	for (i = 0; i < BLOCKS; i++) {
+		for (k = 0; k < 16 + i % 985; k++)
+			assert(blocks[i][k] == (i & 0xff));
+
+		freed[i] = (unsigned long)blocks[i];
+		free(blocks[i]);
+	}
+
+	qsort(freed, BLOCKS, sizeof(freed[0]), compare);
+
+	for (i = 0; i < BLOCKS; i++) {
+		ptr = malloc(16 + i % 985);
+		key = (unsigned long)ptr;
+		assert(bsearch(&key, freed, BLOCKS, sizeof(freed[0]), compare) == NULL);
+		blocks[i] = ptr;
+	}
+
+	for (i = 0; i < BLOCKS; i++)
+		free(blocks[i]);
+
+	pthread_barrier_wait(&barrier);
+
+	return NULL;
+}
+
+static void *sender(void *arg)
+{
+	unsigned long	id = (unsigned long)arg, last = id + HANDOVER, end;
+	unsigned char	*msg;
+	size_t		size;
+	pthread_t	next;
+
+	end = (id / (MESSAGES / PAIRS) + 1) * (MESSAGES / PAIRS);
+
+	for (; id < last; id++) {
+		size = 16 + id % 240;
+		msg = malloc(size);
+		memset(msg, id & 0xff, size);
+		msg[0] = size;
+
+		pthread_mutex_lock(&ring.lock);
+
+		while (ring.head - ring.tail == RING)
+			pthread_cond_wait(&ring.cond, &ring.lock);
+
+		ring.slots[ring.head++ % RING] = msg;
+		pthread_cond_broadcast(&ring.cond);
+		pthread_mutex_unlock(&ring.lock);
+	}
+
+	/* Hand over to a new producer, while the messages of this one are still being freed */
+	if (id < end) {
+		assert(pthread_create(&next, NULL, sender, (void *)id) == 0);
+		pthread_join(next, NULL);
+	}
+
+	return NULL;
+}
+
+static void *receiver(void *arg)
+{
+	unsigned char	*msg;
+	size_t		k;
+	int		i;
+
+	(void)arg;
+
+	for (i = 0; i < MESSAGES / PAIRS; i++) {
+		pthread_mutex_lock(&ring.lock);
+
+		while (ring.head == ring.tail)
+			pthread_cond_wait(&ring.cond, &ring.lock);
+
+		msg = ring.slots[ring.tail++ % RING];
+		pthread_cond_broadcast(&ring.cond);
+		pthread_mutex_unlock(&ring.lock);
+
+		for (k = 1; k < msg[0]; k++)
+			assert(msg[k] == msg[1]);
+
+		free(msg);
+	}
+
+	return NULL;
+}
+
+int main(void)
+{
+	pthread_t		tids[2 * PAIRS];
+	hg_malloc_stats_t	stats;
+	int			i;
+
+	pthread_barrier_init(&barrier, NULL, 2);
+	pthread_create(&tids[0], NULL, producer, NULL);
+	pthread_create(&tids[1], NULL, consumer, NULL);
+	pthread_join(tids[0], NULL);
+	pthread_join(tids[1], NULL);
+
+	hg_malloc_stats(&stats);
+	printf("Remote Frees : %zu\n", stats.remote_frees);
+
+	if (stats.mallocs != 0)
+		assert(stats.remote_frees == BLOCKS);
+
+	for (i = 0; i < PAIRS; i++) {
+		pthread_create(&tids[2 * i], NULL, sender, (void *)(unsigned long)(i * (MESSAGES / PAIRS)));
+		pthread_create(&tids[2 * i + 1], NULL, receiver, NULL);
+	}
+
+	for (i = 0; i < 2 * PAIRS; i++)
+		pthread_join(tids[i], NULL);
+
+	hg_malloc_stats(&stats);
+	assert(stats.slab_used == 0);
+
+	return 0;
+}
@@ -0,0 +1,88 @@
+/**************************************************************************************************** 
+ * 
+ * Test Number 25 : Fork While Other Threads Allocate
+ * 
+ * Description:
+ * - Set the decay time to 0ms (HG_MALLOC_DECAY_MS=0), so that the purge thread takes the heap lock
+ *   all the time
+ * - Allocate and deallocate blocks of 16 bytes to 1 MByte from 2 threads, in a loop
+ * - Fork 200 times meanwhile, allocate and deallocate the same blocks in every child and let it exit
+ *
+ * Results:
+ * - Expected     -> Every child should exit on its own within 10 seconds, i.e. none of them should
+ *                   find a lock of the allocator held by a thread which it does not have
+ * 
+ ****************************************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+#define THREADS	2
+#define FORKS	200
+#define SIZES	6
+
+static const size_t sizes[SIZES] = { 16, 100, 1000, 5000, 100000, 1 << 20 };
+static volatile int stop;
+
+static void churn(void)
+{
+	void *ptrs[SIZES];
+	int i;
+
+	for (i = 0; i < SIZES; i++) {
+		ptrs[i] = malloc(sizes[i]);
+		assert(ptrs[i] != NULL);
+		memset(ptrs[i], i, sizes[i]);
+	}
+
+	for (i = 0; i < SIZES; i++)
+		free(ptrs[i]);
+}
+
+static void *worker(void *arg)
+{
+	(void)arg;
+
+	while (!stop)
+		churn();
+
+	return NULL;
+}
+
+int main(void)
+{
+	pthread_t tids[THREADS];
+	pid_t pid;
+	int i, status;
+
+	setenv("HG_MALLOC_DECAY_MS", "0", 1);
+
+	for (i = 0; i < THREADS; i++)
+		pthread_create(&tids[i], NULL, worker, NULL);
+
+	for (i = 0; i < FORKS; i++) {
+		pid = fork();
+		assert(pid >= 0);
+
+		if (pid == 0) {
+			/* A child stuck on a lock is killed instead of hanging the test */
+			alarm(10);
+			churn();
+			_exit(0);
+		}
+
+		assert(waitpid(pid, &status, 0) == pid);
+		assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	}
+
+	stop = 1;
+
+	for (i = 0; i < THREADS; i++)
+		pthread_join(tids[i], NULL);
+
+	return 0;
+}
@@ -1,6 +1,6 @@
 /**********************************************************************************
  *
- * Test Number 3 : Out of Memory (Restriction of the current version)
+ * Test Number 3 : Heap Growth Beyond One Huge Page
  *
  * Description:
  * - Allocate 950KB
@@ -8,14 +8,15 @@
  * - Allocate 512KB
  * 
  * Results:
- * - Santiy Check -> Program will exit
- * - Expected     -> First two allocation should succeed
- * - Expected     -> Thrid allocation should fail with message : "Out of Memory!"
+ * - Santiy Check -> Heap usage at the end of program should be zero
+ * - Expected     -> First two allocation should be served from the first huge page
+ * - Expected     -> Thrid allocation should succeed from a second segment i.e. Segments should be 2
  *
  *********************************************************************************/
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <assert.h>
 
 #define NUM_OF_ALLOCATIONS 3
 #define SIZE_OF_ALLOCATION 950 * 1024
@@ -36,6 +37,9 @@ int main(void)
 	/* Perform the last allocation */
 	ptr_array[2] = malloc(512 * 1024);
 
+	/* Make sure that the heap grew instead of failing */
+	assert(ptr_array[2] != NULL);
+
 	/* Now deallocate each pointer in the pointer array */
 	for (i = 0; i < NUM_OF_ALLOCATIONS ; i++) {
 		free(ptr_array[i]);
@@ -8,7 +8,7 @@
  * - Deallocate 1024 bytes
  *
  * Results:
- * - Sanity Check -> Heap size at the end of program should be 1024 + 512 + 2*40 (Trackers) = 1616 bytes
+ * - Sanity Check -> Heap size at the end of program should be 1024 + 512 + 2*16 (Aligned Trackers) = 1568 bytes
  * - Expected     -> Max heap usage should be 1024 + 512 = 1536 bytes
  * - Exp cted     -> Largest allocation should be 1024 bytes
  * 
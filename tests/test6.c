@@ -11,7 +11,7 @@
  * - Deallocate 512 bytes (4th allocation)
  *
  * Results:
- * - Sanity Check -> Heap usage at the end of program should be 1024 + 512 + 2*40 (Trackers) = 1616 bytes
+ * - Sanity Check -> Heap usage at the end of program should be 1024 + 512 + 2*16 (Aligned Trackers) = 1568 bytes
  * - Expected     -> Max heap usage should be 1024 + 512 + 1024 + 512 = 3072 bytes
  * - Expected     -> Largest allocation should be 1024 bytes
  *
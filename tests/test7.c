@@ -0,0 +1,58 @@
+/**************************************************************************************************** 
+ * 
+ * Test Number 7 : Splitting and Coalescing of Free Chunks
+ *
+ * Description:
+ * - Allocate 4096 bytes three times
+ * - Deallocate the first and the second allocation
+ * - Allocate 8192 bytes
+ * - Deallocate 8192 bytes
+ * - Allocate 2048 bytes twice
+ * - Deallocate all memory
+ *
+ * Results:
+ * - Sanity Check -> Heap usage at the end of program should be zero
+ * - Expected     -> The first two chunks are merged when freed so the 8192 bytes allocation should
+ *                   reuse the address of the first allocation
+ * - Expected     -> The merged chunk is split when reused so both 2048 bytes allocations should
+ *                   come out of it, back to back
+ * - Expected     -> Max heap usage should be 3 x 4096 = 12288 bytes
+ * - Expected     -> Largest allocation should be 8192 bytes
+ * 
+ ****************************************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+int main(void)
+{
+	char *ptr1, *ptr2, *ptr3, *ptr4, *ptr5, *ptr6;
+
+	/* Perform allocations one by one */
+	ptr1 = malloc(4096);
+	ptr2 = malloc(4096);
+	ptr3 = malloc(4096);
+
+	/* Free two neighbouring chunks */
+	free(ptr1);
+	free(ptr2);
+
+	/* The merged chunk should be large enough for twice the size */
+	ptr4 = malloc(8192);
+	assert(ptr4 == ptr1);
+
+	free(ptr4);
+
+	/* Both halves should be carved out of the merged chunk */
+	ptr5 = malloc(2048);
+	ptr6 = malloc(2048);
+	assert(ptr5 == ptr1);
+	assert(ptr6 > ptr5 && ptr6 < ptr3);
+
+	/* Now deallocate everything */
+	free(ptr5);
+	free(ptr6);
+	free(ptr3);
+
+	return 0;
+}
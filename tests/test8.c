@@ -0,0 +1,64 @@
+/**************************************************************************************************** 
+ * 
+ * Test Number 8 : Aligned Allocations
+ *
+ * Description:
+ * - Allocate 1, 13 and 100 bytes
+ * - Allocate 100 bytes aligned to 64 bytes with memalign
+ * - Allocate 1000 bytes aligned to 4096 bytes with posix_memalign
+ * - Allocate 4096 bytes aligned to 4096 bytes with aligned_alloc
+ * - Ask posix_memalign for an alignment which is not a power of two
+ * - Deallocate all memory
+ *
+ * Results:
+ * - Sanity Check -> Heap usage at the end of program should be zero
+ * - Expected     -> Every address returned by malloc should be 16 bytes aligned
+ * - Expected     -> Every aligned allocation should honour its alignment
+ * - Expected     -> posix_memalign should fail with EINVAL for the bad alignment
+ * - Expected     -> Largest allocation should be 4096 bytes
+ * 
+ ****************************************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <malloc.h>
+#include <assert.h>
+
+int main(void)
+{
+	char *ptr1, *ptr2, *ptr3, *ptr4, *ptr6;
+	void *ptr5, *bad = NULL;
+
+	/* Odd sized requests should not leave the next chunk misaligned */
+	ptr1 = malloc(1);
+	ptr2 = malloc(13);
+	ptr3 = malloc(100);
+	assert((uintptr_t)ptr1 % 16 == 0);
+	assert((uintptr_t)ptr2 % 16 == 0);
+	assert((uintptr_t)ptr3 % 16 == 0);
+
+	/* Cache line and page aligned blocks */
+	ptr4 = memalign(64, 100);
+	assert(ptr4 != NULL && (uintptr_t)ptr4 % 64 == 0);
+
+	assert(posix_memalign(&ptr5, 4096, 1000) == 0);
+	assert((uintptr_t)ptr5 % 4096 == 0);
+
+	ptr6 = aligned_alloc(4096, 4096);
+	assert(ptr6 != NULL && (uintptr_t)ptr6 % 4096 == 0);
+
+	/* Alignments which are not a power of two are refused */
+	assert(posix_memalign(&bad, 24, 100) == EINVAL);
+	assert(bad == NULL);
+
+	/* Now deallocate everything */
+	free(ptr6);
+	free(ptr5);
+	free(ptr4);
+	free(ptr3);
+	free(ptr2);
+	free(ptr1);
+
+	return 0;
+}
@@ -0,0 +1,62 @@
+/**************************************************************************************************** 
+ * 
+ * Test Number 9 : Resizing in Place
+ *
+ * Description:
+ * - Allocate 4096 bytes and fill it
+ * - Reallocate it to 8192 bytes
+ * - Allocate 4096 bytes twice
+ * - Deallocate the first of these two allocations
+ * - Reallocate the 8192 bytes block to 12288 bytes
+ * - Reallocate it to 20480 bytes
+ * - Deallocate all memory
+ *
+ * Results:
+ * - Sanity Check -> Heap usage at the end of program should be zero
+ * - Expected     -> The first block is the last chunk of the heap so it should grow without moving
+ * - Expected     -> The block is followed by a free chunk the second time so it should grow into it
+ *                   without moving
+ * - Expected     -> The block is followed by an allocated chunk the third time so it should move
+ * - Expected     -> The contents of the block should be preserved every time
+ * - Expected     -> Largest allocation should be 20480 bytes
+ * 
+ ****************************************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+int main(void)
+{
+	char *ptr1, *ptr2, *ptr3, *ptr4, *ptr5, *ptr6;
+	int i;
+
+	ptr1 = malloc(4096);
+	memset(ptr1, 0xab, 4096);
+
+	/* Grow into the top of the heap */
+	ptr2 = realloc(ptr1, 8192);
+	assert(ptr2 == ptr1);
+
+	/* Put a free chunk right after the block */
+	ptr3 = malloc(4096);
+	ptr4 = malloc(4096);
+	free(ptr3);
+
+	/* Grow into the free chunk */
+	ptr5 = realloc(ptr2, 12288);
+	assert(ptr5 == ptr1);
+
+	/* No room left in place */
+	ptr6 = realloc(ptr5, 20480);
+	assert(ptr6 != ptr1);
+
+	for (i = 0; i < 4096; i++)
+		assert((unsigned char)ptr6[i] == 0xab);
+
+	/* Now deallocate everything */
+	free(ptr6);
+	free(ptr4);
+
+	return 0;
+}
@@ -0,0 +1,552 @@
+/****************************************************************************************
+ *
+ * Tool : Trace Replay
+ *
+ * Description:
+ * - Read a trace recorded with the trace build of the allocator, e.g.
+ *     LD_PRELOAD=./libhgmalloc-trace.so HG_MALLOC_TRACE=app.trace <program>
+ * - Order the calls of every thread by their timestamps and turn the recorded pointers
+ *   into ids, so that the calls can be run against any allocator
+ * - Replay the calls once with hg_malloc and once with glibc malloc, which the -wrap
+ *   link flags still leave reachable as __real_malloc etc. Every recorded thread gets
+ *   a thread of its own, and a thread which frees a block allocated by another one
+ *   waits until that block exists. The tool runs itself once per allocator so that
+ *   every replay starts from a fresh process
+ * - Allocated blocks get one byte written per 4kB page, as the program would have
+ *   written them
+ * - Report the throughput, the peak memory footprint (resident and huge pages) over
+ *   the footprint before the replay, the fragmentation, i.e. the peak footprint over
+ *   the peak of the bytes asked for, and the latency percentiles of every call
+ *
+ * Usage:
+ * - hg_replay <trace file>
+ *
+ ****************************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "../hg_trace.h"
+
+/* Replay ops. Allocations of any kind share one latency histogram */
+#define OP_MALLOC		0
+#define OP_FREE			1
+#define OP_REALLOC		2
+#define OP_KINDS		3
+
+#define ID_NONE			0xffffffffU
+
+/* Blocks the replayed allocator failed to hand out */
+#define BLOCK_FAILED		((void *)1)
+
+/* The memory footprint is sampled every this many ops of each thread */
+#define SAMPLE_OPS		16384
+
+/* Latency histograms are log-linear in nanoseconds, see malloc_wrapper.c */
+#define LAT_SUB_BITS		3
+#define LAT_SUB			(1 << LAT_SUB_BITS)
+#define LAT_BUCKETS		((64 - LAT_SUB_BITS + 1) * LAT_SUB)
+
+/* One call to replay. It hands out the block id, and frees or resizes the block old */
+typedef struct {
+	uint64_t		size;
+	uint64_t		align;
+	uint32_t		id;
+	uint32_t		old;
+	uint16_t		thread;
+	uint8_t			op;
+	uint8_t			trace_op;
+} replay_op_t;
+
+typedef struct {
+	pthread_t		tid;
+	uint32_t		*ops;
+	unsigned long		count;
+	unsigned long		lat[OP_KINDS][LAT_BUCKETS];
+	unsigned long		max[OP_KINDS];
+} replay_thread_t;
+
+/* Entry of the table which maps live pointers to ids */
+typedef struct {
+	uint64_t		ptr;
+	uint32_t		id;
+} live_t;
+
+/* The allocators under test */
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+int __real_posix_memalign(void **memptr, size_t alignment, size_t size);
+void __real_free(void *ptr);
+
+static int hg_posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+	return posix_memalign(memptr, alignment, size);
+}
+
+static const struct {
+	const char	*name;
+	void		*(*malloc)(size_t);
+	void		*(*calloc)(size_t, size_t);
+	void		*(*realloc)(void *, size_t);
+	int		(*memalign)(void **, size_t, size_t);
+	void		(*free)(void *);
+} allocators[] = {
+	{ "hg_malloc",	malloc,		calloc,		realloc,	hg_posix_memalign,	free },
+	{ "glibc",	__real_malloc,	__real_calloc,	__real_realloc,	__real_posix_memalign,	__real_free },
+};
+
+#define ALLOCATORS	(sizeof(allocators) / sizeof(allocators[0]))
+
+static const char *kinds[OP_KINDS] = { "malloc", "free", "realloc" };
+
+static unsigned int	allocator;
+static replay_op_t	*ops;
+static void		**blocks;
+static replay_thread_t	*threads;
+static unsigned int	thread_count;
+static int		started;
+static unsigned long	peak_footprint;
+
+/* Bookkeeping comes straight from the kernel so that it does not disturb the allocator under test */
+static void *map_zeroed(unsigned long size)
+{
+	void *ptr = mmap(NULL, size ? size : 1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+
+	if (ptr == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+
+	return ptr;
+}
+
+static unsigned long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/* Resident memory plus huge pages, which are not counted as resident, in bytes */
+static unsigned long footprint(void)
+{
+	char		buf[4096], *line;
+	unsigned long	total = 0;
+	ssize_t		len;
+	int		fd;
+
+	fd = open("/proc/self/status", O_RDONLY);
+	if (fd < 0)
+		return 0;
+
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+
+	if (len <= 0)
+		return 0;
+
+	buf[len] = '\0';
+
+	if ((line = strstr(buf, "VmRSS:")) != NULL)
+		total += strtoul(line + 6, NULL, 10) * 1024;
+	if ((line = strstr(buf, "HugetlbPages:")) != NULL)
+		total += strtoul(line + 13, NULL, 10) * 1024;
+
+	return total;
+}
+
+static void sample_footprint(void)
+{
+	unsigned long current = footprint();
+	unsigned long peak = __atomic_load_n(&peak_footprint, __ATOMIC_RELAXED);
+
+	while (current > peak && !__atomic_compare_exchange_n(&peak_footprint, &peak, current, 0,
+							       __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static unsigned int lat_bucket(unsigned long value)
+{
+	unsigned int msb;
+
+	if (value < 2 * LAT_SUB)
+		return value;
+
+	msb = 63 - __builtin_clzl(value);
+
+	return (msb - LAT_SUB_BITS + 1) * LAT_SUB + ((value >> (msb - LAT_SUB_BITS)) & (LAT_SUB - 1));
+}
+
+static unsigned long lat_bucket_start(unsigned int bucket)
+{
+	if (bucket < 2 * LAT_SUB)
+		return bucket;
+
+	return (unsigned long)(LAT_SUB + bucket % LAT_SUB) << (bucket / LAT_SUB - 1);
+}
+
+/* Open addressing with linear probing. Removals shift the entries behind back into place */
+static live_t *live_find(live_t *table, unsigned long mask, uint64_t ptr)
+{
+	unsigned long slot = (ptr >> 4) * 0x9e3779b97f4a7c15UL & mask;
+
+	while (table[slot].ptr != 0 && table[slot].ptr != ptr)
+		slot = (slot + 1) & mask;
+
+	return &table[slot];
+}
+
+static void live_remove(live_t *table, unsigned long mask, live_t *entry)
+{
+	unsigned long	hole = entry - table, slot = hole, home;
+
+	for (;;) {
+		slot = (slot + 1) & mask;
+
+		if (table[slot].ptr == 0)
+			break;
+
+		home = (table[slot].ptr >> 4) * 0x9e3779b97f4a7c15UL & mask;
+
+		/* Move the entry into the hole unless its home lies between the hole and the entry */
+		if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+			table[hole] = table[slot];
+			hole = slot;
+		}
+	}
+
+	table[hole].ptr = 0;
+}
+
+static int record_compare(const void *a, const void *b)
+{
+	const trace_record_t *x = *(trace_record_t * const *)a, *y = *(trace_record_t * const *)b;
+
+	if (x->time != y->time)
+		return (x->time < y->time) ? -1 : 1;
+
+	/* Records which share a timestamp keep the order they have in the file */
+	return (x < y) ? -1 : (x > y);
+}
+
+/* Reads the trace and turns it into ops on ids, returns the number of ops */
+static unsigned long load_trace(const char *path, unsigned long *peak_live)
+{
+	trace_header_t		*header;
+	trace_record_t		*records, **order;
+	live_t			*live, *entry;
+	unsigned long		count = 0, mask, n, i, live_bytes = 0;
+	unsigned int		thread_map[4096];
+	uint64_t		*sizes;
+	uint32_t		ids = 0, id, old;
+	struct stat		st;
+	int			fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) != 0 || (unsigned long)st.st_size < TRACE_HEADER_SIZE) {
+		fprintf(stderr, "Cannot read trace %s\n", path);
+		exit(1);
+	}
+
+	header = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (header == MAP_FAILED || memcmp(header->magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0 ||
+	    header->version != TRACE_VERSION || header->record_size != sizeof(trace_record_t)) {
+		fprintf(stderr, "%s is not a trace of this version\n", path);
+		exit(1);
+	}
+
+	records = (trace_record_t *)((char *)header + TRACE_HEADER_SIZE);
+	n = (st.st_size - TRACE_HEADER_SIZE) / sizeof(trace_record_t);
+
+	order = map_zeroed(n * sizeof(*order));
+
+	for (i = 0; i < n; i++)
+		if (records[i].op != TRACE_OP_NONE)
+			order[count++] = &records[i];
+
+	qsort(order, count, sizeof(*order), record_compare);
+
+	/* Every live block is in the table at most once, and an allocation may free one implicitly */
+	for (mask = 1; mask < 2 * count; mask <<= 1);
+	live = map_zeroed(mask * sizeof(*live));
+	mask--;
+
+	ops = map_zeroed(2 * count * sizeof(*ops));
+	sizes = map_zeroed(count * sizeof(*sizes));
+	memset(thread_map, 0xff, sizeof(thread_map));
+	n = 0;
+
+	for (i = 0; i < count; i++) {
+		trace_record_t *record = order[i];
+
+		if (thread_map[record->thread] == ID_NONE)
+			thread_map[record->thread] = thread_count++;
+
+		old = ID_NONE;
+
+		if (record->op == TRACE_OP_FREE || record->op == TRACE_OP_REALLOC) {
+			/* Failed reallocs leave the block where it was */
+			if (record->op == TRACE_OP_REALLOC && record->ptr == 0 && record->size != 0)
+				continue;
+
+			entry = live_find(live, mask, record->op == TRACE_OP_FREE ? record->ptr : record->arg);
+
+			/* Blocks which were allocated before recording started are unknown */
+			if (entry->ptr != 0) {
+				old = entry->id;
+				live_bytes -= sizes[old];
+				live_remove(live, mask, entry);
+			}
+
+			if (record->op == TRACE_OP_FREE) {
+				if (old != ID_NONE)
+					ops[n++] = (replay_op_t){ .op = OP_FREE, .id = ID_NONE, .old = old,
+								  .thread = thread_map[record->thread] };
+				continue;
+			}
+		}
+
+		id = ID_NONE;
+
+		if (record->ptr != 0) {
+			entry = live_find(live, mask, record->ptr);
+
+			/* The free of a block which was handed out again may be stamped a little late */
+			if (entry->ptr != 0) {
+				live_bytes -= sizes[entry->id];
+				ops[n++] = (replay_op_t){ .op = OP_FREE, .id = ID_NONE, .old = entry->id,
+							  .thread = thread_map[record->thread] };
+				live_remove(live, mask, entry);
+				entry = live_find(live, mask, record->ptr);
+			}
+
+			id = ids++;
+			entry->ptr = record->ptr;
+			entry->id = id;
+			sizes[id] = record->size;
+			live_bytes += record->size;
+
+			if (live_bytes > *peak_live)
+				*peak_live = live_bytes;
+		} else if (record->op != TRACE_OP_REALLOC) {
+			/* Failed allocations are not replayed */
+			continue;
+		}
+
+		ops[n++] = (replay_op_t){ .op = (record->op == TRACE_OP_REALLOC) ? OP_REALLOC : OP_MALLOC,
+					  .trace_op = record->op, .size = record->size, .align = record->arg,
+					  .id = id, .old = old, .thread = thread_map[record->thread] };
+	}
+
+	blocks = map_zeroed((ids + 1) * sizeof(*blocks));
+
+	/* Hand every thread the ops it recorded, in order */
+	threads = map_zeroed(thread_count * sizeof(*threads));
+
+	for (i = 0; i < n; i++)
+		threads[ops[i].thread].count++;
+
+	for (id = 0; id < thread_count; id++) {
+		threads[id].ops = map_zeroed(threads[id].count * sizeof(uint32_t));
+		threads[id].count = 0;
+	}
+
+	for (i = 0; i < n; i++)
+		threads[ops[i].thread].ops[threads[ops[i].thread].count++] = i;
+
+	return n;
+}
+
+/* Waits until the thread which allocates the given block has done so */
+static void *wait_block(uint32_t id)
+{
+	void *block;
+
+	while ((block = __atomic_load_n(&blocks[id], __ATOMIC_ACQUIRE)) == NULL)
+		sched_yield();
+
+	return block;
+}
+
+static void touch(char *block, unsigned long size)
+{
+	unsigned long offset;
+
+	for (offset = 0; offset < size; offset += 4096)
+		block[offset] = 1;
+}
+
+static void *replay_thread(void *arg)
+{
+	replay_thread_t	*self = arg;
+	replay_op_t	*op;
+	unsigned long	i, start, elapsed;
+	void		*block, *old;
+	unsigned int	kind;
+
+	while (!__atomic_load_n(&started, __ATOMIC_ACQUIRE))
+		sched_yield();
+
+	for (i = 0; i < self->count; i++) {
+		op = &ops[self->ops[i]];
+		old = (op->old != ID_NONE) ? wait_block(op->old) : NULL;
+		block = NULL;
+		kind = op->op;
+
+		start = now_ns();
+
+		if (op->op == OP_FREE) {
+			if (old != BLOCK_FAILED)
+				allocators[allocator].free(old);
+		} else if (op->op == OP_REALLOC && old != NULL) {
+			block = allocators[allocator].realloc((old == BLOCK_FAILED) ? NULL : old, op->size);
+		} else if (op->trace_op == TRACE_OP_CALLOC) {
+			block = allocators[allocator].calloc(1, op->size);
+		} else if (op->trace_op == TRACE_OP_MEMALIGN && op->align > sizeof(void *)) {
+			if (allocators[allocator].memalign(&block, op->align, op->size) != 0)
+				block = NULL;
+		} else {
+			block = allocators[allocator].malloc(op->size);
+		}
+
+		elapsed = now_ns() - start;
+
+		self->lat[kind][lat_bucket(elapsed)]++;
+		if (elapsed > self->max[kind])
+			self->max[kind] = elapsed;
+
+		if (op->id != ID_NONE) {
+			if (block != NULL)
+				touch(block, op->size);
+
+			__atomic_store_n(&blocks[op->id], (block != NULL) ? block : BLOCK_FAILED, __ATOMIC_RELEASE);
+		}
+
+		if (i % SAMPLE_OPS == SAMPLE_OPS - 1)
+			sample_footprint();
+	}
+
+	return NULL;
+}
+
+static unsigned long percentile(const unsigned long *lat, unsigned long total, double fraction)
+{
+	unsigned long	seen = 0, rank = (unsigned long)(total * fraction);
+	unsigned int	bucket;
+
+	for (bucket = 0; bucket < LAT_BUCKETS; bucket++) {
+		seen += lat[bucket];
+
+		if (seen > rank)
+			return lat_bucket_start(bucket);
+	}
+
+	return 0;
+}
+
+/* Child run, replays the trace against one allocator and prints the results */
+static void run(const char *path)
+{
+	unsigned long	n, peak_live = 0, baseline, start, elapsed, total, max;
+	unsigned long	lat[LAT_BUCKETS];
+	unsigned int	t, kind, bucket;
+
+	n = load_trace(path, &peak_live);
+
+	for (t = 0; t < thread_count; t++)
+		pthread_create(&threads[t].tid, NULL, replay_thread, &threads[t]);
+
+	baseline = footprint();
+	peak_footprint = baseline;
+
+	start = now_ns();
+	__atomic_store_n(&started, 1, __ATOMIC_RELEASE);
+
+	for (t = 0; t < thread_count; t++)
+		pthread_join(threads[t].tid, NULL);
+
+	elapsed = now_ns() - start;
+	sample_footprint();
+
+	printf("%-10s %8u %12lu %12.1f %10.2f %12.1f %12.1f %8.2f\n", allocators[allocator].name, thread_count, n,
+	       elapsed / 1e6, n / (elapsed / 1e3), (peak_footprint - baseline) / 1048576.0, peak_live / 1048576.0,
+	       peak_live ? (double)(peak_footprint - baseline) / peak_live : 0);
+
+	for (kind = 0; kind < OP_KINDS; kind++) {
+		memset(lat, 0, sizeof(lat));
+		total = max = 0;
+
+		for (t = 0; t < thread_count; t++) {
+			for (bucket = 0; bucket < LAT_BUCKETS; bucket++)
+				lat[bucket] += threads[t].lat[kind][bucket];
+
+			if (threads[t].max[kind] > max)
+				max = threads[t].max[kind];
+		}
+
+		for (bucket = 0; bucket < LAT_BUCKETS; bucket++)
+			total += lat[bucket];
+
+		if (total == 0)
+			continue;
+
+		printf("%12s %10s %12lu %10lu %10lu %10lu %10lu\n", "", kinds[kind], total, percentile(lat, total, 0.5),
+		       percentile(lat, total, 0.99), percentile(lat, total, 0.999), max);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	char	arg[16];
+	int	status;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <trace file>\n", argv[0]);
+		return 1;
+	}
+
+	if (argc > 2) {
+		allocator = atoi(argv[2]);
+		run(argv[1]);
+		return 0;
+	}
+
+	printf("%-10s %8s %12s %12s %10s %12s %12s %8s\n", "Allocator", "Threads", "Ops", "Time (ms)", "Mops/s",
+	       "Peak (MB)", "Live (MB)", "Frag");
+	printf("%12s %10s %12s %10s %10s %10s %10s\n", "", "Latency", "Calls", "p50 (ns)", "p99 (ns)", "p99.9 (ns)",
+	       "Max (ns)");
+
+	for (allocator = 0; allocator < ALLOCATORS; allocator++) {
+		fflush(stdout);
+
+		if (fork() == 0) {
+			snprintf(arg, sizeof(arg), "%u", allocator);
+			execl(argv[0], argv[0], argv[1], arg, NULL);
+			_exit(1);
+		}
+
+		wait(&status);
+
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			fprintf(stderr, "Replay with %s failed\n", allocators[allocator].name);
+			return 1;
+		}
+	}
+
+	return 0;
+}